@@ -49,9 +49,19 @@ of this distribution.
 */
 
 /* System includes */
+#if defined(linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
+#include <errno.h>
+#ifdef linux
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 /* EPICS includes */
 #include <drvIpac.h>
@@ -63,60 +73,28 @@ of this distribution.
 #include <epicsTimer.h>
 #include <epicsExit.h>
 #include <epicsMutex.h>
-#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+#include <epicsAtomic.h>
+#include <epicsInterrupt.h>
 #include <cantProceed.h>
 #include <asynDriver.h>
 #include <asynInt32.h>
 #include <asynFloat64.h>
+#include <asynInt16Array.h>
 #include <asynInt32Array.h>
+#include <asynFloat32Array.h>
+#include <asynFloat64Array.h>
 #include <asynDrvUser.h>
 #include <devLib.h>
 
 /* Custom includes */
 #include "drvIp330.h" 
-
-/* Control register bits */
-#define CTL_OUTPUT_SHIFT              1
-#define CTL_OUTPUT_MASK             0x0002
-#define CTL_OUTPUT_TWOS_COMPLEMENT  0x0000
-#define CTL_OUTPUT_STRAIGHT_BINARY  0x0002
-
-#define CTL_TRIGGER_SHIFT             2
-#define CTL_TRIGGER_MASK            0x0004
-#define CTL_TRIGGER_INPUT           0x0000
-#define CTL_TRIGGER_OUTPUT          0x0004
-
-#define CTL_INPUT_SHIFT               3
-#define CTL_INPUT_MASK              0x0038
-#define CTL_INPUT_DIFFERENTIAL      0x0000
-#define CTL_INPUT_SINGLE_ENDED      0x0008
-#define CTL_INPUT_4900MV            0x0018
-#define CTL_INPUT_2450MV            0x0020
-#define CTL_INPUT_1225MV            0x0028
-#define CTL_INPUT_612MV             0x0030
-#define CTL_INPUT_AUTO_ZERO         0x0038
-
-#define CTL_SCAN_SHIFT                8
-#define CTL_SCAN_MASK               0x0700
-#define CTL_SCAN_DISABLE            0x0000
-#define CTL_SCAN_UNIFORM_CONTINUOUS 0x0100
-#define CTL_SCAN_UNIFORM_SINGLE     0x0200
-#define CTL_SCAN_BURST_CONTINUOUS   0x0300
-#define CTL_SCAN_BURST_SINGLE       0x0400
-#define CTL_SCAN_EXTERNAL           0x0500
-
-#define CTL_TIMER_SHIFT              11
-#define CTL_TIMER_MASK              0x0800
-#define CTL_TIMER_DISABLE           0x0000
-#define CTL_TIMER_ENABLE            0x0800
-
-#define CTL_INTERRUPT_SHIFT          12
-#define CTL_INTERRUPT_MASK          0x3000
-#define CTL_INTERRUPT_DISABLE       0x0000
-#define CTL_INTERRUPT_AFTER_EACH    0x1000
-#define CTL_INTERRUPT_AFTER_ALL     0x2000
-
-#define DISABLE_SCAN_AND_INTERRUPT ~(CTL_SCAN_MASK | CTL_INTERRUPT_MASK) 
+#include "ip330Correct.h"
+#include "ip330Filter.h"
+#include "ip330Regs.h"
+#include "ip330Recorder.h"
+#include "ip330Sim.h"
+#include "ip330Spectrum.h"
 
 #define ACROMAG_ID 0xa3
 #define ACRO_IP330 0x11
@@ -127,13 +105,50 @@ of this distribution.
 #define MICROSECONDS_PER_SCAN 1000
 #define SECONDS_BETWEEN_CALIBRATE 0
 
-/* Message queue size */
-#define MAX_MESSAGES 100
-
-#define MAX_IP330_CHANNELS 32
+/* Number of scan frames in the ring between intFunc and intTask.
+ * Must be a power of 2 */
+#define FRAME_RING_SIZE 256
 
 #define MAX_IP330_CARDS 256
 
+/* Scan processing is done by a pool of dispatch workers shared by all
+ * cards.  The default number of workers is the number of CPUs, up to
+ * MAX_DISPATCH_WORKERS.  A worker processes at most DISPATCH_BATCH frames
+ * of one card before it looks at its other cards. */
+#define MAX_DISPATCH_WORKERS 16
+#define DISPATCH_BATCH 16
+
+/* Maximum number of scans per block in block mode */
+#define MAX_BLOCK_SIZE 100000
+
+/* Maximum number of scans in the capture history */
+#define MAX_CAPTURE_DEPTH 1000000
+
+/* Range of SPECTRUM_SIZE, powers of 2.  The ring between intTask and the
+ * spectrum thread holds SPECTRUM_RING_BLOCKS blocks of each channel, so
+ * the thread can fall that far behind before blocks are skipped. */
+#define MIN_SPECTRUM_SIZE 16
+#define MAX_SPECTRUM_SIZE 65536
+#define SPECTRUM_RING_BLOCKS 4
+#define MAX_SPECTRUM_AVERAGES 10000
+
+/* Maximum number of scans in a statistics window */
+#define MAX_STAT_WINDOW 100000000
+
+/* Default number of scans per recorder segment file */
+#define RECORDER_SEGMENT_SCANS 1000000
+
+/* Time for one conversion in a burst */
+#define CONVERSION_MICROSECONDS 15.
+
+/* waitNewData spins this many times before it starts sleeping, then sleeps
+ * for at most WAIT_POLL_SECONDS at a time.  The timeout is WAIT_MARGIN
+ * times the expected conversion time, but at least WAIT_MIN_SECONDS. */
+#define WAIT_SPIN_COUNT 1000
+#define WAIT_POLL_SECONDS 0.001
+#define WAIT_MARGIN 4.
+#define WAIT_MIN_SECONDS 0.01
+
 typedef struct {
     ip330Command command;
     char *commandString;
@@ -141,10 +156,54 @@ typedef struct {
 
 static ip330CommandStruct ip330Commands[MAX_IP330_COMMANDS] = {
     {ip330Data,            "DATA"},
+    {ip330Average,         "AVERAGE"},
+    {ip330BlockSize,       "BLOCK_SIZE"},
+    {ip330BlockData,       "BLOCK_DATA"},
+    {ip330BlockInterleaved,"BLOCK_INTERLEAVED"},
     {ip330Gain,            "GAIN"},
     {ip330ScanPeriod,      "SCAN_PERIOD"},
     {ip330CalibratePeriod, "CALIBRATE_PERIOD"},
-    {ip330ScanMode,        "SCAN_MODE"}
+    {ip330CalibrateGap,    "CALIBRATE_GAP"},
+    {ip330ScanMode,        "SCAN_MODE"},
+    {ip330RingDepth,       "RING_DEPTH"},
+    {ip330RingHighWater,   "RING_HIGH_WATER"},
+    {ip330RingOverruns,    "RING_OVERRUNS"},
+    {ip330LatencyQueue,    "LATENCY_QUEUE"},
+    {ip330LatencyCorrect,  "LATENCY_CORRECT"},
+    {ip330LatencyCallback, "LATENCY_CALLBACK"},
+    {ip330LatencyTotal,    "LATENCY_TOTAL"},
+    {ip330ScanJitter,      "SCAN_JITTER"},
+    {ip330HistogramReset,  "HISTOGRAM_RESET"},
+    {ip330MissedData,      "MISSED_DATA"},
+    {ip330PingPongErrors,  "PING_PONG_ERRORS"},
+    {ip330CaptureDepth,    "CAPTURE_DEPTH"},
+    {ip330CapturePost,     "CAPTURE_POST"},
+    {ip330CaptureState,    "CAPTURE_STATE"},
+    {ip330CaptureData,     "CAPTURE_DATA"},
+    {ip330Filtered,        "FILTERED"},
+    {ip330FilterBiquad,    "FILTER_BIQUAD"},
+    {ip330FilterFir,       "FILTER_FIR"},
+    {ip330SpectrumSize,    "SPECTRUM_SIZE"},
+    {ip330SpectrumWindow,  "SPECTRUM_WINDOW"},
+    {ip330SpectrumAverages, "SPECTRUM_AVERAGES"},
+    {ip330SpectrumMagnitude, "SPECTRUM_MAGNITUDE"},
+    {ip330SpectrumPsd,     "SPECTRUM_PSD"},
+    {ip330SpectrumFreq,    "SPECTRUM_FREQ"},
+    {ip330StatWindow,      "STAT_WINDOW"},
+    {ip330StatMean,        "STAT_MEAN"},
+    {ip330StatRms,         "STAT_RMS"},
+    {ip330StatStdDev,      "STAT_STDDEV"},
+    {ip330StatMin,         "STAT_MIN"},
+    {ip330StatMax,         "STAT_MAX"},
+    {ip330Egu,             "EGU"},
+    {ip330EguSlope,        "EGU_SLOPE"},
+    {ip330EguOffset,       "EGU_OFFSET"},
+    {ip330FirstChan,       "FIRST_CHAN"},
+    {ip330LastChan,        "LAST_CHAN"},
+    {ip330Deadband,        "DEADBAND"},
+    {ip330DeadbandEgu,     "DEADBAND_EGU"},
+    {ip330DeadbandHeartbeat, "DEADBAND_HEARTBEAT"},
+    {ip330DeadbandSuppressed, "DEADBAND_SUPPRESSED"}
 };
 
 typedef enum {differential, singleEnded} signalType;
@@ -154,6 +213,69 @@ typedef enum {input, output} triggerType;
 
 typedef enum{typeInt32, typeFloat64, typeInt32Array} dataType;
 
+/* State of the incremental calibration engine in intFunc */
+typedef enum {calIdle, calSettle, calMeasure} calStateType;
+
+/* Interrupt dispatch tables, one per interface for intTask.  The ones
+ * after dispatchFloat64Array are second tables of the clients of an
+ * interface for a background thread, so that it never rebuilds a table
+ * intTask is reading: dispatchSpectrum for the spectrum thread and
+ * dispatchCapture* for the capture thread.  dispatchInterface gives the
+ * interface of each table. */
+typedef enum {dispatchInt32, dispatchFloat64, dispatchInt16Array,
+              dispatchInt32Array, dispatchFloat32Array,
+              dispatchFloat64Array, dispatchSpectrum,
+              dispatchCaptureInt32, dispatchCaptureInt32Array,
+              dispatchCaptureFloat32Array} dispatchType;
+#define nDispatchTypes 10
+
+static const dispatchType dispatchInterface[nDispatchTypes] = {
+    dispatchInt32, dispatchFloat64, dispatchInt16Array, dispatchInt32Array,
+    dispatchFloat32Array, dispatchFloat64Array, dispatchFloat64Array,
+    dispatchInt32, dispatchInt32Array, dispatchFloat32Array};
+
+/* One bucket per channel, plus one for clients with addr out of range */
+#define DISPATCH_BUCKETS (MAX_IP330_CHANNELS+1)
+#define DISPATCH_INDEX_SIZE (MAX_IP330_COMMANDS*DISPATCH_BUCKETS + 2)
+
+/* Initial size of the clients[] array of a dispatch table */
+#define DISPATCH_MIN_CLIENTS 16
+
+/* A clients[] array handed between a registering thread and the owner of
+ * a dispatch table */
+typedef struct ip330ClientArray {
+    int size;
+    void **clients;
+} ip330ClientArray;
+
+/* Precomputed interrupt client table for one interface.  clients[] holds the
+ * asynXXXInterrupt pointers sorted by reason and then addr.  The clients for
+ * (reason, addr) are clients[dispatchFirst(pd, reason, addr)] up to but not
+ * including clients[dispatchFirst(pd, reason, addr+1)].
+ * The table is rebuilt by its owner when a client registers or cancels.
+ * The owner never allocates.  Registering threads count the clients in
+ * reserved and allocate a bigger array, before the client is added, when
+ * there would not be room in allocated.  They hand it to the owner in
+ * spare, which swaps it in at the next rebuild and hands the old array
+ * back in retired, see handoffPut.  reserved and allocated are only used
+ * with lock held. */
+typedef struct ip330Dispatch {
+    void *interruptPvt;
+    int dirty;
+    int nRegistered;
+    int nListed;
+    int maxClients;
+    void **clients;
+    int reserved;
+    int allocated;
+    EpicsAtomicPtrT spare;
+    EpicsAtomicPtrT retired;
+    int index[DISPATCH_INDEX_SIZE];
+} ip330Dispatch;
+
+#define dispatchFirst(pd, reason, addr) \
+    ((pd)->index[(reason)*DISPATCH_BUCKETS + (addr)])
+
 #define nRanges 4
 #define nGains 4
 #define nTriggers 2
@@ -163,21 +285,6 @@ static const char *triggerName[nTriggers] = {"Input", "Output"};
 static const double pgaGain[nGains] = {1.0,2.0,4.0,8.0};
 static void rebootCallback(void *drvPvt);
 
-typedef struct ip330ADCregs {
-    unsigned short control;
-    unsigned char timePrescale;
-    unsigned char intVector;
-    unsigned short conversionTime;
-    unsigned char endChanVal;
-    unsigned char startChanVal;
-    unsigned short newData[2];
-    unsigned short missedData[2];
-    unsigned short startConvert;
-    unsigned char pad[0x0E];
-    unsigned char gain[MAX_IP330_CHANNELS];
-    unsigned short mailBox[MAX_IP330_CHANNELS];
-} ip330ADCregs;
-
 typedef struct ip330ADCSettings {
     double volt_callo;
     double volt_calhi;
@@ -185,11 +292,26 @@ typedef struct ip330ADCSettings {
     unsigned char ctl_calhi;
     double ideal_span;
     double ideal_zero;
-    double adj_slope;
-    double adj_offset;
     int gain;
 } ip330ADCSettings;
 
+/* Calibration result for one gain.  It depends only on the range, which is
+ * fixed for a port, and the gain, so it is shared by all channels with
+ * that gain. */
+typedef struct ip330GainCalibration {
+    int valid;
+    epicsTimeStamp time;
+    double adj_slope;
+    double adj_offset;
+} ip330GainCalibration;
+
+/* Calibration coefficients, kept as separate arrays so that correctAll
+ * can run a vector kernel over the active channels */
+typedef struct ip330Coefficients {
+    double adj_slope[MAX_IP330_CHANNELS];
+    double adj_offset[MAX_IP330_CHANNELS];
+} ip330Coefficients;
+
 typedef struct calibrationSetting {
     double volt_callo;
     double volt_calhi;
@@ -199,6 +321,104 @@ typedef struct calibrationSetting {
     double ideal_zero;
 } calibrationSetting;
 
+/* CPU affinity and scheduling for a driver thread, set with
+ * ip330SetThreadPolicy.  The thread applies it to itself when pending is
+ * set, and records the result in status (0 or an errno value). */
+typedef struct ip330ThreadPolicy {
+    volatile int pending;
+    int applied;
+    char cpuList[64];
+#ifdef linux
+    cpu_set_t cpuSet;
+#endif
+    int priority;
+    int status;
+} ip330ThreadPolicy;
+
+/* A dispatch worker thread.  Each card is assigned to one worker, which is
+ * woken by the card's interrupt routine.  A worker with nothing to do for
+ * its own cards steals from cards whose worker is busy with another card.
+ * A card is only processed by one worker at a time, see serviceCard. */
+typedef struct ip330Worker {
+    int index;
+    epicsThreadId threadId;
+    epicsEventId eventId;
+    volatile int busy;
+    int nCards;
+    unsigned long batches;
+    unsigned long steals;
+} ip330Worker;
+
+/* Per-asynUser state for the AVERAGE command.  Holds the running totals
+ * at the time of the previous read by this client. */
+typedef struct ip330AverageUser {
+    double sum;
+    unsigned int count;
+} ip330AverageUser;
+
+/* Block buffers for one block size, see drvIp330Pvt */
+typedef struct ip330BlockBuffers {
+    int size;
+    epicsInt32 *data;
+    epicsInt32 *interleaved;
+    epicsFloat32 *float32;
+} ip330BlockBuffers;
+
+/* Capture history for one depth, see drvIp330Pvt.  intTask fills raw,
+ * the capture thread corrects it into data[(generation + 1)&1] and then
+ * increments generation to publish scans[] and time[] of that set. */
+typedef struct ip330CaptureBuffers {
+    int depth;
+    epicsUInt16 *raw;
+    epicsInt32 *data[2];
+    int scans[2];
+    epicsTimeStamp time[2];
+    volatile unsigned int generation;
+    epicsFloat32 *float32;
+} ip330CaptureBuffers;
+
+/* Spectrum ring buffers for one block size, see drvIp330Pvt */
+typedef struct ip330SpectrumBuffers {
+    int size;
+    epicsInt32 *ring;
+    epicsTimeStamp *time;
+} ip330SpectrumBuffers;
+
+/* drvUser of a DATA, FILTERED or EGU client created with rate options,
+ * e.g. "DATA?rate=10Hz&average".  Only intTask uses it after drvUserCreate.
+ * The client gets every decimate scans, or at most every period seconds,
+ * the latest value or the average of the scans since its last callback. */
+typedef struct ip330RateUser {
+    int decimate;
+    double period;
+    int average;
+    int scans;
+    double sum;
+    epicsTimeStamp nextTime;
+} ip330RateUser;
+
+/* One scan of raw mailbox values.  intFunc writes these directly into the
+ * frame ring and intTask consumes them in place.  time is when the
+ * interrupt routine was entered.  follows is set if the previous scan is
+ * also in the ring, with no dropped scan or calibration burst between them. */
+typedef struct ip330Frame {
+    epicsUInt16 data[MAX_IP330_CHANNELS];
+    epicsTimeStamp time;
+    int follows;
+} ip330Frame;
+
+/* Histograms of the time spent in each stage of the scan path.  The order
+ * must match ip330LatencyQueue ... ip330ScanJitter in drvIp330.h.  Only
+ * intTask writes them, readers copy them without a lock. */
+typedef enum {histQueue, histCorrect, histCallback, histTotal,
+              histJitter} histogramType;
+#define nHistograms 5
+
+typedef struct ip330Histogram {
+    epicsInt32 counts[IP330_HISTOGRAM_BUCKETS];
+    double max;
+} ip330Histogram;
+
 static calibrationSetting calibrationSettings[nRanges][nGains] = {
     {   {0.0000, 4.9000,  0x38,  0x18, 10.0,  -5.0},
         {0.0000, 2.4500,  0x38,  0x20, 10.0,  -5.0},
@@ -223,14 +443,101 @@ typedef struct drvIp330Pvt {
     asynUser *pasynUser;
     ushort_t carrier;
     ushort_t slot;
+    ip330Sim *pSim;
     epicsTimerId timerId;
     epicsMutexId lock;
     signalType type;
     int range;
     volatile ip330ADCregs* regs;
     ip330ADCSettings *chanSettings;
+    /* Double-buffered calibration coefficients.  coefficients[coefGeneration&1]
+     * is the published set.  Writers hold lock, fill the other set and then
+     * increment coefGeneration.  The scan path never takes the lock, it
+     * retries if the generation changed while it was correcting. */
+    ip330Coefficients coefficients[2];
+    volatile unsigned int coefGeneration;
+    ip330GainCalibration gainCalibration[nGains];
+    /* Incremental calibration.  Each step measures one reference input
+     * for one gain with a settle burst followed by a measurement burst.
+     * intFunc starts a step right after a normal scan and restores normal
+     * scanning when the measurement burst completes.  intTask computes the
+     * coefficients once both references of a gain have been measured.
+     * calGainMask has a bit for each gain still to be done in this pass. */
+    struct ip330Worker *pWorker;
+    volatile int calPassActive;
+    volatile int calBlocking;
+    volatile calStateType calState;
+    int calGainMask;
+    int calGain;
+    int calHigh;
+    unsigned short calSaveControl;
+    unsigned char calSaveStartChanVal;
+    unsigned char calSaveEndChanVal;
+    unsigned long calSumLo;
+    volatile int calResultReady;
+    int calResultGain;
+    unsigned long calResultLo;
+    unsigned long calResultHi;
+    epicsTimeStamp calStepStart;
+    epicsTimeStamp calStepEnd;
+    volatile unsigned int calSteps;
+    unsigned int calStepsSeen;
+    double calLastGap;
+    double calMaxGap;
+    /* Signalled by calibrateInterrupt when a step returns to calIdle */
+    epicsEventId calIdleEventId;
+    /* Blocking calibration.  Once interrupts are enabled, calibrate asks
+     * for an interrupt at the end of each burst and intFunc signals
+     * calEventId instead of reading the data. */
+    int irqEnabled;
+    volatile int calWaiting;
+    epicsEventId calEventId;
     int chanData[MAX_IP330_CHANNELS];
     int correctedData[MAX_IP330_CHANNELS];
+    /* Filter stage.  Writers change requestedFilter with lock held and
+     * publish it as for coefficients, in publishedFilter[(filterGeneration
+     * + 1)&1] before incrementing filterGeneration.  intTask copies the
+     * published set into filter without the lock, retrying if the
+     * generation changed meanwhile.  Only intTask uses filter, and it
+     * primes the channels whose serial changed. */
+    ip330FilterCoefficients requestedFilter;
+    ip330FilterCoefficients publishedFilter[2];
+    volatile unsigned int filterGeneration;
+    unsigned int filterGenerationSeen;
+    ip330FilterCoefficients filter;
+    ip330FilterState filterState;
+    double filteredData[MAX_IP330_CHANNELS];
+    /* Engineering units, eguData = eguOffset + eguSlope * correctedData.
+     * Writers change requestedEguSlope and requestedEguOffset with lock
+     * held and publish them as for filter, in published*[(eguGeneration
+     * + 1)&1], and intTask copies them without the lock.  eguCustom is set
+     * for channels whose scaling was written, the others are volts at the
+     * input and are updated by setGainPrivate. */
+    double requestedEguSlope[MAX_IP330_CHANNELS];
+    double requestedEguOffset[MAX_IP330_CHANNELS];
+    int eguCustom[MAX_IP330_CHANNELS];
+    double publishedEguSlope[2][MAX_IP330_CHANNELS];
+    double publishedEguOffset[2][MAX_IP330_CHANNELS];
+    volatile unsigned int eguGeneration;
+    unsigned int eguGenerationSeen;
+    double eguSlope[MAX_IP330_CHANNELS];
+    double eguOffset[MAX_IP330_CHANNELS];
+    double eguData[MAX_IP330_CHANNELS];
+    /* Deadband in corrected counts and heartbeat in seconds, written with
+     * lock held.  deadbandChans counts the channels with a deadband, so
+     * that intTask skips the test when there are none.  The others belong
+     * to intTask, except deadbandSuppressed which readInt32 reads. */
+    double deadband[MAX_IP330_CHANNELS];
+    double deadbandHeartbeat[MAX_IP330_CHANNELS];
+    volatile int deadbandChans;
+    int deadbandLast[MAX_IP330_CHANNELS];
+    epicsTimeStamp deadbandLastTime[MAX_IP330_CHANNELS];
+    int deadbandSend[MAX_IP330_CHANNELS];
+    unsigned int deadbandSuppressed[MAX_IP330_CHANNELS];
+    /* The scan of the active channels only, firstChan first, for the
+     * DATA int16Array and float32Array clients */
+    epicsInt16 compactInt16[MAX_IP330_CHANNELS];
+    epicsFloat32 compactFloat32[MAX_IP330_CHANNELS];
     int firstChan;
     int lastChan;
     scanModeType scanMode;
@@ -238,34 +545,216 @@ typedef struct drvIp330Pvt {
     int secondsBetweenCalibrate;
     int rebooting;
     int mailBoxOffset;
-    epicsMessageQueueId intMsgQId;
-    int messagesSent;
-    int messagesFailed;
+    /* Single-producer (intFunc), single-consumer (intTask) frame ring.
+     * ringHead is only written by intFunc, ringTail only by intTask. */
+    ip330Frame *frameRing;
+    unsigned int ringMask;
+    volatile unsigned int ringHead;
+    volatile unsigned int ringTail;
+    int claimed;
+    unsigned int stealHint;
+    int ringHighWater;
+    int ringOverruns;
+    int framesReceived;
+    /* Set by anything that interrupts the regular sequence of scans, so
+     * that the next frame is not used for the jitter histogram */
+    volatile int scanBreak;
+    epicsTimeStamp lastFrameTime;
+    ip330Histogram histograms[nHistograms];
+    volatile int histogramReset;
+    /* Overruns seen in the card's missedData registers.  intFunc writes the
+     * counts, intTask does callbacks when missedTotal or pingPongErrors
+     * changes.  missedDataStale is set when calibration has used the
+     * mailboxes, so the bits after it are not counted. */
+    int missedData[MAX_IP330_CHANNELS];
+    volatile unsigned int missedTotal;
+    unsigned int missedTotalSeen;
+    volatile int pingPongErrors;
+    int pingPongErrorsSeen;
+    int missedDataStale;
+    /* Block mode.  blockData holds blockSize scans of each active channel,
+     * channel-major.  Writes of BLOCK_SIZE allocate the buffers for the
+     * new size and hand them to intTask in blockNew.  intTask swaps them in
+     * at the start of the next block and hands the old ones back in
+     * blockOld, for the port thread to free.  See handoffPut. */
+    int blockSize;
+    int requestedBlockSize;
+    int blockCount;
+    epicsInt32 *blockData;
+    epicsInt32 *blockInterleaved;
+    epicsFloat32 *blockFloat32;
+    EpicsAtomicPtrT blockNew;
+    EpicsAtomicPtrT blockOld;
+    /* Capture history.  pCapture->raw is a circular buffer of
+     * captureDepth raw scans of the active channels, scan-major, filled by
+     * intTask while armed.  captureRequest is set by writes of
+     * CAPTURE_STATE and handled by intTask.  When the history freezes,
+     * intTask copies the coefficients in use into captureCoefficients,
+     * sets captureFrozen and wakes the capture thread.  The thread
+     * corrects the history into pCapture->data, channel-major, oldest scan
+     * first, publishes it, sets captureState to done, does the callbacks
+     * and clears captureFrozen.  Until then intTask leaves pCapture and
+     * captureState alone.  Writes of CAPTURE_DEPTH allocate the buffers
+     * for the new depth and hand them to intTask in captureNew.  intTask
+     * swaps them in when it next arms, and hands the old ones back in
+     * captureOld, see handoffPut. */
+    int captureDepth;
+    int requestedCaptureDepth;
+    int capturePost;
+    volatile int captureRequest;
+    volatile ip330CaptureStateType captureState;
+    int captureHead;
+    int captureFilled;
+    int captureRemaining;
+    ip330CaptureBuffers *pCapture;
+    epicsTimeStamp captureTime;
+    epicsTimeStamp captureFreezeTime;
+    volatile int captureFrozen;
+    int captureUncalibrated;
+    ip330Coefficients captureCoefficients;
+    epicsEventId captureEventId;
+    epicsThreadId captureThreadId;
+    EpicsAtomicPtrT captureNew;
+    EpicsAtomicPtrT captureOld;
+    /* Raw scan recorder.  ip330StartRecorder and ip330StopRecorder set
+     * requestedRecorder and recorderRequest, and intTask switches to it,
+     * or requestRecorder does if it can claim the card first.  The recorder
+     * closed is kept in closedRecorder for report, until the next
+     * ip330StartRecorder destroys it.  These handoffs are made with lock
+     * held.  recordGeneration is the last calibration given to the
+     * recorder. */
+    ip330Recorder *pRecorder;
+    ip330Recorder *closedRecorder;
+    ip330Recorder *requestedRecorder;
+    volatile int recorderRequest;
+    unsigned int recordGeneration;
+    int recordGenerationValid;
+    /* Spectra.  intTask writes correctedData into spectrumRing, a circular
+     * buffer of SPECTRUM_RING_BLOCKS*spectrumSize scans of each active
+     * channel, channel-major, and counts the scans in spectrumHead.  The
+     * spectrum thread follows behind with its own read position.  It holds
+     * spectrumLock while it copies a block out, and discards the block if
+     * intTask overwrote it meanwhile.  Writes of SPECTRUM_SIZE allocate
+     * the ring for the new size into spectrumNew.  intTask swaps it in with
+     * spectrumLock held, leaving the old ring in spectrumOld, and increments
+     * spectrumEpoch so that the thread starts again and frees the old
+     * ring.  The thread publishes each spectrum in spectrumMagnitude,
+     * spectrumPsd and spectrumFreq, spectrumPoints values per channel, with
+     * spectrumLock held. */
+    epicsMutexId spectrumLock;
+    epicsEventId spectrumEventId;
+    epicsThreadId spectrumThreadId;
+    int spectrumSize;
+    int requestedSpectrumSize;
+    int spectrumWindow;
+    int spectrumAverages;
+    unsigned int spectrumEpoch;
+    epicsInt32 *spectrumRing;
+    epicsTimeStamp *spectrumTime;
+    ip330SpectrumBuffers spectrumNew;
+    volatile int spectrumNewReady;
+    ip330SpectrumBuffers spectrumOld;
+    volatile unsigned int spectrumHead;
+    int spectrumPoints;
+    double *spectrumMagnitude;
+    double *spectrumPsd;
+    double *spectrumFreq;
+    epicsTimeStamp spectrumTimestamp;
+    unsigned long spectrumCount;
+    unsigned long spectrumSkipped;
+    /* Running totals of correctedData for AVERAGE clients.  Only intTask
+     * writes these; averageSeq is odd while an update is in progress.
+     * The sums are exact up to 2^53 counts. */
+    int averageUsers;
+    volatile unsigned int averageSeq;
+    double averageSum[MAX_IP330_CHANNELS];
+    volatile unsigned int averageCount;
+    /* Statistics.  intTask keeps Welford accumulators of correctedData for
+     * statWindow scans, then publishes the results of the window in
+     * statMean ... statMax.  statSeq is odd while they are being written,
+     * as for averageSeq.  requestedStatWindow is applied by intTask at the
+     * start of the next window. */
+    int statWindow;
+    int requestedStatWindow;
+    int statScans;
+    double statAccMean[MAX_IP330_CHANNELS];
+    double statAccM2[MAX_IP330_CHANNELS];
+    int statAccMin[MAX_IP330_CHANNELS];
+    int statAccMax[MAX_IP330_CHANNELS];
+    volatile unsigned int statSeq;
+    double statMean[MAX_IP330_CHANNELS];
+    double statRms[MAX_IP330_CHANNELS];
+    double statStdDev[MAX_IP330_CHANNELS];
+    double statMin[MAX_IP330_CHANNELS];
+    double statMax[MAX_IP330_CHANNELS];
+    epicsTimeStamp statTime;
     double actualScanPeriod;
+    /* Time of the scan intTask is processing, and of each channel in it.
+     * sampleInterval is the time between the conversions of adjacent
+     * channels, blockTime the time of the first scan in the current block. */
+    epicsTimeStamp scanTime;
+    epicsTimeStamp sampleTime[MAX_IP330_CHANNELS];
+    double sampleInterval;
+    epicsTimeStamp blockTime;
     asynInterface common;
     asynInterface int32;
     void *int32InterruptPvt;
     asynInterface float64;
     void *float64InterruptPvt;
+    asynInterface int16Array;
+    void *int16ArrayInterruptPvt;
     asynInterface int32Array;
     void *int32ArrayInterruptPvt;
+    asynInterface float32Array;
+    void *float32ArrayInterruptPvt;
+    asynInterface float64Array;
+    void *float64ArrayInterruptPvt;
     asynInterface drvUser;
+    ip330Dispatch dispatch[nDispatchTypes];
 } drvIp330Pvt;
 
 static drvIp330Pvt* driverTable[MAX_IP330_CARDS];
 static int numCards;
 
+static ip330Worker *workers;
+static int numWorkers;
+static int requestedWorkers;
+static epicsMutexId workerLock;
+
+/* One timer queue for the calibration timers of all cards */
+static epicsTimerQueueId calTimerQueue;
+
+static ip330ThreadPolicy workerPolicy[MAX_DISPATCH_WORKERS];
+static ip330ThreadPolicy calPolicy;
+static epicsTimerId calPolicyTimer;
+static int memoryLocked;
+static int memoryLockStatus;
+
 /* These functions are used by the interfaces */
 static asynStatus readInt32         (void *drvPvt, asynUser *pasynUser,
                                      epicsInt32 *value);
 static asynStatus writeInt32        (void *drvPvt, asynUser *pasynUser,
                                      epicsInt32 value);
+static asynStatus readInt16Array    (void *drvPvt, asynUser *pasynUser,
+                                     epicsInt16 *value, size_t nelements,
+                                     size_t *nIn);
+static asynStatus readFloat32Array  (void *drvPvt, asynUser *pasynUser,
+                                     epicsFloat32 *value, size_t nelements,
+                                     size_t *nIn);
+static asynStatus readInt32Array    (void *drvPvt, asynUser *pasynUser,
+                                     epicsInt32 *value, size_t nelements,
+                                     size_t *nIn);
 static asynStatus getBounds         (void *drvPvt, asynUser *pasynUser,
                                      epicsInt32 *low, epicsInt32 *high);
 static asynStatus readFloat64       (void *drvPvt, asynUser *pasynUser,
                                      epicsFloat64 *value);
 static asynStatus writeFloat64      (void *drvPvt, asynUser *pasynUser,
                                      epicsFloat64 value);
+static asynStatus readFloat64Array  (void *drvPvt, asynUser *pasynUser,
+                                     epicsFloat64 *value, size_t nelements,
+                                     size_t *nIn);
+static asynStatus writeFloat64Array (void *drvPvt, asynUser *pasynUser,
+                                     epicsFloat64 *value, size_t nelements);
 static asynStatus drvUserCreate     (void *drvPvt, asynUser *pasynUser,
                                      const char *drvInfo, 
                                      const char **pptypeName, size_t *psize);
@@ -280,10 +769,88 @@ static asynStatus disconnect        (void *drvPvt, asynUser *pasynUser);
 
 /* These are private functions, not used in any interfaces */
 static void intFunc           (int drvPvt); /* Interrupt function */
-static void intTask           (drvIp330Pvt *pPvt);
-static int calibrate          (drvIp330Pvt *pPvt, int channel);
-static void waitNewData       (drvIp330Pvt *pPvt);
+static int intTask            (drvIp330Pvt *pPvt, int maxFrames);
+static int startWorkers       (void);
+static void assignWorker      (drvIp330Pvt *pPvt);
+static void wakeWorkers       (drvIp330Pvt *pPvt);
+static int serviceCard        (drvIp330Pvt *pPvt);
+static void dispatchWorker    (ip330Worker *pWorker);
+static void applyThreadPolicy (ip330ThreadPolicy *pPolicy);
+static void applyCalPolicy    (void *unused);
+static void scheduleCalPolicy (void);
+static void reportThreadPolicy (FILE *fp, const char *name,
+                                const ip330ThreadPolicy *pPolicy);
+static void publishFilter     (drvIp330Pvt *pPvt);
+static void filterAll         (drvIp330Pvt *pPvt);
+static void publishEgu        (drvIp330Pvt *pPvt);
+static void scaleAll          (drvIp330Pvt *pPvt);
+static void updateDeadband    (drvIp330Pvt *pPvt);
+static int deadbandPass       (drvIp330Pvt *pPvt, int channel);
+static int clientPass         (drvIp330Pvt *pPvt, asynUser *pasynUser,
+                               int channel, double *value);
+static asynStatus parseRateOptions (asynUser *pasynUser, const char *options,
+                                    ip330RateUser **ppRate);
+static asynStatus setDeadband (void *drvPvt, asynUser *pasynUser,
+                               int command, double value);
+static void setEguVolts       (drvIp330Pvt *pPvt, int channel);
+static asynStatus setEguScaling (void *drvPvt, asynUser *pasynUser,
+                                 int command, double value);
+static void accumulateBlock   (drvIp330Pvt *pPvt);
+static void accumulateAverage (drvIp330Pvt *pPvt);
+static void readAverage       (drvIp330Pvt *pPvt, asynUser *pasynUser,
+                               int channel, double *value);
+static void accumulateStatistics (drvIp330Pvt *pPvt);
+static void publishStatistics (drvIp330Pvt *pPvt);
+static double readStatistic   (drvIp330Pvt *pPvt, int command, int channel,
+                               epicsTimeStamp *pTime);
+static void accumulateCapture (drvIp330Pvt *pPvt);
+static void switchRecorder    (drvIp330Pvt *pPvt);
+static void recordScan        (drvIp330Pvt *pPvt, const ip330Frame *pFrame,
+                               unsigned int generation);
+static void accumulateSpectrum (drvIp330Pvt *pPvt);
+static void spectrumTask      (drvIp330Pvt *pPvt);
+static asynStatus setSpectrumSize (drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                   int size);
+static void publishSpectrum   (drvIp330Pvt *pPvt, const ip330Spectrum *pSpectrum,
+                               const double *power, int nBlocks,
+                               const epicsTimeStamp *pTime);
+static void freezeCapture     (drvIp330Pvt *pPvt);
+static void captureTask       (drvIp330Pvt *pPvt);
+static void publishCapture    (drvIp330Pvt *pPvt);
+static asynStatus setCaptureDepth (drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                   int depth);
+static void freeCaptureBuffers (ip330CaptureBuffers *pBuffers);
+static void doCaptureStateCallbacks (drvIp330Pvt *pPvt, dispatchType type,
+                                     const epicsTimeStamp *pTime);
+static void checkMissedData   (drvIp330Pvt *pPvt);
+static void doOverrunCallbacks (drvIp330Pvt *pPvt);
+static void updateHistograms  (drvIp330Pvt *pPvt, const epicsTimeStamp *frameTime,
+                               int follows, const epicsTimeStamp *dequeueTime,
+                               const epicsTimeStamp *correctTime,
+                               const epicsTimeStamp *doneTime);
+static ip330Dispatch *dispatchStart (drvIp330Pvt *pPvt, dispatchType type);
+static void dispatchEnd       (ip330Dispatch *pd);
+static void installDispatchHooks (void);
+static void doBlockCallbacks  (drvIp330Pvt *pPvt);
+static asynStatus setBlockSize (drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                int blockSize);
+static void freeBlockBuffers  (ip330BlockBuffers *pBuffers);
+static void *handoffPut       (EpicsAtomicPtrT *pSlot, void *p);
+static void *handoffTake      (EpicsAtomicPtrT *pSlot);
+static int calibrate          (drvIp330Pvt *pPvt, int gain);
+static void startBurst        (drvIp330Pvt *pPvt);
+static asynStatus waitNewData (drvIp330Pvt *pPvt, int nConversions);
 static void autoCalibrate     (void *drvPvt);
+static void startCalibrateStep (drvIp330Pvt *pPvt);
+static void calibrateInterrupt (drvIp330Pvt *pPvt);
+static void finishCalibrateStep (drvIp330Pvt *pPvt);
+static void computeCoefficients (drvIp330Pvt *pPvt, int gain,
+                                 double count_callo, double count_calhi);
+static int initIp330Private   (const char *portName, ushort_t carrier,
+                               ushort_t slot, const char *typeString,
+                               const char *rangeString, int firstChan,
+                               int lastChan, int intVec,
+                               const char *signalString);
 static int config             (drvIp330Pvt *pPvt, scanModeType scanMode, 
                                const char *triggerString, 
                                double secondsPerScan, 
@@ -300,6 +867,9 @@ static double setScanPeriod   (void *drvPvt, asynUser *pasynUser,
                                double seconds);
 static double getScanPeriod   (void *drvPvt, asynUser *pasynUser);
 static double getActualScanPeriod (drvIp330Pvt *pPvt);
+static void setSampleInterval (drvIp330Pvt *pPvt);
+static void computeSampleTimes (drvIp330Pvt *pPvt);
+static int getInterruptTime   (epicsTimeStamp *pTime);
      
 static asynCommon drvIp330Common = {
     report,
@@ -318,12 +888,34 @@ static asynFloat64 drvIp330Float64 = {
     readFloat64
 };
 
+static asynInt16Array drvIp330Int16Array = {
+    NULL,
+    readInt16Array,
+    NULL,
+    NULL
+};
+
 static asynInt32Array drvIp330Int32Array = {
     NULL,
+    readInt32Array,
     NULL,
+    NULL
+};
+
+static asynFloat32Array drvIp330Float32Array = {
+    NULL,
+    readFloat32Array,
+    NULL,
+    NULL
+};
+
+static asynFloat64Array drvIp330Float64Array = {
+    writeFloat64Array,
+    readFloat64Array,
     NULL,
     NULL
 };
+
 static asynDrvUser drvIp330DrvUser = {
     drvUserCreate,
     drvUserGetType,
@@ -334,6 +926,32 @@ static asynDrvUser drvIp330DrvUser = {
 int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
               const char *typeString, const char *rangeString,
               int firstChan, int lastChan, int intVec)
+{
+    return(initIp330Private(portName, carrier, slot, typeString, rangeString,
+                            firstChan, lastChan, intVec, NULL));
+}
+
+/* Same as initIp330, but with a simulated carrier and module instead of
+ * hardware.  See ip330Sim.h for signalString.  The simulation is only
+ * built for Linux. */
+int initIp330Sim(const char *portName, const char *typeString, 
+                 const char *rangeString, int firstChan, int lastChan,
+                 const char *signalString)
+{
+#ifdef linux
+    if (!signalString || !*signalString) signalString = "sine";
+    return(initIp330Private(portName, 0, 0, typeString, rangeString,
+                            firstChan, lastChan, 0, signalString));
+#else
+    errlogPrintf("initIp330Sim: the simulation is only built for Linux\n");
+    return -1;
+#endif
+}
+
+static int initIp330Private(const char *portName, ushort_t carrier, 
+                            ushort_t slot, const char *typeString, 
+                            const char *rangeString, int firstChan, 
+                            int lastChan, int intVec, const char *signalString)
 {
     ipac_idProm_t *id;
     unsigned char manufacturer;
@@ -341,7 +959,6 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     drvIp330Pvt *pPvt;
     asynStatus status;
     int i;
-    epicsTimerQueueId timerQueueId;
 
     pPvt = callocMustSucceed(1, sizeof(*pPvt), "initIp330");
     pPvt->portName = epicsStrDup(portName);
@@ -349,26 +966,31 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     pPvt->slot = slot;
     pPvt->firstChan = firstChan;
     pPvt->lastChan = lastChan;
-    timerQueueId = epicsTimerQueueAllocate(1, epicsThreadPriorityLow);
-    pPvt->timerId = epicsTimerQueueCreateTimer(timerQueueId, autoCalibrate,
+    if (!calTimerQueue) {
+        calTimerQueue = epicsTimerQueueAllocate(1, epicsThreadPriorityLow);
+        scheduleCalPolicy();
+    }
+    pPvt->timerId = epicsTimerQueueCreateTimer(calTimerQueue, autoCalibrate,
                                                (void *)pPvt);
 
-    if (ipmCheck(carrier, slot)) {
-       errlogPrintf("initIp330: bad carrier or slot\n");
-       return -1;
-    }
+    if (!signalString) {
+        if (ipmCheck(carrier, slot)) {
+           errlogPrintf("initIp330: bad carrier or slot\n");
+           return -1;
+        }
 
-    id = (ipac_idProm_t *) ipmBaseAddr(carrier, slot, ipac_addrID);
-    manufacturer = id->manufacturerId & 0xff;
-    model = id->modelId & 0xff;
-    if(manufacturer!=ACROMAG_ID) {
-        errlogPrintf("initIp330 manufacturer 0x%x not ACROMAG_ID\n",
-                     manufacturer);
-        return -1;
-    }
-    if(model!=ACRO_IP330) {
-       errlogPrintf("initIp330 model 0x%x not a ACRO_IP330\n",model);
-       return -1;
+        id = (ipac_idProm_t *) ipmBaseAddr(carrier, slot, ipac_addrID);
+        manufacturer = id->manufacturerId & 0xff;
+        model = id->modelId & 0xff;
+        if(manufacturer!=ACROMAG_ID) {
+            errlogPrintf("initIp330 manufacturer 0x%x not ACROMAG_ID\n",
+                         manufacturer);
+            return -1;
+        }
+        if(model!=ACRO_IP330) {
+           errlogPrintf("initIp330 model 0x%x not a ACRO_IP330\n",model);
+           return -1;
+        }
     }
     if(strcmp(typeString,"D")==0) {
         pPvt->type = differential;
@@ -385,6 +1007,15 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
         errlogPrintf("initIp330 illegal range\n");
         return -1;
     }
+#ifdef linux
+    if (signalString) {
+        pPvt->pSim = ip330SimCreate(portName,
+                                    calibrationSettings[pPvt->range][0].ideal_zero,
+                                    calibrationSettings[pPvt->range][0].ideal_span,
+                                    signalString);
+        if (!pPvt->pSim) return -1;
+    }
+#endif
 
     if (pPvt->type == differential) {
        pPvt->mailBoxOffset = 16;
@@ -394,6 +1025,20 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     pPvt->chanSettings = callocMustSucceed(MAX_IP330_CHANNELS,
                                            sizeof(ip330ADCSettings),
                                            "initIp330");
+    pPvt->frameRing = callocMustSucceed(FRAME_RING_SIZE, sizeof(ip330Frame),
+                                        "initIp330");
+    pPvt->ringMask = FRAME_RING_SIZE - 1;
+    pPvt->calEventId = epicsEventMustCreate(epicsEventEmpty);
+    pPvt->calIdleEventId = epicsEventMustCreate(epicsEventEmpty);
+    pPvt->spectrumLock = epicsMutexMustCreate();
+    pPvt->spectrumEventId = epicsEventMustCreate(epicsEventEmpty);
+    pPvt->captureEventId = epicsEventMustCreate(epicsEventEmpty);
+    pPvt->spectrumWindow = ip330WindowHann;
+    pPvt->spectrumAverages = 1;
+    ip330FilterInit(&pPvt->requestedFilter);
+    ip330FilterInit(&pPvt->publishedFilter[0]);
+    ip330FilterInit(&pPvt->publishedFilter[1]);
+    ip330FilterInit(&pPvt->filter);
     /* Link with higher level routines */
     pPvt->common.interfaceType = asynCommonType;
     pPvt->common.pinterface  = (void *)&drvIp330Common;
@@ -404,9 +1049,18 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     pPvt->float64.interfaceType = asynFloat64Type;
     pPvt->float64.pinterface  = (void *)&drvIp330Float64;
     pPvt->float64.drvPvt = pPvt;
+    pPvt->int16Array.interfaceType = asynInt16ArrayType;
+    pPvt->int16Array.pinterface  = (void *)&drvIp330Int16Array;
+    pPvt->int16Array.drvPvt = pPvt;
     pPvt->int32Array.interfaceType = asynInt32ArrayType;
     pPvt->int32Array.pinterface  = (void *)&drvIp330Int32Array;
     pPvt->int32Array.drvPvt = pPvt;
+    pPvt->float32Array.interfaceType = asynFloat32ArrayType;
+    pPvt->float32Array.pinterface  = (void *)&drvIp330Float32Array;
+    pPvt->float32Array.drvPvt = pPvt;
+    pPvt->float64Array.interfaceType = asynFloat64ArrayType;
+    pPvt->float64Array.pinterface  = (void *)&drvIp330Float64Array;
+    pPvt->float64Array.drvPvt = pPvt;
     pPvt->drvUser.interfaceType = asynDrvUserType;
     pPvt->drvUser.pinterface  = (void *)&drvIp330DrvUser;
     pPvt->drvUser.drvPvt = pPvt;
@@ -438,6 +1092,13 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     }
     pasynManager->registerInterruptSource(portName, &pPvt->float64,
                                           &pPvt->float64InterruptPvt);
+    status = pasynInt16ArrayBase->initialize(pPvt->portName,&pPvt->int16Array);
+    if (status != asynSuccess) {
+        errlogPrintf("initIp330 ERROR: Can't register int16Array\n");
+        return -1;
+    }
+    pasynManager->registerInterruptSource(portName, &pPvt->int16Array,
+                                          &pPvt->int16ArrayInterruptPvt);
     status = pasynInt32ArrayBase->initialize(pPvt->portName,&pPvt->int32Array);
     if (status != asynSuccess) {
         errlogPrintf("initIp330 ERROR: Can't register int32Array\n");
@@ -445,11 +1106,43 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     }
     pasynManager->registerInterruptSource(portName, &pPvt->int32Array,
                                           &pPvt->int32ArrayInterruptPvt);
+    status = pasynFloat32ArrayBase->initialize(pPvt->portName,
+                                               &pPvt->float32Array);
+    if (status != asynSuccess) {
+        errlogPrintf("initIp330 ERROR: Can't register float32Array\n");
+        return -1;
+    }
+    pasynManager->registerInterruptSource(portName, &pPvt->float32Array,
+                                          &pPvt->float32ArrayInterruptPvt);
+    status = pasynFloat64ArrayBase->initialize(pPvt->portName,
+                                               &pPvt->float64Array);
+    if (status != asynSuccess) {
+        errlogPrintf("initIp330 ERROR: Can't register float64Array\n");
+        return -1;
+    }
+    pasynManager->registerInterruptSource(portName, &pPvt->float64Array,
+                                          &pPvt->float64ArrayInterruptPvt);
     status = pasynManager->registerInterface(pPvt->portName,&pPvt->drvUser);
     if (status != asynSuccess) {
         errlogPrintf("initIp330 ERROR: Can't register drvUser\n");
         return -1;
     }
+    pPvt->dispatch[dispatchInt32].interruptPvt = pPvt->int32InterruptPvt;
+    pPvt->dispatch[dispatchFloat64].interruptPvt = pPvt->float64InterruptPvt;
+    pPvt->dispatch[dispatchInt16Array].interruptPvt = 
+                                            pPvt->int16ArrayInterruptPvt;
+    pPvt->dispatch[dispatchInt32Array].interruptPvt = 
+                                            pPvt->int32ArrayInterruptPvt;
+    pPvt->dispatch[dispatchFloat32Array].interruptPvt = 
+                                            pPvt->float32ArrayInterruptPvt;
+    pPvt->dispatch[dispatchFloat64Array].interruptPvt = 
+                                            pPvt->float64ArrayInterruptPvt;
+    for (i=0; i<nDispatchTypes; i++) {
+        pPvt->dispatch[i].interruptPvt = 
+                            pPvt->dispatch[dispatchInterface[i]].interruptPvt;
+        pPvt->dispatch[i].dirty = 1;
+    }
+    installDispatchHooks();
     /* Create asynUser for debugging */
     pPvt->pasynUser = pasynManager->createAsynUser(0, 0);
 
@@ -461,12 +1154,22 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     }
 
     /* Program device registers */
-    pPvt->regs = (ip330ADCregs *) ipmBaseAddr(carrier, slot, ipac_addrIO);;
+#ifdef linux
+    if (pPvt->pSim)
+        pPvt->regs = (ip330ADCregs *) ip330SimRegs(pPvt->pSim);
+    else
+#endif
+        pPvt->regs = (ip330ADCregs *) ipmBaseAddr(carrier, slot, ipac_addrIO);
     pPvt->lock = epicsMutexCreate();
     pPvt->regs->startConvert = 0x0000;
     pPvt->regs->intVector = intVec;
     driverTable[numCards] = pPvt;
     numCards++;
+#ifdef linux
+    if (pPvt->pSim) {
+      ip330SimIntConnect(pPvt->pSim, intFunc, numCards-1);
+    } else
+#endif
     if (ipmIntConnect(carrier, slot, intVec, intFunc, numCards-1)) {
       errlogPrintf("initIp330: interrupt connect failure\n");
       return -1;
@@ -493,12 +1196,18 @@ int initIp330(const char *portName, ushort_t carrier, ushort_t slot,
     setSecondsBetweenCalibrate(pPvt, pPvt->pasynUser, SECONDS_BETWEEN_CALIBRATE);
 
     /* Enable interrupts on carrier card */
-    ipmIrqCmd(pPvt->carrier, pPvt->slot, 0, ipac_irqEnable);
+#ifdef linux
+    if (pPvt->pSim)
+        ip330SimIrqEnable(pPvt->pSim, 1);
+    else
+#endif
+        ipmIrqCmd(pPvt->carrier, pPvt->slot, 0, ipac_irqEnable);
+    pPvt->irqEnabled = 1;
 
     return 0;
 }
 
-int configIp330(const char *portName, scanModeType scanMode, 
+int configIp330(const char *portName, int scanMode, 
                 const char *triggerString, int microSecondsPerScan, 
                 int secondsBetweenCalibrate)
 {
@@ -522,8 +1231,8 @@ int configIp330(const char *portName, scanModeType scanMode,
     }
     pPvt = pasynInterface->drvPvt;
 
-    config(pPvt, scanMode, triggerString, microSecondsPerScan/1.e6,
-           secondsBetweenCalibrate);
+    config(pPvt, (scanModeType)scanMode, triggerString,
+           microSecondsPerScan/1.e6, secondsBetweenCalibrate);
     return(0);
 }
 
@@ -548,32 +1257,468 @@ static int config(drvIp330Pvt *pPvt, scanModeType scan,
     setSecondsBetweenCalibrate(pPvt, pPvt->pasynUser, secondsCalibrate);
     autoCalibrate((void *)pPvt);
     pPvt->regs->control |= CTL_INTERRUPT_AFTER_ALL; /* = Interrupt After All Selected */
-    pPvt->intMsgQId = epicsMessageQueueCreate(MAX_MESSAGES, 
-                                              MAX_IP330_CHANNELS*sizeof(int));
-    if (epicsThreadCreate("Ip330intTask",
-                           epicsThreadPriorityHigh,
-                           epicsThreadGetStackSize(epicsThreadStackMedium),
-                           (EPICSTHREADFUNC)intTask,
-                           pPvt) == NULL)
-       errlogPrintf("Ip330intTask epicsThreadCreate failure\n");
+    if (!pPvt->pWorker) {
+        if (startWorkers()) return(-1);
+        assignWorker(pPvt);
+    }
+    return(0);
+}
+
+/* Set the number of dispatch workers.  Must be called before the first
+ * configIp330.  0 selects the number of CPUs. */
+int ip330SetDispatchPool(int nWorkers)
+{
+    if (workers) {
+        errlogPrintf("ip330SetDispatchPool: the pool already has %d workers\n",
+                     numWorkers);
+        return(-1);
+    }
+    if ((nWorkers < 0) || (nWorkers > MAX_DISPATCH_WORKERS)) {
+        errlogPrintf("ip330SetDispatchPool: nWorkers must be 0 to %d\n",
+                     MAX_DISPATCH_WORKERS);
+        return(-1);
+    }
+    requestedWorkers = nWorkers;
+    return(0);
+}
+
+static int startWorkers(void)
+{
+    char name[32];
+    int i, n;
+
+    if (workers) return(0);
+    n = requestedWorkers;
+    if (n <= 0) n = epicsThreadGetCPUs();
+    if (n < 1) n = 1;
+    if (n > MAX_DISPATCH_WORKERS) n = MAX_DISPATCH_WORKERS;
+    workerLock = epicsMutexMustCreate();
+    workers = callocMustSucceed(n, sizeof(ip330Worker), "ip330 startWorkers");
+    for (i=0; i<n; i++) {
+        workers[i].index = i;
+        workers[i].eventId = epicsEventMustCreate(epicsEventEmpty);
+    }
+    numWorkers = n;
+    for (i=0; i<n; i++) {
+        epicsSnprintf(name, sizeof(name), "ip330Dispatch%d", i);
+        workers[i].threadId = epicsThreadCreate(name,
+                              epicsThreadPriorityHigh,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)dispatchWorker,
+                              &workers[i]);
+        if (!workers[i].threadId) {
+            errlogPrintf("ip330 startWorkers epicsThreadCreate failure\n");
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/* Give the card to the worker with the fewest cards */
+static void assignWorker(drvIp330Pvt *pPvt)
+{
+    ip330Worker *pWorker = &workers[0];
+    int i;
+
+    epicsMutexLock(workerLock);
+    for (i=1; i<numWorkers; i++) {
+        if (workers[i].nCards < pWorker->nCards) pWorker = &workers[i];
+    }
+    pWorker->nCards++;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->pWorker = pWorker;
+    epicsMutexUnlock(workerLock);
+    epicsEventSignal(pWorker->eventId);
+}
+
+/* Called from intFunc */
+static void wakeWorkers(drvIp330Pvt *pPvt)
+{
+    ip330Worker *pWorker = pPvt->pWorker;
+    int thief;
+
+    if (!pWorker) return;
+    epicsEventSignal(pWorker->eventId);
+    /* If the card's worker is busy, let one of the others steal this card */
+    if (pWorker->busy && (numWorkers > 1)) {
+        thief = (pWorker->index + 1 + pPvt->stealHint++ % (numWorkers - 1)) %
+                numWorkers;
+        epicsEventSignal(workers[thief].eventId);
+    }
+}
+
+/* Process a batch of frames for a card if it has work and no other worker
+ * has it.  Returns 1 if it did some work. */
+static int serviceCard(drvIp330Pvt *pPvt)
+{
+    ip330Worker *pWorker = pPvt->pWorker;
+
+    if ((pPvt->ringTail == pPvt->ringHead) && !pPvt->calResultReady &&
+        (pPvt->calSteps == pPvt->calStepsSeen)) return(0);
+    if (epicsAtomicCmpAndSwapIntT(&pPvt->claimed, 0, 1) != 0) return(0);
+    intTask(pPvt, DISPATCH_BATCH);
+    epicsAtomicWriteMemoryBarrier();
+    epicsAtomicSetIntT(&pPvt->claimed, 0);
+    /* Make sure whoever comes next sees the frames left in the ring */
+    if (pPvt->ringTail != pPvt->ringHead) epicsEventSignal(pWorker->eventId);
+    return(1);
+}
+
+static void dispatchWorker(ip330Worker *pWorker)
+{
+    drvIp330Pvt *pPvt;
+    int i, didWork;
+
+    while (1) {
+        if (workerPolicy[pWorker->index].pending)
+            applyThreadPolicy(&workerPolicy[pWorker->index]);
+        didWork = 0;
+        pWorker->busy = 1;
+        for (i=0; i<numCards; i++) {
+            pPvt = driverTable[i];
+            if (!pPvt || (pPvt->pWorker != pWorker)) continue;
+            if (serviceCard(pPvt)) {
+                pWorker->batches++;
+                didWork = 1;
+            }
+        }
+        if (!didWork) {
+            /* Nothing of our own to do, help the other workers */
+            for (i=0; i<numCards; i++) {
+                pPvt = driverTable[i];
+                if (!pPvt || !pPvt->pWorker || (pPvt->pWorker == pWorker))
+                    continue;
+                if (serviceCard(pPvt)) {
+                    pWorker->steals++;
+                    didWork = 1;
+                }
+            }
+        }
+        pWorker->busy = 0;
+        if (!didWork) epicsEventMustWait(pWorker->eventId);
+    }
+}
+
+#ifdef linux
+/* Parse a list like "2,3" or "4-7" */
+static int parseCpuList(const char *cpuList, cpu_set_t *pSet)
+{
+    const char *p = cpuList;
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(pSet);
+    while (*p) {
+        first = strtol(p, &end, 10);
+        if (end == p) return(-1);
+        last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p) return(-1);
+            p = end;
+        }
+        if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) return(-1);
+        for (cpu=first; cpu<=last; cpu++) CPU_SET(cpu, pSet);
+        if (*p == ',') p++;
+        else if (*p) return(-1);
+    }
+    return(0);
+}
+#endif
+
+/* Called by the thread the policy is for */
+static void applyThreadPolicy(ip330ThreadPolicy *pPolicy)
+{
+#ifdef linux
+    struct sched_param param;
+    int status = 0;
+
+    pPolicy->pending = 0;
+    epicsAtomicReadMemoryBarrier();
+    if (CPU_COUNT(&pPolicy->cpuSet) > 0)
+        status = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                        &pPolicy->cpuSet);
+    if ((status == 0) && (pPolicy->priority > 0)) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = pPolicy->priority;
+        status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    pPolicy->status = status;
+    pPolicy->applied = 1;
+    if (status)
+        errlogPrintf("drvIp330: thread %s, cannot apply cpus=\"%s\" "
+                     "priority=%d: %s\n", epicsThreadGetNameSelf(),
+                     pPolicy->cpuList, pPolicy->priority, strerror(status));
+#endif
+}
+
+/* Runs in the calibration timer queue's thread */
+static void applyCalPolicy(void *unused)
+{
+    applyThreadPolicy(&calPolicy);
+}
+
+static void scheduleCalPolicy(void)
+{
+    if (!calPolicy.pending || !calTimerQueue) return;
+    if (!calPolicyTimer)
+        calPolicyTimer = epicsTimerQueueCreateTimer(calTimerQueue,
+                                                    applyCalPolicy, NULL);
+    epicsTimerStartDelay(calPolicyTimer, 0.);
+}
+
+/* Set the CPU affinity and real-time priority of driver threads.
+ *   target   "dispatch" for all dispatch workers, "dispatchN" for worker N,
+ *            or "calibrate" for the calibration timer thread.  A worker
+ *            is shared by its cards, and an idle worker steals cards from
+ *            a busy one, so a card is only kept on the chosen CPUs if
+ *            every worker is pinned with "dispatch".  Report shows which
+ *            worker a card is assigned to.
+ *   cpuList  CPUs to run on, e.g. "2,3" or "2-3".  Empty leaves the
+ *            affinity alone.
+ *   priority SCHED_FIFO priority 1-99, 0 leaves the scheduling alone.
+ *   lockMemory  if non-zero, lock all of the IOC's memory with mlockall.
+ * Can be called before or after configIp330.  Linux only. */
+int ip330SetThreadPolicy(const char *target, const char *cpuList,
+                         int priority, int lockMemory)
+{
+#ifdef linux
+    ip330ThreadPolicy policy;
+    ip330ThreadPolicy *pPolicies[MAX_DISPATCH_WORKERS];
+    int nPolicies = 0;
+    int i, n;
+
+    if (!target || !*target) {
+        errlogPrintf("ip330SetThreadPolicy: target must be dispatch, "
+                     "dispatchN or calibrate\n");
+        return(-1);
+    }
+    if (!cpuList) cpuList = "";
+    memset(&policy, 0, sizeof(policy));
+    if (parseCpuList(cpuList, &policy.cpuSet)) {
+        errlogPrintf("ip330SetThreadPolicy: bad cpuList \"%s\"\n", cpuList);
+        return(-1);
+    }
+    if ((priority < 0) || (priority > sched_get_priority_max(SCHED_FIFO))) {
+        errlogPrintf("ip330SetThreadPolicy: priority must be 0 to %d\n",
+                     sched_get_priority_max(SCHED_FIFO));
+        return(-1);
+    }
+    strncpy(policy.cpuList, cpuList, sizeof(policy.cpuList)-1);
+    policy.priority = priority;
+
+    if (strcmp(target, "calibrate") == 0) {
+        pPolicies[nPolicies++] = &calPolicy;
+    } else if (strcmp(target, "dispatch") == 0) {
+        for (i=0; i<MAX_DISPATCH_WORKERS; i++) pPolicies[nPolicies++] = &workerPolicy[i];
+    } else if ((sscanf(target, "dispatch%d", &n) == 1) && 
+               (n >= 0) && (n < MAX_DISPATCH_WORKERS)) {
+        pPolicies[nPolicies++] = &workerPolicy[n];
+    } else {
+        errlogPrintf("ip330SetThreadPolicy: target must be dispatch, "
+                     "dispatchN or calibrate, not %s\n", target);
+        return(-1);
+    }
+    for (i=0; i<nPolicies; i++) {
+        *pPolicies[i] = policy;
+        epicsAtomicWriteMemoryBarrier();
+        pPolicies[i]->pending = 1;
+    }
+    /* Wake the threads so that they apply it now */
+    for (i=0; i<numWorkers; i++) epicsEventSignal(workers[i].eventId);
+    scheduleCalPolicy();
+
+    if (lockMemory && !memoryLocked) {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+            memoryLocked = 1;
+        } else {
+            memoryLockStatus = errno;
+            errlogPrintf("ip330SetThreadPolicy: mlockall failed: %s\n",
+                         strerror(memoryLockStatus));
+        }
+    }
+    return(0);
+#else
+    errlogPrintf("ip330SetThreadPolicy: only supported on Linux\n");
+    return(-1);
+#endif
+}
+
+static drvIp330Pvt *findPort(const char *portName)
+{
+    int i;
+
+    for (i=0; i<numCards; i++) {
+        if (strcmp(driverTable[i]->portName, portName) == 0)
+            return(driverTable[i]);
+    }
+    return(NULL);
+}
+
+static int requestRecorder(drvIp330Pvt *pPvt, ip330Recorder *pRec)
+{
+    int status = 0;
+
+    epicsMutexLock(pPvt->lock);
+    if (pPvt->recorderRequest) {
+        status = -1;
+    } else {
+        pPvt->requestedRecorder = pRec;
+        epicsAtomicWriteMemoryBarrier();
+        pPvt->recorderRequest = 1;
+    }
+    epicsMutexUnlock(pPvt->lock);
+    if (status) return(status);
+    /* intTask switches at the next scan, which may never come if the card
+     * is stopped or idle.  Claim the card and switch here unless a worker
+     * gets there first. */
+    while (pPvt->recorderRequest) {
+        if (epicsAtomicCmpAndSwapIntT(&pPvt->claimed, 0, 1) == 0) {
+            if (pPvt->recorderRequest) switchRecorder(pPvt);
+            epicsAtomicWriteMemoryBarrier();
+            epicsAtomicSetIntT(&pPvt->claimed, 0);
+            /* A worker may have skipped the card while it was claimed */
+            if (pPvt->pWorker && (pPvt->ringTail != pPvt->ringHead))
+                epicsEventSignal(pPvt->pWorker->eventId);
+            break;
+        }
+        epicsThreadSleep(WAIT_POLL_SECONDS);
+    }
+    return(status);
+}
+
+/* Start recording every raw scan of a port to segment files in directory,
+ * segmentScans scans per file, 0 for RECORDER_SEGMENT_SCANS.  See
+ * ip330Recorder.h for the file format and ip330RecordRead to convert
+ * them.  Recording starts with the next scan. */
+int ip330StartRecorder(const char *portName, const char *directory,
+                       int segmentScans)
+{
+    drvIp330Pvt *pPvt;
+    ip330Recorder *pRec, *pClosed;
+
+    if (!portName || !(pPvt = findPort(portName))) {
+        errlogPrintf("ip330StartRecorder: no port %s\n", portName ? portName : "");
+        return(-1);
+    }
+    if (!directory || !*directory) directory = ".";
+    if (segmentScans <= 0) segmentScans = RECORDER_SEGMENT_SCANS;
+    epicsMutexLock(pPvt->lock);
+    if (pPvt->pRecorder || pPvt->recorderRequest) {
+        epicsMutexUnlock(pPvt->lock);
+        errlogPrintf("ip330StartRecorder: %s is already recording\n", portName);
+        return(-1);
+    }
+    pClosed = pPvt->closedRecorder;
+    pPvt->closedRecorder = NULL;
+    epicsMutexUnlock(pPvt->lock);
+    ip330RecorderDestroy(pClosed);
+    pRec = ip330RecorderCreate(portName, directory, pPvt->firstChan,
+                               pPvt->lastChan - pPvt->firstChan + 1,
+                               calibrationSettings[pPvt->range][0].ideal_zero,
+                               calibrationSettings[pPvt->range][0].ideal_span,
+                               pPvt->actualScanPeriod, segmentScans);
+    if (!pRec) return(-1);
+    if (requestRecorder(pPvt, pRec)) {
+        ip330RecorderDestroy(pRec);
+        errlogPrintf("ip330StartRecorder: %s is already recording\n", portName);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Stop the recorder of a port.  The last segment is closed once the
+ * scans in the recorder's ring have been written, whether or not the card
+ * is still scanning. */
+int ip330StopRecorder(const char *portName)
+{
+    drvIp330Pvt *pPvt;
+
+    if (!portName || !(pPvt = findPort(portName))) {
+        errlogPrintf("ip330StopRecorder: no port %s\n", portName ? portName : "");
+        return(-1);
+    }
+    if (requestRecorder(pPvt, NULL)) {
+        errlogPrintf("ip330StopRecorder: %s has a recorder request pending\n",
+                     portName);
+        return(-1);
+    }
     return(0);
 }
 
+static void reportThreadPolicy(FILE *fp, const char *name,
+                               const ip330ThreadPolicy *pPolicy)
+{
+    if (!pPolicy->applied && !pPolicy->pending) return;
+    fprintf(fp, "    %s thread policy cpus=\"%s\", SCHED_FIFO priority=%d, %s\n",
+            name, pPolicy->cpuList, pPolicy->priority,
+            pPolicy->pending ? "pending" :
+            pPolicy->status ? strerror(pPolicy->status) : "applied");
+}
+
 static asynStatus readInt32(void *drvPvt, asynUser *pasynUser, 
                             epicsInt32 *value)
 {
     drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     int channel;
+    double dvalue;
     ip330Command command = pasynUser->reason;
 
     if (pPvt->rebooting) epicsThreadSuspendSelf();
     pasynManager->getAddr(pasynUser, &channel);
     if (command == ip330Data) {
         *value = pPvt->correctedData[channel];
+    } else if (command == ip330Average) {
+        readAverage(pPvt, pasynUser, channel, &dvalue);
+        *value = (epicsInt32)floor(dvalue + 0.5);
+    } else if (command == ip330BlockSize) {
+        *value = pPvt->requestedBlockSize;
     } else if (command == ip330Gain) {
         *value = pPvt->chanSettings[channel].gain;
     } else if (command == ip330ScanMode) {
         *value = pPvt->scanMode;    
+    } else if (command == ip330RingDepth) {
+        *value = pPvt->ringMask + 1;
+    } else if (command == ip330RingHighWater) {
+        *value = pPvt->ringHighWater;
+    } else if (command == ip330RingOverruns) {
+        *value = pPvt->ringOverruns;
+    } else if (command == ip330MissedData) {
+        *value = pPvt->missedData[channel];
+    } else if (command == ip330PingPongErrors) {
+        *value = pPvt->pingPongErrors;
+    } else if (command == ip330CaptureDepth) {
+        *value = pPvt->requestedCaptureDepth;
+    } else if (command == ip330CapturePost) {
+        *value = pPvt->capturePost;
+    } else if (command == ip330CaptureState) {
+        *value = pPvt->captureState;
+    } else if (command == ip330Filtered) {
+        *value = (epicsInt32)floor(pPvt->filteredData[channel] + 0.5);
+    } else if (command == ip330SpectrumSize) {
+        *value = pPvt->requestedSpectrumSize;
+    } else if (command == ip330SpectrumWindow) {
+        *value = pPvt->spectrumWindow;
+    } else if (command == ip330SpectrumAverages) {
+        *value = pPvt->spectrumAverages;
+    } else if (command == ip330FirstChan) {
+        *value = pPvt->firstChan;
+    } else if (command == ip330LastChan) {
+        *value = pPvt->lastChan;
+    } else if (command == ip330DeadbandSuppressed) {
+        if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::readInt32 invalid channel %d", channel);
+            return(asynError);
+        }
+        *value = pPvt->deadbandSuppressed[channel];
+    } else if (command == ip330StatWindow) {
+        *value = pPvt->requestedStatWindow;
+    } else if ((command >= ip330StatMean) && (command <= ip330StatMax)) {
+        dvalue = readStatistic(pPvt, command, channel, &pasynUser->timestamp);
+        *value = (epicsInt32)floor(dvalue + 0.5);
     } else {
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
                       "drvIp330::readInt32 invalid command=%d",
@@ -591,16 +1736,57 @@ static asynStatus readFloat64(void *drvPvt, asynUser *pasynUser,
 {
     drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     int ivalue;
+    int channel;
     asynStatus status = asynSuccess;
     ip330Command command = pasynUser->reason;
 
     if (command == ip330Data) {
         status = readInt32(drvPvt, pasynUser, &ivalue);
         *value = (double)ivalue;
+    } else if (command == ip330Average) {
+        pasynManager->getAddr(pasynUser, &channel);
+        readAverage(pPvt, pasynUser, channel, value);
     } else if (command == ip330ScanPeriod) {
         *value = getScanPeriod(drvPvt, pasynUser);
     } else if (command == ip330CalibratePeriod) {
         *value = pPvt->secondsBetweenCalibrate;
+    } else if (command == ip330CalibrateGap) {
+        *value = pPvt->calLastGap;
+    } else if ((command >= ip330LatencyQueue) && (command <= ip330ScanJitter)) {
+        *value = pPvt->histograms[command - ip330LatencyQueue].max;
+    } else if (command == ip330Filtered) {
+        pasynManager->getAddr(pasynUser, &channel);
+        *value = pPvt->filteredData[channel];
+    } else if ((command >= ip330StatMean) && (command <= ip330StatMax)) {
+        pasynManager->getAddr(pasynUser, &channel);
+        *value = readStatistic(pPvt, command, channel, &pasynUser->timestamp);
+    } else if ((command >= ip330Egu) && (command <= ip330EguOffset)) {
+        pasynManager->getAddr(pasynUser, &channel);
+        if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::readFloat64 invalid channel %d", channel);
+            return(asynError);
+        }
+        if (command == ip330Egu)
+            *value = pPvt->eguData[channel];
+        else if (command == ip330EguSlope)
+            *value = pPvt->requestedEguSlope[channel];
+        else
+            *value = pPvt->requestedEguOffset[channel];
+    } else if ((command >= ip330Deadband) && (command <= ip330DeadbandHeartbeat)) {
+        pasynManager->getAddr(pasynUser, &channel);
+        if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::readFloat64 invalid channel %d", channel);
+            return(asynError);
+        }
+        if (command == ip330Deadband)
+            *value = pPvt->deadband[channel];
+        else if (command == ip330DeadbandEgu)
+            *value = pPvt->deadband[channel] *
+                     fabs(pPvt->requestedEguSlope[channel]);
+        else
+            *value = pPvt->deadbandHeartbeat[channel];
     } else {
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
                       "drvIp330::readFloat64 invalid command=%d",
@@ -612,52 +1798,265 @@ static asynStatus readFloat64(void *drvPvt, asynUser *pasynUser,
     return(status);
 }
 
-static asynStatus getBounds(void *drvPvt, asynUser *pasynUser,
-                            epicsInt32 *low, epicsInt32 *high)
+/* Corrected counts as a signed 16 bit value, offset by half scale */
+static epicsInt16 countsToInt16(int counts)
 {
-    *low = 0;
-    *high = 65535;
-    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
-              "drvIp330::getBounds,low=%d, high=%d\n", *low, *high);
-    return(asynSuccess);
+    counts -= 32768;
+    if (counts < -32768) counts = -32768;
+    if (counts > 32767) counts = 32767;
+    return((epicsInt16)counts);
 }
 
-static asynStatus writeInt32(void *drvPvt, asynUser *pasynUser, 
-                             epicsInt32 value)
+static asynStatus readInt16Array(void *drvPvt, asynUser *pasynUser,
+                                 epicsInt16 *value, size_t nelements,
+                                 size_t *nIn)
 {
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     ip330Command command = pasynUser->reason;
-    asynStatus status;
+    size_t i, n = pPvt->lastChan - pPvt->firstChan + 1;
 
-    if (command == ip330Gain) {
-        status = setGain(drvPvt, pasynUser, value);
-    } else if (command == ip330ScanMode) {
-        status = setScanMode(drvPvt, value);    
-    } else {
+    if (command != ip330Data) {
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
-                      "drvIp330::writeInt32D invalid command=%d",
+                      "drvIp330::readInt16Array invalid command=%d",
                       command);
         return(asynError);
     }
+    /* Converted here, compactInt16 belongs to intTask */
+    if (n > nelements) n = nelements;
+    for (i=0; i<n; i++)
+        value[i] = countsToInt16(pPvt->correctedData[pPvt->firstChan + i]);
+    *nIn = n;
     asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
-                  "drvIp330::writeInt32, command=%d, value=%d\n", command, value);
-    return(status);
+              "drvIp330::readInt16Array, command=%d, nIn=%d\n", command, (int)n);
+    return(asynSuccess);
 }
 
-static asynStatus writeFloat64(void *drvPvt, asynUser *pasynUser, 
-                               epicsFloat64 value)
+static asynStatus readFloat32Array(void *drvPvt, asynUser *pasynUser,
+                                   epicsFloat32 *value, size_t nelements,
+                                   size_t *nIn)
 {
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     ip330Command command = pasynUser->reason;
-    asynStatus status=asynError;
+    size_t i, n = pPvt->lastChan - pPvt->firstChan + 1;
 
-    if (command == ip330Data) {
+    if (command != ip330Data) {
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
-                      "drvIp330::writeFloat64 invalid command=%d",
+                      "drvIp330::readFloat32Array invalid command=%d",
                       command);
         return(asynError);
-    } else if (command == ip330ScanPeriod) {
+    }
+    if (n > nelements) n = nelements;
+    for (i=0; i<n; i++)
+        value[i] = (epicsFloat32)pPvt->correctedData[pPvt->firstChan + i];
+    *nIn = n;
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::readFloat32Array, command=%d, nIn=%d\n", command, (int)n);
+    return(asynSuccess);
+}
+
+static asynStatus readInt32Array(void *drvPvt, asynUser *pasynUser,
+                                 epicsInt32 *value, size_t nelements,
+                                 size_t *nIn)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    ip330Command command = pasynUser->reason;
+    size_t n = IP330_HISTOGRAM_BUCKETS;
+    int channel, scans;
+    ip330CaptureBuffers *pCapture;
+    unsigned int generation;
+
+    if (command == ip330CaptureData) {
+        pasynManager->getAddr(pasynUser, &channel);
+        if ((channel < pPvt->firstChan) || (channel > pPvt->lastChan)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::readInt32Array channel %d not active",
+                          channel);
+            return(asynError);
+        }
+        /* Buffers are only freed by the port thread, so pCapture stays
+         * valid.  Copy again if the capture thread published meanwhile. */
+        pCapture = pPvt->pCapture;
+        n = 0;
+        if (pCapture) {
+            do {
+                generation = pCapture->generation;
+                epicsAtomicReadMemoryBarrier();
+                scans = pCapture->scans[generation & 1];
+                n = scans;
+                if (n > nelements) n = nelements;
+                if (n > 0)
+                    memcpy(value, pCapture->data[generation & 1] +
+                                  (channel - pPvt->firstChan) * scans,
+                           n * sizeof(epicsInt32));
+                pasynUser->timestamp = pCapture->time[generation & 1];
+                epicsAtomicReadMemoryBarrier();
+            } while (generation != pCapture->generation);
+        }
+        *nIn = n;
+        return(asynSuccess);
+    }
+    if ((command < ip330LatencyQueue) || (command > ip330ScanJitter)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::readInt32Array invalid command=%d",
+                      command);
+        return(asynError);
+    }
+    if (n > nelements) n = nelements;
+    memcpy(value, pPvt->histograms[command - ip330LatencyQueue].counts,
+           n * sizeof(epicsInt32));
+    *nIn = n;
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::readInt32Array, command=%d, nIn=%d\n", command, (int)n);
+    return(asynSuccess);
+}
+
+static asynStatus getBounds(void *drvPvt, asynUser *pasynUser,
+                            epicsInt32 *low, epicsInt32 *high)
+{
+    *low = 0;
+    *high = 65535;
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::getBounds,low=%d, high=%d\n", *low, *high);
+    return(asynSuccess);
+}
+
+static asynStatus writeInt32(void *drvPvt, asynUser *pasynUser, 
+                             epicsInt32 value)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    ip330Command command = pasynUser->reason;
+    asynStatus status;
+
+    if (command == ip330Gain) {
+        status = setGain(drvPvt, pasynUser, value);
+    } else if (command == ip330BlockSize) {
+        status = setBlockSize(drvPvt, pasynUser, value);
+    } else if (command == ip330ScanMode) {
+        status = setScanMode(drvPvt, value);    
+    } else if (command == ip330CaptureDepth) {
+        if ((value < 0) || (value > MAX_CAPTURE_DEPTH)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 illegal capture depth %d",
+                          value);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->lock);
+        if (value && !pPvt->captureThreadId) {
+            pPvt->captureThreadId = epicsThreadCreate("ip330Capture",
+                              epicsThreadPriorityLow,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)captureTask, pPvt);
+        }
+        epicsMutexUnlock(pPvt->lock);
+        if (value && !pPvt->captureThreadId) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 cannot create capture thread");
+            return(asynError);
+        }
+        status = setCaptureDepth(pPvt, pasynUser, value);
+    } else if (command == ip330CapturePost) {
+        if (value < 0) value = 0;
+        pPvt->capturePost = value;
+        status = asynSuccess;
+    } else if (command == ip330CaptureState) {
+        if ((value != ip330CaptureArmed) && (value != ip330CaptureTriggered)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 capture state can only be "
+                          "set to armed or triggered");
+            return(asynError);
+        }
+        freeCaptureBuffers(handoffTake(&pPvt->captureOld));
+        /* intTask acts on this at the next scan, or once the capture
+         * thread is done with a frozen history */
+        pPvt->captureRequest = value;
+        status = asynSuccess;
+    } else if (command == ip330SpectrumSize) {
+        if ((value != 0) && ((value < MIN_SPECTRUM_SIZE) ||
+                             (value > MAX_SPECTRUM_SIZE) || (value & (value - 1)))) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 spectrum size must be 0 or a "
+                          "power of 2 from %d to %d", MIN_SPECTRUM_SIZE,
+                          MAX_SPECTRUM_SIZE);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->lock);
+        if (value && !pPvt->spectrumThreadId) {
+            pPvt->spectrumThreadId = epicsThreadCreate("ip330Spectrum",
+                              epicsThreadPriorityLow,
+                              epicsThreadGetStackSize(epicsThreadStackMedium),
+                              (EPICSTHREADFUNC)spectrumTask, pPvt);
+        }
+        epicsMutexUnlock(pPvt->lock);
+        if (value && !pPvt->spectrumThreadId) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 cannot create spectrum thread");
+            return(asynError);
+        }
+        status = setSpectrumSize(pPvt, pasynUser, value);
+    } else if (command == ip330SpectrumWindow) {
+        if ((value < ip330WindowRectangular) || (value > ip330WindowFlatTop)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 illegal spectrum window %d",
+                          value);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->spectrumLock);
+        pPvt->spectrumWindow = value;
+        epicsMutexUnlock(pPvt->spectrumLock);
+        status = asynSuccess;
+    } else if (command == ip330SpectrumAverages) {
+        if ((value < 1) || (value > MAX_SPECTRUM_AVERAGES)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 spectrum averages must be 1 "
+                          "to %d", MAX_SPECTRUM_AVERAGES);
+            return(asynError);
+        }
+        pPvt->spectrumAverages = value;
+        status = asynSuccess;
+    } else if (command == ip330StatWindow) {
+        if ((value < 0) || (value > MAX_STAT_WINDOW)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeInt32 illegal statistics window %d",
+                          value);
+            return(asynError);
+        }
+        /* intTask switches at the start of the next window */
+        pPvt->requestedStatWindow = value;
+        status = asynSuccess;
+    } else if (command == ip330HistogramReset) {
+        /* intTask clears the histograms before it next writes them */
+        pPvt->histogramReset = 1;
+        status = asynSuccess;
+    } else {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::writeInt32D invalid command=%d",
+                      command);
+        return(asynError);
+    }
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                  "drvIp330::writeInt32, command=%d, value=%d\n", command, value);
+    return(status);
+}
+
+static asynStatus writeFloat64(void *drvPvt, asynUser *pasynUser, 
+                               epicsFloat64 value)
+{
+    ip330Command command = pasynUser->reason;
+    asynStatus status=asynError;
+
+    if (command == ip330Data) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::writeFloat64 invalid command=%d",
+                      command);
+        return(asynError);
+    } else if (command == ip330ScanPeriod) {
         status = setScanPeriod(drvPvt, pasynUser, value);
     } else if (command == ip330CalibratePeriod) {
         status = setSecondsBetweenCalibrate(drvPvt, pasynUser, value);
+    } else if ((command == ip330EguSlope) || (command == ip330EguOffset)) {
+        status = setEguScaling(drvPvt, pasynUser, command, value);
+    } else if ((command >= ip330Deadband) && (command <= ip330DeadbandHeartbeat)) {
+        status = setDeadband(drvPvt, pasynUser, command, value);
     } else {
         epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
                       "drvIp330::writeFloat64 invalid command=%d",
@@ -669,203 +2068,2238 @@ static asynStatus writeFloat64(void *drvPvt, asynUser *pasynUser,
     return(status);
 }
 
-static void correctAll(drvIp330Pvt *pPvt)
+static asynStatus readFloat64Array(void *drvPvt, asynUser *pasynUser,
+                                   epicsFloat64 *value, size_t nelements,
+                                   size_t *nIn)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    ip330FilterCoefficients *pFilter = &pPvt->requestedFilter;
+    ip330Command command = pasynUser->reason;
+    const double *pData;
+    size_t i, n = 0;
+    int channel;
+
+    pasynManager->getAddr(pasynUser, &channel);
+    if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::readFloat64Array invalid channel %d", channel);
+        return(asynError);
+    }
+    if (command == ip330Egu) {
+        n = MAX_IP330_CHANNELS;
+        if (n > nelements) n = nelements;
+        memcpy(value, pPvt->eguData, n * sizeof(epicsFloat64));
+        pasynUser->timestamp = pPvt->scanTime;
+        *nIn = n;
+        return(asynSuccess);
+    }
+    if ((command == ip330SpectrumMagnitude) || (command == ip330SpectrumPsd) ||
+        (command == ip330SpectrumFreq)) {
+        if ((command != ip330SpectrumFreq) &&
+            ((channel < pPvt->firstChan) || (channel > pPvt->lastChan))) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::readFloat64Array channel %d not active",
+                          channel);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->spectrumLock);
+        n = pPvt->spectrumPoints;
+        if (n > nelements) n = nelements;
+        if (n > 0) {
+            if (command == ip330SpectrumFreq)
+                pData = pPvt->spectrumFreq;
+            else
+                pData = ((command == ip330SpectrumMagnitude) ?
+                         pPvt->spectrumMagnitude : pPvt->spectrumPsd) +
+                        (channel - pPvt->firstChan) * pPvt->spectrumPoints;
+            memcpy(value, pData, n * sizeof(epicsFloat64));
+        }
+        pasynUser->timestamp = pPvt->spectrumTimestamp;
+        epicsMutexUnlock(pPvt->spectrumLock);
+        *nIn = n;
+        return(asynSuccess);
+    }
+    epicsMutexLock(pPvt->lock);
+    if (command == ip330FilterBiquad) {
+        for (i=0; (i < (size_t)pFilter->sections[channel]*IP330_BIQUAD_COEFS) &&
+                  (i < nelements); i++)
+            value[n++] = pFilter->biquad[i / IP330_BIQUAD_COEFS]
+                                        [i % IP330_BIQUAD_COEFS][channel];
+    } else if (command == ip330FilterFir) {
+        for (i=0; (i < (size_t)pFilter->taps[channel]) && (i < nelements); i++)
+            value[n++] = pFilter->fir[i][channel];
+    } else {
+        epicsMutexUnlock(pPvt->lock);
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::readFloat64Array invalid command=%d",
+                      command);
+        return(asynError);
+    }
+    epicsMutexUnlock(pPvt->lock);
+    *nIn = n;
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::readFloat64Array, command=%d, nIn=%d\n", command, (int)n);
+    return(asynSuccess);
+}
+
+static asynStatus writeFloat64Array(void *drvPvt, asynUser *pasynUser,
+                                    epicsFloat64 *value, size_t nelements)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    ip330Command command = pasynUser->reason;
+    int channel;
+
+    pasynManager->getAddr(pasynUser, &channel);
+    if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::writeFloat64Array invalid channel %d", channel);
+        return(asynError);
+    }
+    if (command == ip330FilterBiquad) {
+        if ((nelements % IP330_BIQUAD_COEFS) ||
+            (nelements > IP330_FILTER_SECTIONS*IP330_BIQUAD_COEFS)) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeFloat64Array need %d values per "
+                          "section, at most %d sections", IP330_BIQUAD_COEFS,
+                          IP330_FILTER_SECTIONS);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->lock);
+        ip330FilterSet(&pPvt->requestedFilter, channel, value,
+                       nelements / IP330_BIQUAD_COEFS, NULL, 0);
+    } else if (command == ip330FilterFir) {
+        if (nelements > IP330_FILTER_TAPS) {
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::writeFloat64Array at most %d FIR taps",
+                          IP330_FILTER_TAPS);
+            return(asynError);
+        }
+        epicsMutexLock(pPvt->lock);
+        ip330FilterSet(&pPvt->requestedFilter, channel, NULL, 0, value,
+                       nelements);
+    } else {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::writeFloat64Array invalid command=%d",
+                      command);
+        return(asynError);
+    }
+    /* intTask copies the new filter at the next scan */
+    publishFilter(pPvt);
+    epicsMutexUnlock(pPvt->lock);
+    asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::writeFloat64Array, command=%d, nelements=%d\n",
+              command, (int)nelements);
+    return(asynSuccess);
+}
+
+/* Publish requestedFilter to intTask.  Called with lock held. */
+static void publishFilter(drvIp330Pvt *pPvt)
+{
+    unsigned int generation = pPvt->filterGeneration;
+
+    pPvt->publishedFilter[(generation + 1) & 1] = pPvt->requestedFilter;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->filterGeneration = generation + 1;
+}
+
+static void setCoefficients(drvIp330Pvt *pPvt, int channel, 
+                            double slope, double offset)
+{
+    unsigned int generation;
+    ip330Coefficients *pNext;
+
+    epicsMutexLock(pPvt->lock);
+    generation = pPvt->coefGeneration;
+    pNext = &pPvt->coefficients[(generation + 1) & 1];
+    *pNext = pPvt->coefficients[generation & 1];
+    pNext->adj_slope[channel] = slope;
+    pNext->adj_offset[channel] = offset;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->coefGeneration = generation + 1;
+    epicsMutexUnlock(pPvt->lock);
+}
+
+/* Store the calibration of a gain and publish it to every channel which
+ * uses that gain, in a single generation */
+static void setGainCoefficients(drvIp330Pvt *pPvt, int gain, 
+                                double slope, double offset)
+{
+    unsigned int generation;
+    ip330Coefficients *pNext;
+    int i;
+
+    epicsMutexLock(pPvt->lock);
+    pPvt->gainCalibration[gain].adj_slope = slope;
+    pPvt->gainCalibration[gain].adj_offset = offset;
+    epicsTimeGetCurrent(&pPvt->gainCalibration[gain].time);
+    pPvt->gainCalibration[gain].valid = 1;
+    generation = pPvt->coefGeneration;
+    pNext = &pPvt->coefficients[(generation + 1) & 1];
+    *pNext = pPvt->coefficients[generation & 1];
+    for (i=0; i<MAX_IP330_CHANNELS; i++) {
+        if (pPvt->chanSettings[i].gain != gain) continue;
+        pNext->adj_slope[i] = slope;
+        pNext->adj_offset[i] = offset;
+    }
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->coefGeneration = generation + 1;
+    epicsMutexUnlock(pPvt->lock);
+}
+
+/* Returns 1 if the cached calibration of a gain can be used */
+static int gainCalibrationValid(drvIp330Pvt *pPvt, int gain)
 {
-    int value, raw;
+    epicsTimeStamp now;
+
+    if (!pPvt->gainCalibration[gain].valid) return(0);
+    if (pPvt->secondsBetweenCalibrate <= 0) return(1);
+    epicsTimeGetCurrent(&now);
+    return(epicsTimeDiffInSeconds(&now, &pPvt->gainCalibration[gain].time) <
+           pPvt->secondsBetweenCalibrate);
+}
+
+/* Returns the calibration generation used, IP330_RECORD_UNCALIBRATED if
+ * the raw values were passed through */
+static unsigned int correctAll(drvIp330Pvt *pPvt, const ip330Frame *pFrame)
+{
+    int first = pPvt->firstChan;
+    int n = pPvt->lastChan - pPvt->firstChan + 1;
     int i;
+    unsigned int generation;
+    const ip330Coefficients *pCoef;
 
     if (pPvt->rebooting) epicsThreadSuspendSelf();
     if (pPvt->secondsBetweenCalibrate < 0) {
-        for (i=0; i<MAX_IP330_CHANNELS; i++) {
-           pPvt->correctedData[i] = pPvt->chanData[i];
+        for (i=first; i<=pPvt->lastChan; i++) {
+           pPvt->chanData[i] = pFrame->data[i];
+           pPvt->correctedData[i] = pFrame->data[i];
         }
+        return(IP330_RECORD_UNCALIBRATED);
     } else {
-        epicsMutexLock(pPvt->lock);
-        for (i=0; i<MAX_IP330_CHANNELS; i++) {
-           raw = pPvt->chanData[i];
-           value = (int) (pPvt->chanSettings[i].adj_slope *
-                   (((double)raw + pPvt->chanSettings[i].adj_offset)));
-           pPvt->correctedData[i] = value;
-        }
-        epicsMutexUnlock(pPvt->lock);
+        do {
+            generation = pPvt->coefGeneration;
+            epicsAtomicReadMemoryBarrier();
+            pCoef = &pPvt->coefficients[generation & 1];
+            ip330Correct(&pFrame->data[first],
+                         &pCoef->adj_slope[first], &pCoef->adj_offset[first],
+                         &pPvt->chanData[first], &pPvt->correctedData[first], n);
+            epicsAtomicReadMemoryBarrier();
+        } while (generation != pPvt->coefGeneration);
     }
+    return(generation);
 }
 
 static asynStatus setGain(void *drvPvt, asynUser *pasynUser, 
                           int gain)
 {
-    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
-    int status = 0;
-    int channel;
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    int status = 0;
+    int channel;
+
+    pasynManager->getAddr(pasynUser, &channel);
+
+    if (pPvt->rebooting) epicsThreadSuspendSelf();
+    if(gain<0 || gain>nGains || channel<0 || channel>pPvt->lastChan) 
+       return(-1);
+    if(gain != pPvt->chanSettings[channel].gain) 
+       status = setGainPrivate(pPvt, pPvt->range, gain, channel);
+    return(status);
+}
+
+static int setGainPrivate(drvIp330Pvt *pPvt, int range, int gain, int channel)
+{
+    unsigned short saveControl;
+
+    if (pPvt->rebooting) epicsThreadSuspendSelf();
+    if(gain<0 || gain>=nGains) {
+        asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
+                  "drvIp330::setGainPrivate illegal gain value %d\n", gain);
+        return(-1);
+    }
+    saveControl = pPvt->regs->control;
+    pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+    pPvt->chanSettings[channel].gain = gain;
+    pPvt->chanSettings[channel].volt_callo = 
+                                calibrationSettings[range][gain].volt_callo;
+    pPvt->chanSettings[channel].volt_calhi = 
+                                calibrationSettings[range][gain].volt_calhi;
+    pPvt->chanSettings[channel].ctl_callo = 
+                                calibrationSettings[range][gain].ctl_callo;
+    pPvt->chanSettings[channel].ctl_calhi = 
+                                calibrationSettings[range][gain].ctl_calhi;
+    pPvt->chanSettings[channel].ideal_span = 
+                                calibrationSettings[range][gain].ideal_span;
+    pPvt->chanSettings[channel].ideal_zero = 
+                                calibrationSettings[range][gain].ideal_zero;
+    pPvt->regs->gain[channel] = gain;
+    pPvt->regs->control = saveControl;
+    if (!pPvt->eguCustom[channel]) setEguVolts(pPvt, channel);
+    /* Channels with the same gain share one calibration */
+    if (!gainCalibrationValid(pPvt, gain) && (calibrate(pPvt, gain) != 0)) {
+        if (!pPvt->gainCalibration[gain].valid) {
+            asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
+                      "drvIp330::setGainPrivate calibration failed, "
+                      "channel %d gain %d is not calibrated\n",
+                      channel, gain);
+            return(-1);
+        }
+        asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
+                  "drvIp330::setGainPrivate calibration failed, "
+                  "using previous calibration of gain %d\n", gain);
+    }
+    setCoefficients(pPvt, channel, 
+                    pPvt->gainCalibration[gain].adj_slope,
+                    pPvt->gainCalibration[gain].adj_offset);
+    return(0);
+}
+
+/* Scale a channel to volts at the input, for its range and gain */
+static void setEguVolts(drvIp330Pvt *pPvt, int channel)
+{
+    ip330ADCSettings *pSettings = &pPvt->chanSettings[channel];
+
+    epicsMutexLock(pPvt->lock);
+    pPvt->requestedEguSlope[channel] = 
+        pSettings->ideal_span / 65536. / pgaGain[pSettings->gain];
+    pPvt->requestedEguOffset[channel] = 
+        pSettings->ideal_zero / pgaGain[pSettings->gain];
+    publishEgu(pPvt);
+    epicsMutexUnlock(pPvt->lock);
+}
+
+/* Publish requestedEguSlope and requestedEguOffset to intTask.  Called
+ * with lock held. */
+static void publishEgu(drvIp330Pvt *pPvt)
+{
+    unsigned int generation = pPvt->eguGeneration;
+
+    memcpy(pPvt->publishedEguSlope[(generation + 1) & 1],
+           pPvt->requestedEguSlope, sizeof(pPvt->requestedEguSlope));
+    memcpy(pPvt->publishedEguOffset[(generation + 1) & 1],
+           pPvt->requestedEguOffset, sizeof(pPvt->requestedEguOffset));
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->eguGeneration = generation + 1;
+}
+
+static asynStatus setEguScaling(void *drvPvt, asynUser *pasynUser,
+                                int command, double value)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    int channel;
+
+    pasynManager->getAddr(pasynUser, &channel);
+    if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setEguScaling invalid channel %d", channel);
+        return(asynError);
+    }
+    if ((command == ip330EguSlope) && (value == 0.)) {
+        pPvt->eguCustom[channel] = 0;
+        setEguVolts(pPvt, channel);
+        return(asynSuccess);
+    }
+    epicsMutexLock(pPvt->lock);
+    if (command == ip330EguSlope)
+        pPvt->requestedEguSlope[channel] = value;
+    else
+        pPvt->requestedEguOffset[channel] = value;
+    pPvt->eguCustom[channel] = 1;
+    /* intTask copies the new scaling at the next scan */
+    publishEgu(pPvt);
+    epicsMutexUnlock(pPvt->lock);
+    return(asynSuccess);
+}
+
+static int setTrigger(drvIp330Pvt *pPvt, triggerType trig)
+{
+    if (pPvt->rebooting) epicsThreadSuspendSelf();
+    if (trig < 0 || trig >= nTriggers) return(-1);
+    pPvt->trigger = trig;
+    if (pPvt->trigger == output) pPvt->regs->control |= CTL_TRIGGER_OUTPUT;
+    return(0);
+}
+
+static int setScanMode(drvIp330Pvt *pPvt, scanModeType mode)
+{
+    if (pPvt->rebooting) epicsThreadSuspendSelf();
+    if ((mode < disable) || (mode > convertOnExternalTriggerOnly)) return(-1);
+    pPvt->scanMode = mode;
+    pPvt->scanBreak = 1;
+    pPvt->regs->control &= ~CTL_SCAN_MASK; /* Kill all scan bits first */
+    pPvt->regs->control |= pPvt->scanMode << CTL_SCAN_SHIFT;
+    setSampleInterval(pPvt);
+    return(0);
+}
+
+static void intFunc(int card)
+{
+    drvIp330Pvt *pPvt = driverTable[card];
+    int i;
+    unsigned int head = pPvt->ringHead;
+    unsigned int used = head - pPvt->ringTail;
+    ip330Frame *pFrame;
+    epicsUInt16 *data;
+    epicsTimeStamp entryTime;
+    int key;
+
+    getInterruptTime(&entryTime);
+#ifdef linux
+    asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::intFunc entry, card=%d\n", card);
+#endif
+    if (pPvt->calWaiting) {
+        /* This interrupt is the end of a blocking calibration burst */
+        pPvt->calWaiting = 0;
+        pPvt->scanBreak = 1;
+        epicsEventSignal(pPvt->calEventId);
+        return;
+    }
+    if (pPvt->calState != calIdle) {
+        /* This interrupt is the end of a calibration burst */
+        calibrateInterrupt(pPvt);
+        pPvt->scanBreak = 1;
+        wakeWorkers(pPvt);
+        return;
+    }
+    if (pPvt->type == differential) {
+       /* Must alternate between reading data from mailBox[i] and mailBox[i+16]
+        * Except in case of uniform/burstSingle, where only half of mailbox is 
+        * used. */
+       if(pPvt->scanMode == uniformSingle || pPvt->scanMode==burstSingle 
+                                          || pPvt->mailBoxOffset==16)
+          pPvt->mailBoxOffset = 0; 
+       else 
+          pPvt->mailBoxOffset = 16;
+    }
+    checkMissedData(pPvt);
+    if (used > pPvt->ringMask) {
+        /* Ring is full, intTask is not keeping up.  Drop this scan. */
+        pPvt->ringOverruns++;
+        pPvt->scanBreak = 1;
+    } else {
+        /* Copy the mailbox straight into the next free slot */
+        pFrame = &pPvt->frameRing[head & pPvt->ringMask];
+        pFrame->time = entryTime;
+        pFrame->follows = !pPvt->scanBreak;
+        pPvt->scanBreak = 0;
+        data = pFrame->data;
+        for (i = pPvt->firstChan; i <= pPvt->lastChan; i++) {
+            data[i] = (pPvt->regs->mailBox[i + pPvt->mailBoxOffset]);
+        }
+        if ((int)used + 1 > pPvt->ringHighWater) pPvt->ringHighWater = used + 1;
+        /* The frame contents must be visible before the new head */
+        epicsAtomicWriteMemoryBarrier();
+        pPvt->ringHead = head + 1;
+    }
+    /* Steal the time until the next scan for a calibration step.  calBlocking
+     * is tested with the interrupt lock held so that calibrate either sees
+     * the step or stops it from starting. */
+    if (pPvt->calPassActive && !pPvt->calResultReady && !pPvt->rebooting) {
+        key = epicsInterruptLock();
+        if (!pPvt->calBlocking) startCalibrateStep(pPvt);
+        epicsInterruptUnlock(key);
+    }
+    /* Wake up the worker which calls the callback routines */
+    wakeWorkers(pPvt);
+    if (pPvt->rebooting) 
+        pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+}
+
+/* Called from intFunc before the mailbox is read.  Counts and clears the
+ * missedData bits, and in the differential continuous modes checks that
+ * the mailbox half the driver is about to read is the one with new data. */
+static void checkMissedData(drvIp330Pvt *pPvt)
+{
+    volatile ip330ADCregs *regs = pPvt->regs;
+    unsigned short missed[2];
+    unsigned short bit;
+    int half, i, chan;
+
+    if ((pPvt->type == differential) && 
+        ((pPvt->scanMode == uniformContinuous) ||
+         (pPvt->scanMode == burstContinuous))) {
+        half = pPvt->mailBoxOffset / 16;
+        bit = 1 << pPvt->firstChan;
+        if (!(regs->newData[half] & bit) && (regs->newData[!half] & bit)) {
+            pPvt->pingPongErrors++;
+            pPvt->mailBoxOffset ^= 16;
+        }
+    }
+    missed[0] = regs->missedData[0];
+    missed[1] = regs->missedData[1];
+    if (!(missed[0] | missed[1])) {
+        pPvt->missedDataStale = 0;
+        return;
+    }
+    regs->missedData[0] = 0;
+    regs->missedData[1] = 0;
+    if (pPvt->missedDataStale) {
+        pPvt->missedDataStale = 0;
+        return;
+    }
+    for (i=0; i<2*16; i++) {
+        if (!(missed[i/16] & (1 << (i%16)))) continue;
+        /* In differential mode both halves hold channels 0-15 */
+        chan = (pPvt->type == differential) ? i%16 : i;
+        if ((chan < pPvt->firstChan) || (chan > pPvt->lastChan)) continue;
+        pPvt->missedData[chan]++;
+        pPvt->missedTotal++;
+    }
+}
+
+/* Process up to maxFrames scans of one card.  Called by the dispatch worker
+ * which has claimed the card, so only one thread runs this per card at a
+ * time.  Returns the number of scans processed. */
+static int intTask(drvIp330Pvt *pPvt, int maxFrames)
+{
+    unsigned int tail;
+    int n;
+    int i, j, last;
+    double value;
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    ip330Dispatch *pd;
+    ip330Frame *pFrame;
+    int sampleTimesDone;
+    epicsTimeStamp dequeueTime, correctTime, doneTime;
+    int follows;
+    int timed;
+    unsigned int generation;
+
+    for (n=0; n<maxFrames; n++) {
+        if (pPvt->calResultReady || (pPvt->calSteps != pPvt->calStepsSeen))
+            finishCalibrateStep(pPvt);
+        tail = pPvt->ringTail;
+        if (tail == pPvt->ringHead) break;
+        /* Frame contents must not be read before the head that published it */
+        epicsAtomicReadMemoryBarrier();
+        epicsTimeGetCurrent(&dequeueTime);
+        pPvt->framesReceived++;
+        /* Correct the data in place, then hand the slot back to intFunc */
+        pFrame = &pPvt->frameRing[tail & pPvt->ringMask];
+        /* Without a time from intFunc the callbacks get the dequeue time,
+         * and the scan is left out of the histograms that need it */
+        timed = (pFrame->time.secPastEpoch != 0);
+        pPvt->scanTime = timed ? pFrame->time : dequeueTime;
+        follows = pFrame->follows;
+        generation = correctAll(pPvt, pFrame);
+        epicsTimeGetCurrent(&correctTime);
+        if (pPvt->pRecorder || pPvt->recorderRequest)
+            recordScan(pPvt, pFrame, generation);
+        epicsAtomicWriteMemoryBarrier();
+        pPvt->ringTail = tail + 1;
+        filterAll(pPvt);
+        scaleAll(pPvt);
+        if (pPvt->deadbandChans) updateDeadband(pPvt);
+
+        /* Pass int32 interrupts */
+        sampleTimesDone = 0;
+        pd = dispatchStart(pPvt, dispatchInt32);
+        if (pd) {
+            computeSampleTimes(pPvt);
+            sampleTimesDone = 1;
+            last = dispatchFirst(pd, ip330Data, pPvt->lastChan+1);
+            for (i=dispatchFirst(pd, ip330Data, pPvt->firstChan); i<last; i++) {
+                asynInt32Interrupt *pint32Interrupt = pd->clients[i];
+                value = pPvt->correctedData[pint32Interrupt->addr];
+                if (!clientPass(pPvt, pint32Interrupt->pasynUser,
+                                pint32Interrupt->addr, &value)) continue;
+                pint32Interrupt->pasynUser->timestamp = 
+                    pPvt->sampleTime[pint32Interrupt->addr];
+                pint32Interrupt->callback(pint32Interrupt->userPvt, 
+                                          pint32Interrupt->pasynUser,
+                                          (epicsInt32)floor(value + 0.5));
+            }
+            last = dispatchFirst(pd, ip330Filtered, pPvt->lastChan+1);
+            for (i=dispatchFirst(pd, ip330Filtered, pPvt->firstChan); i<last; i++) {
+                asynInt32Interrupt *pint32Interrupt = pd->clients[i];
+                value = pPvt->filteredData[pint32Interrupt->addr];
+                if (!clientPass(pPvt, pint32Interrupt->pasynUser,
+                                pint32Interrupt->addr, &value)) continue;
+                pint32Interrupt->pasynUser->timestamp = 
+                    pPvt->sampleTime[pint32Interrupt->addr];
+                pint32Interrupt->callback(pint32Interrupt->userPvt, 
+                                          pint32Interrupt->pasynUser,
+                                          (epicsInt32)floor(value + 0.5));
+            }
+            dispatchEnd(pd);
+        }
+
+        /* Pass float64 interrupts */
+        pd = dispatchStart(pPvt, dispatchFloat64);
+        if (pd) {
+            if (!sampleTimesDone) computeSampleTimes(pPvt);
+            last = dispatchFirst(pd, ip330Data, pPvt->lastChan+1);
+            for (i=dispatchFirst(pd, ip330Data, pPvt->firstChan); i<last; i++) {
+                asynFloat64Interrupt *pfloat64Interrupt = pd->clients[i];
+                value = (double)pPvt->correctedData[pfloat64Interrupt->addr];
+                if (!clientPass(pPvt, pfloat64Interrupt->pasynUser,
+                                pfloat64Interrupt->addr, &value)) continue;
+                pfloat64Interrupt->pasynUser->timestamp = 
+                    pPvt->sampleTime[pfloat64Interrupt->addr];
+                pfloat64Interrupt->callback(pfloat64Interrupt->userPvt, 
+                                            pfloat64Interrupt->pasynUser,
+                                            value);
+            }
+            last = dispatchFirst(pd, ip330Filtered, pPvt->lastChan+1);
+            for (i=dispatchFirst(pd, ip330Filtered, pPvt->firstChan); i<last; i++) {
+                asynFloat64Interrupt *pfloat64Interrupt = pd->clients[i];
+                value = pPvt->filteredData[pfloat64Interrupt->addr];
+                if (!clientPass(pPvt, pfloat64Interrupt->pasynUser,
+                                pfloat64Interrupt->addr, &value)) continue;
+                pfloat64Interrupt->pasynUser->timestamp = 
+                    pPvt->sampleTime[pfloat64Interrupt->addr];
+                pfloat64Interrupt->callback(pfloat64Interrupt->userPvt, 
+                                            pfloat64Interrupt->pasynUser,
+                                            value);
+            }
+            last = dispatchFirst(pd, ip330Egu, pPvt->lastChan+1);
+            for (i=dispatchFirst(pd, ip330Egu, pPvt->firstChan); i<last; i++) {
+                asynFloat64Interrupt *pfloat64Interrupt = pd->clients[i];
+                value = pPvt->eguData[pfloat64Interrupt->addr];
+                if (!clientPass(pPvt, pfloat64Interrupt->pasynUser,
+                                pfloat64Interrupt->addr, &value)) continue;
+                pfloat64Interrupt->pasynUser->timestamp = 
+                    pPvt->sampleTime[pfloat64Interrupt->addr];
+                pfloat64Interrupt->callback(pfloat64Interrupt->userPvt, 
+                                            pfloat64Interrupt->pasynUser,
+                                            value);
+            }
+            dispatchEnd(pd);
+        }
+
+        /* Pass int32Array interrupts */
+        pd = dispatchStart(pPvt, dispatchInt32Array);
+        if (pd) {
+            last = dispatchFirst(pd, ip330Data+1, 0);
+            for (i=dispatchFirst(pd, ip330Data, 0); i<last; i++) {
+                asynInt32ArrayInterrupt *pint32ArrayInterrupt = pd->clients[i];
+                pint32ArrayInterrupt->pasynUser->timestamp = pPvt->scanTime;
+                pint32ArrayInterrupt->callback(pint32ArrayInterrupt->userPvt, 
+                                               pint32ArrayInterrupt->pasynUser,
+                                               pPvt->correctedData, 
+                                               MAX_IP330_CHANNELS);
+            }
+            dispatchEnd(pd);
+        }
+
+        /* Pass int16Array and float32Array interrupts, with the active
+         * channels only.  The arrays are only filled if there are clients. */
+        pd = dispatchStart(pPvt, dispatchInt16Array);
+        if (pd) {
+            last = dispatchFirst(pd, ip330Data+1, 0);
+            i = dispatchFirst(pd, ip330Data, 0);
+            if (i < last) {
+                for (j=0; j<nChans; j++)
+                    pPvt->compactInt16[j] = 
+                        countsToInt16(pPvt->correctedData[pPvt->firstChan + j]);
+            }
+            for (; i<last; i++) {
+                asynInt16ArrayInterrupt *pint16ArrayInterrupt = pd->clients[i];
+                pint16ArrayInterrupt->pasynUser->timestamp = pPvt->scanTime;
+                pint16ArrayInterrupt->callback(pint16ArrayInterrupt->userPvt, 
+                                               pint16ArrayInterrupt->pasynUser,
+                                               pPvt->compactInt16, nChans);
+            }
+            dispatchEnd(pd);
+        }
+        pd = dispatchStart(pPvt, dispatchFloat32Array);
+        if (pd) {
+            last = dispatchFirst(pd, ip330Data+1, 0);
+            i = dispatchFirst(pd, ip330Data, 0);
+            if (i < last) {
+                for (j=0; j<nChans; j++)
+                    pPvt->compactFloat32[j] = 
+                        (epicsFloat32)pPvt->correctedData[pPvt->firstChan + j];
+            }
+            for (; i<last; i++) {
+                asynFloat32ArrayInterrupt *pfloat32ArrayInterrupt = pd->clients[i];
+                pfloat32ArrayInterrupt->pasynUser->timestamp = pPvt->scanTime;
+                pfloat32ArrayInterrupt->callback(pfloat32ArrayInterrupt->userPvt, 
+                                                 pfloat32ArrayInterrupt->pasynUser,
+                                                 pPvt->compactFloat32, nChans);
+            }
+            dispatchEnd(pd);
+        }
+
+        /* Pass float64Array interrupts */
+        pd = dispatchStart(pPvt, dispatchFloat64Array);
+        if (pd) {
+            last = dispatchFirst(pd, ip330Egu+1, 0);
+            for (i=dispatchFirst(pd, ip330Egu, 0); i<last; i++) {
+                asynFloat64ArrayInterrupt *pfloat64ArrayInterrupt = pd->clients[i];
+                pfloat64ArrayInterrupt->pasynUser->timestamp = pPvt->scanTime;
+                pfloat64ArrayInterrupt->callback(pfloat64ArrayInterrupt->userPvt, 
+                                                 pfloat64ArrayInterrupt->pasynUser,
+                                                 pPvt->eguData, 
+                                                 MAX_IP330_CHANNELS);
+            }
+            dispatchEnd(pd);
+        }
+
+        accumulateAverage(pPvt);
+        if (pPvt->statWindow || pPvt->requestedStatWindow)
+            accumulateStatistics(pPvt);
+        accumulateBlock(pPvt);
+        if (pPvt->captureRequest || (pPvt->captureState == ip330CaptureArmed) ||
+            (pPvt->captureState == ip330CaptureTriggered))
+            accumulateCapture(pPvt);
+        if (pPvt->spectrumSize || pPvt->spectrumNewReady)
+            accumulateSpectrum(pPvt);
+        if ((pPvt->missedTotal != pPvt->missedTotalSeen) ||
+            (pPvt->pingPongErrors != pPvt->pingPongErrorsSeen))
+            doOverrunCallbacks(pPvt);
+        epicsTimeGetCurrent(&doneTime);
+        updateHistograms(pPvt, timed ? &pPvt->scanTime : NULL, follows,
+                         &dequeueTime, &correctTime, &doneTime);
+    }
+    return(n);
+}
+
+/* Run the filter stage on correctedData.  Only done when some channel has
+ * a filter, otherwise filteredData is a copy of correctedData. */
+static void filterAll(drvIp330Pvt *pPvt)
+{
+    int first = pPvt->firstChan;
+    int n = pPvt->lastChan - pPvt->firstChan + 1;
+    unsigned int serial[MAX_IP330_CHANNELS];
+    unsigned int generation;
+    int i;
+
+    if (pPvt->filterGeneration != pPvt->filterGenerationSeen) {
+        memcpy(serial, pPvt->filter.serial, sizeof(serial));
+        do {
+            generation = pPvt->filterGeneration;
+            epicsAtomicReadMemoryBarrier();
+            pPvt->filter = pPvt->publishedFilter[generation & 1];
+            epicsAtomicReadMemoryBarrier();
+        } while (generation != pPvt->filterGeneration);
+        pPvt->filterGenerationSeen = generation;
+        for (i=first; i<first+n; i++) {
+            if (pPvt->filter.serial[i] != serial[i])
+                ip330FilterPrime(&pPvt->filter, &pPvt->filterState, i,
+                                 (double)pPvt->correctedData[i]);
+        }
+    }
+    if (pPvt->filter.nSections || pPvt->filter.nTaps) {
+        ip330Filter(&pPvt->filter, &pPvt->filterState, pPvt->correctedData,
+                    pPvt->filteredData, first, n);
+    } else {
+        for (i=first; i<first+n; i++) pPvt->filteredData[i] = pPvt->correctedData[i];
+    }
+}
+
+/* Decide which active channels with a deadband get callbacks this scan */
+static void updateDeadband(drvIp330Pvt *pPvt)
+{
+    int i, delta;
+
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
+        delta = pPvt->correctedData[i] - pPvt->deadbandLast[i];
+        if ((pPvt->deadband[i] <= 0.) ||
+            (pPvt->deadbandLastTime[i].secPastEpoch == 0) ||
+            (abs(delta) > pPvt->deadband[i]) ||
+            ((pPvt->deadbandHeartbeat[i] > 0.) &&
+             (epicsTimeDiffInSeconds(&pPvt->scanTime,
+                                     &pPvt->deadbandLastTime[i]) >=
+              pPvt->deadbandHeartbeat[i]))) {
+            pPvt->deadbandSend[i] = 1;
+            pPvt->deadbandLast[i] = pPvt->correctedData[i];
+            pPvt->deadbandLastTime[i] = pPvt->scanTime;
+        } else {
+            pPvt->deadbandSend[i] = 0;
+        }
+    }
+}
+
+/* Whether to call a value callback of channel, counting the ones not called */
+static int deadbandPass(drvIp330Pvt *pPvt, int channel)
+{
+    if (!pPvt->deadbandChans || pPvt->deadbandSend[channel]) return(1);
+    pPvt->deadbandSuppressed[channel]++;
+    return(0);
+}
+
+/* Whether to call a value callback, with value the value of this scan.
+ * For a client with rate options this adds value to the client's average,
+ * and replaces it with the average if the client asked for it. */
+static int clientPass(drvIp330Pvt *pPvt, asynUser *pasynUser, int channel,
+                      double *value)
+{
+    ip330RateUser *pRate = pasynUser->drvUser;
+
+    if (!pRate) return(deadbandPass(pPvt, channel));
+    pRate->sum += *value;
+    pRate->scans++;
+    if (pRate->decimate) {
+        if (pRate->scans < pRate->decimate) return(0);
+    } else if (epicsTimeDiffInSeconds(&pPvt->scanTime, &pRate->nextTime) < 0.) {
+        return(0);
+    }
+    /* A client held back by the deadband stays due until the value moves */
+    if (!deadbandPass(pPvt, channel)) return(0);
+    if (pRate->average) *value = pRate->sum / pRate->scans;
+    pRate->sum = 0.;
+    pRate->scans = 0;
+    if (!pRate->decimate) {
+        /* Keep the cadence, unless the client has fallen a period behind */
+        epicsTimeAddSeconds(&pRate->nextTime, pRate->period);
+        if (epicsTimeDiffInSeconds(&pRate->nextTime, &pPvt->scanTime) <= 0.) {
+            pRate->nextTime = pPvt->scanTime;
+            epicsTimeAddSeconds(&pRate->nextTime, pRate->period);
+        }
+    }
+    return(1);
+}
+
+static asynStatus setDeadband(void *drvPvt, asynUser *pasynUser,
+                              int command, double value)
+{
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+    int channel, i, n;
+
+    pasynManager->getAddr(pasynUser, &channel);
+    if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setDeadband invalid channel %d", channel);
+        return(asynError);
+    }
+    if (!(value >= 0.)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setDeadband illegal value %f", value);
+        return(asynError);
+    }
+    epicsMutexLock(pPvt->lock);
+    if (command == ip330DeadbandHeartbeat) {
+        pPvt->deadbandHeartbeat[channel] = value;
+    } else if (command == ip330DeadbandEgu) {
+        if (pPvt->requestedEguSlope[channel] == 0.) {
+            epicsMutexUnlock(pPvt->lock);
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::setDeadband no EGU_SLOPE for channel %d",
+                          channel);
+            return(asynError);
+        }
+        pPvt->deadband[channel] = value / fabs(pPvt->requestedEguSlope[channel]);
+    } else {
+        pPvt->deadband[channel] = value;
+    }
+    for (i=0, n=0; i<MAX_IP330_CHANNELS; i++)
+        if (pPvt->deadband[i] > 0.) n++;
+    pPvt->deadbandChans = n;
+    epicsMutexUnlock(pPvt->lock);
+    return(asynSuccess);
+}
+
+/* Convert correctedData of the active channels to engineering units */
+static void scaleAll(drvIp330Pvt *pPvt)
+{
+    unsigned int generation;
+    int i;
+
+    if (pPvt->eguGeneration != pPvt->eguGenerationSeen) {
+        do {
+            generation = pPvt->eguGeneration;
+            epicsAtomicReadMemoryBarrier();
+            memcpy(pPvt->eguSlope, pPvt->publishedEguSlope[generation & 1],
+                   sizeof(pPvt->eguSlope));
+            memcpy(pPvt->eguOffset, pPvt->publishedEguOffset[generation & 1],
+                   sizeof(pPvt->eguOffset));
+            epicsAtomicReadMemoryBarrier();
+        } while (generation != pPvt->eguGeneration);
+        pPvt->eguGenerationSeen = generation;
+    }
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++)
+        pPvt->eguData[i] = pPvt->eguOffset[i] + 
+                           pPvt->eguSlope[i] * pPvt->correctedData[i];
+}
+
+/* Switch to the requested recorder, closing the current one.  Called by
+ * whichever thread has claimed the card. */
+static void switchRecorder(drvIp330Pvt *pPvt)
+{
+    epicsMutexLock(pPvt->lock);
+    if (pPvt->pRecorder) {
+        ip330RecorderClose(pPvt->pRecorder);
+        pPvt->closedRecorder = pPvt->pRecorder;
+    }
+    pPvt->pRecorder = pPvt->requestedRecorder;
+    pPvt->recorderRequest = 0;
+    epicsMutexUnlock(pPvt->lock);
+    pPvt->recordGenerationValid = 0;
+}
+
+/* Give the raw scan to the recorder, with the calibration it was corrected
+ * with the first time that generation is seen.  Called by intTask before
+ * the frame is handed back to intFunc. */
+static void recordScan(drvIp330Pvt *pPvt, const ip330Frame *pFrame,
+                       unsigned int generation)
+{
+    ip330RecordCalibration cal;
+    const ip330Coefficients *pCoef;
+    int i;
+
+    if (pPvt->recorderRequest) {
+        switchRecorder(pPvt);
+        if (!pPvt->pRecorder) return;
+    }
+    if (!pPvt->recordGenerationValid || (generation != pPvt->recordGeneration)) {
+        memset(&cal, 0, sizeof(cal));
+        cal.generation = generation;
+        pCoef = &pPvt->coefficients[generation & 1];
+        for (i=0; i<MAX_IP330_CHANNELS; i++) {
+            cal.slope[i] = (generation == IP330_RECORD_UNCALIBRATED) ? 
+                           1.0 : pCoef->adj_slope[i];
+            cal.offset[i] = (generation == IP330_RECORD_UNCALIBRATED) ? 
+                            0.0 : pCoef->adj_offset[i];
+            cal.gain[i] = pgaGain[pPvt->chanSettings[i].gain];
+        }
+        /* If a new generation was published meanwhile the copy may be torn.
+         * The scan is recorded without its calibration, the next scans
+         * use the new generation. */
+        epicsAtomicReadMemoryBarrier();
+        if (((generation == IP330_RECORD_UNCALIBRATED) ||
+             (generation == pPvt->coefGeneration)) &&
+            (ip330RecorderCalibration(pPvt->pRecorder, &cal) == 0)) {
+            pPvt->recordGeneration = generation;
+            pPvt->recordGenerationValid = 1;
+        }
+    }
+    ip330RecorderPut(pPvt->pRecorder, &pFrame->data[pPvt->firstChan],
+                     &pPvt->scanTime, generation,
+                     pFrame->follows ? 0 : IP330_RECORD_BREAK);
+}
+
+/* Allocate the ring for a new block size.  Called on the port thread, so
+ * that intTask only has to swap the ring in at the next scan. */
+static asynStatus setSpectrumSize(drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                  int size)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    int ringSize = size * SPECTRUM_RING_BLOCKS;
+    ip330SpectrumBuffers buffers, unused, old;
+
+    if (size == pPvt->requestedSpectrumSize) return(asynSuccess);
+    memset(&buffers, 0, sizeof(buffers));
+    buffers.size = size;
+    if (size > 0) {
+        buffers.ring = calloc(nChans * ringSize, sizeof(epicsInt32));
+        buffers.time = calloc(ringSize, sizeof(epicsTimeStamp));
+        if (!buffers.ring || !buffers.time) {
+            free(buffers.ring);
+            free(buffers.time);
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::setSpectrumSize cannot allocate size %d",
+                          size);
+            return(asynError);
+        }
+    }
+    epicsMutexLock(pPvt->spectrumLock);
+    /* A ring which intTask never took, and one it swapped out which the
+     * thread has not freed yet, so that spectrumOld is empty before the
+     * next swap */
+    unused = pPvt->spectrumNew;
+    old = pPvt->spectrumOld;
+    memset(&pPvt->spectrumOld, 0, sizeof(pPvt->spectrumOld));
+    pPvt->spectrumNew = buffers;
+    pPvt->spectrumNewReady = 1;
+    pPvt->requestedSpectrumSize = size;
+    epicsMutexUnlock(pPvt->spectrumLock);
+    free(unused.ring);
+    free(unused.time);
+    free(old.ring);
+    free(old.time);
+    return(asynSuccess);
+}
+
+/* Add the scan to the spectrum ring, switching to a new block size first
+ * if one was requested.  The thread is woken every half block. */
+static void accumulateSpectrum(drvIp330Pvt *pPvt)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    unsigned int ringSize, pos, head;
+    epicsInt32 *pRing;
+    int i;
+
+    if (pPvt->spectrumNewReady) {
+        epicsMutexLock(pPvt->spectrumLock);
+        pPvt->spectrumOld.size = pPvt->spectrumSize;
+        pPvt->spectrumOld.ring = pPvt->spectrumRing;
+        pPvt->spectrumOld.time = pPvt->spectrumTime;
+        pPvt->spectrumSize = pPvt->spectrumNew.size;
+        pPvt->spectrumRing = pPvt->spectrumNew.ring;
+        pPvt->spectrumTime = pPvt->spectrumNew.time;
+        memset(&pPvt->spectrumNew, 0, sizeof(pPvt->spectrumNew));
+        pPvt->spectrumNewReady = 0;
+        pPvt->spectrumHead = 0;
+        pPvt->spectrumEpoch++;
+        epicsMutexUnlock(pPvt->spectrumLock);
+        epicsEventSignal(pPvt->spectrumEventId);
+    }
+    if (!pPvt->spectrumSize) return;
+    ringSize = pPvt->spectrumSize * SPECTRUM_RING_BLOCKS;
+    head = pPvt->spectrumHead;
+    pos = head & (ringSize - 1);
+    pRing = pPvt->spectrumRing + pos;
+    for (i=0; i<nChans; i++, pRing += ringSize)
+        *pRing = pPvt->correctedData[pPvt->firstChan + i];
+    pPvt->spectrumTime[pos] = pPvt->scanTime;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->spectrumHead = ++head;
+    if ((head & (pPvt->spectrumSize/2 - 1)) == 0)
+        epicsEventSignal(pPvt->spectrumEventId);
+}
+
+/* Thread that computes the spectra of one card, started by the first
+ * write of a non-zero SPECTRUM_SIZE.  It runs at low priority and only
+ * reads the ring, so it never holds up intTask.  Blocks overlap by half
+ * except with the rectangular window. */
+static void spectrumTask(drvIp330Pvt *pPvt)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    ip330Spectrum *pSpectrum = NULL;
+    double *block = NULL, *power = NULL;
+    unsigned int epoch = 0, readPos = 0, ringSize = 0, head;
+    int size = 0, window = -1, points = 0, nBlocks = 0;
+    int i, j, torn;
+    const epicsInt32 *pRing;
+    epicsTimeStamp blockTime;
+    ip330SpectrumBuffers old;
+
+    while (1) {
+        epicsEventMustWait(pPvt->spectrumEventId);
+        if (pPvt->rebooting) epicsThreadSuspendSelf();
+        /* Free the ring intTask swapped out, it signals after each swap */
+        epicsMutexLock(pPvt->spectrumLock);
+        old = pPvt->spectrumOld;
+        memset(&pPvt->spectrumOld, 0, sizeof(pPvt->spectrumOld));
+        epicsMutexUnlock(pPvt->spectrumLock);
+        free(old.ring);
+        free(old.time);
+        while (1) {
+            epicsMutexLock(pPvt->spectrumLock);
+            if ((epoch != pPvt->spectrumEpoch) || (window != pPvt->spectrumWindow)) {
+                /* New block size or window, start again */
+                ip330SpectrumDestroy(pSpectrum);
+                free(block);
+                free(power);
+                pSpectrum = NULL;
+                block = NULL;
+                power = NULL;
+                epoch = pPvt->spectrumEpoch;
+                window = pPvt->spectrumWindow;
+                size = pPvt->spectrumSize;
+                ringSize = size * SPECTRUM_RING_BLOCKS;
+                readPos = pPvt->spectrumHead;
+                nBlocks = 0;
+                if (size > 0) {
+                    pSpectrum = ip330SpectrumCreate(size, window);
+                    points = ip330SpectrumPoints(pSpectrum);
+                    block = callocMustSucceed(nChans * size, sizeof(double),
+                                              "drvIp330::spectrumTask");
+                    power = callocMustSucceed(nChans * points, sizeof(double),
+                                              "drvIp330::spectrumTask");
+                }
+            }
+            head = pPvt->spectrumHead;
+            if (!pSpectrum || (head - readPos < (unsigned int)size)) {
+                epicsMutexUnlock(pPvt->spectrumLock);
+                break;
+            }
+            if (head - readPos > ringSize - size) {
+                /* Fell behind, go on from the newest complete block */
+                pPvt->spectrumSkipped++;
+                readPos = head - size;
+            }
+            /* The ring must not be read before the head that published it */
+            epicsAtomicReadMemoryBarrier();
+            blockTime = pPvt->spectrumTime[(readPos + size - 1) & (ringSize - 1)];
+            for (i=0; i<nChans; i++) {
+                pRing = pPvt->spectrumRing + i * ringSize;
+                for (j=0; j<size; j++)
+                    block[i * size + j] = pRing[(readPos + j) & (ringSize - 1)];
+            }
+            /* If intTask has come round to the start of the block again
+             * the copy may be torn */
+            epicsAtomicReadMemoryBarrier();
+            torn = (pPvt->spectrumHead - readPos >= ringSize);
+            epicsMutexUnlock(pPvt->spectrumLock);
+            readPos += (window == ip330WindowRectangular) ? size : size/2;
+            if (torn) {
+                pPvt->spectrumSkipped++;
+                continue;
+            }
+            for (i=0; i<nChans; i++)
+                ip330SpectrumAdd(pSpectrum, block + i * size, power + i * points);
+            if (++nBlocks < pPvt->spectrumAverages) continue;
+            publishSpectrum(pPvt, pSpectrum, power, nBlocks, &blockTime);
+            memset(power, 0, nChans * points * sizeof(double));
+            nBlocks = 0;
+        }
+    }
+}
+
+/* Publish the averaged spectra and do the float64Array callbacks.  Called
+ * by the spectrum thread, which is the only writer of the published
+ * arrays. */
+static void publishSpectrum(drvIp330Pvt *pPvt, const ip330Spectrum *pSpectrum,
+                            const double *power, int nBlocks,
+                            const epicsTimeStamp *pTime)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    int points = ip330SpectrumPoints(pSpectrum);
+    double sampleRate = 1. / pPvt->actualScanPeriod;
+    int i, last;
+    ip330Dispatch *pd;
+    asynFloat64ArrayInterrupt *pfloat64ArrayInterrupt;
+
+    epicsMutexLock(pPvt->spectrumLock);
+    if (pPvt->spectrumPoints != points) {
+        free(pPvt->spectrumMagnitude);
+        free(pPvt->spectrumPsd);
+        free(pPvt->spectrumFreq);
+        pPvt->spectrumMagnitude = callocMustSucceed(nChans * points,
+                                sizeof(double), "drvIp330::publishSpectrum");
+        pPvt->spectrumPsd = callocMustSucceed(nChans * points,
+                                sizeof(double), "drvIp330::publishSpectrum");
+        pPvt->spectrumFreq = callocMustSucceed(points,
+                                sizeof(double), "drvIp330::publishSpectrum");
+        pPvt->spectrumPoints = points;
+    }
+    for (i=0; i<nChans; i++)
+        ip330SpectrumFinish(pSpectrum, power + i * points, nBlocks, sampleRate,
+                            pPvt->spectrumMagnitude + i * points,
+                            pPvt->spectrumPsd + i * points);
+    for (i=0; i<points; i++)
+        pPvt->spectrumFreq[i] = i * sampleRate / (2 * (points - 1));
+    pPvt->spectrumTimestamp = *pTime;
+    pPvt->spectrumCount++;
+    epicsMutexUnlock(pPvt->spectrumLock);
+
+    /* Pass float64Array interrupts */
+    pd = dispatchStart(pPvt, dispatchSpectrum);
+    if (!pd) return;
+    last = dispatchFirst(pd, ip330SpectrumMagnitude, pPvt->lastChan+1);
+    for (i=dispatchFirst(pd, ip330SpectrumMagnitude, pPvt->firstChan); i<last; i++) {
+        pfloat64ArrayInterrupt = pd->clients[i];
+        pfloat64ArrayInterrupt->pasynUser->timestamp = *pTime;
+        pfloat64ArrayInterrupt->callback(pfloat64ArrayInterrupt->userPvt,
+                 pfloat64ArrayInterrupt->pasynUser,
+                 pPvt->spectrumMagnitude +
+                     (pfloat64ArrayInterrupt->addr - pPvt->firstChan) * points,
+                 points);
+    }
+    last = dispatchFirst(pd, ip330SpectrumPsd, pPvt->lastChan+1);
+    for (i=dispatchFirst(pd, ip330SpectrumPsd, pPvt->firstChan); i<last; i++) {
+        pfloat64ArrayInterrupt = pd->clients[i];
+        pfloat64ArrayInterrupt->pasynUser->timestamp = *pTime;
+        pfloat64ArrayInterrupt->callback(pfloat64ArrayInterrupt->userPvt,
+                 pfloat64ArrayInterrupt->pasynUser,
+                 pPvt->spectrumPsd +
+                     (pfloat64ArrayInterrupt->addr - pPvt->firstChan) * points,
+                 points);
+    }
+    /* The frequencies are the same for every addr */
+    last = dispatchFirst(pd, ip330SpectrumFreq+1, 0);
+    for (i=dispatchFirst(pd, ip330SpectrumFreq, 0); i<last; i++) {
+        pfloat64ArrayInterrupt = pd->clients[i];
+        pfloat64ArrayInterrupt->pasynUser->timestamp = *pTime;
+        pfloat64ArrayInterrupt->callback(pfloat64ArrayInterrupt->userPvt,
+                                         pfloat64ArrayInterrupt->pasynUser,
+                                         pPvt->spectrumFreq, points);
+    }
+    dispatchEnd(pd);
+}
+
+static void accumulateCapture(drvIp330Pvt *pPvt)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    int request = pPvt->captureRequest;
+    int i;
+    epicsUInt16 *pRaw;
+    ip330CaptureBuffers *pCapture;
+
+    /* The capture thread owns a frozen history until it is published */
+    if (pPvt->captureFrozen) return;
+    if (request) {
+        pPvt->captureRequest = 0;
+        if (request == ip330CaptureArmed) {
+            if (!epicsAtomicGetPtrT(&pPvt->captureOld) &&
+                (pCapture = handoffTake(&pPvt->captureNew))) {
+                /* Swap in the history of the new depth */
+                handoffPut(&pPvt->captureOld, pPvt->pCapture);
+                pPvt->pCapture = pCapture;
+                pPvt->captureDepth = pCapture->depth;
+            }
+            pPvt->captureHead = 0;
+            pPvt->captureFilled = 0;
+            pPvt->captureState = (pPvt->captureDepth > 0) ? 
+                                 ip330CaptureArmed : ip330CaptureIdle;
+            doCaptureStateCallbacks(pPvt, dispatchInt32, &pPvt->scanTime);
+        } else if (pPvt->captureState == ip330CaptureArmed) {
+            pPvt->captureRemaining = pPvt->capturePost;
+            if (pPvt->captureRemaining > pPvt->captureDepth - 1)
+                pPvt->captureRemaining = pPvt->captureDepth - 1;
+            pPvt->captureTime = pPvt->scanTime;
+            pPvt->captureState = ip330CaptureTriggered;
+            doCaptureStateCallbacks(pPvt, dispatchInt32, &pPvt->scanTime);
+        }
+    }
+    if ((pPvt->captureState != ip330CaptureArmed) &&
+        (pPvt->captureState != ip330CaptureTriggered)) return;
+    /* Keep the raw scan, chanData holds the raw value of each channel */
+    pRaw = pPvt->pCapture->raw + pPvt->captureHead * nChans;
+    for (i=0; i<nChans; i++) 
+        pRaw[i] = (epicsUInt16)pPvt->chanData[pPvt->firstChan + i];
+    if (++pPvt->captureHead == pPvt->captureDepth) pPvt->captureHead = 0;
+    if (pPvt->captureFilled < pPvt->captureDepth) pPvt->captureFilled++;
+    if (pPvt->captureState == ip330CaptureTriggered) {
+        if (pPvt->captureRemaining-- <= 0) freezeCapture(pPvt);
+    }
+}
+
+static void freeCaptureBuffers(ip330CaptureBuffers *pBuffers)
+{
+    if (!pBuffers) return;
+    free(pBuffers->raw);
+    free(pBuffers->data[0]);
+    free(pBuffers->data[1]);
+    free(pBuffers->float32);
+    free(pBuffers);
+}
+
+/* Allocate the history for a new depth.  Called on the port thread, so
+ * that intTask only has to swap the buffers in when it next arms. */
+static asynStatus setCaptureDepth(drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                  int depth)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    ip330CaptureBuffers *pBuffers;
+
+    if (depth == pPvt->requestedCaptureDepth) return(asynSuccess);
+    pBuffers = calloc(1, sizeof(*pBuffers));
+    if (pBuffers && (depth > 0)) {
+        pBuffers->raw = calloc(nChans * depth, sizeof(epicsUInt16));
+        pBuffers->data[0] = calloc(nChans * depth, sizeof(epicsInt32));
+        pBuffers->data[1] = calloc(nChans * depth, sizeof(epicsInt32));
+        pBuffers->float32 = calloc(depth, sizeof(epicsFloat32));
+        if (!pBuffers->raw || !pBuffers->data[0] || !pBuffers->data[1] ||
+            !pBuffers->float32) {
+            freeCaptureBuffers(pBuffers);
+            pBuffers = NULL;
+        }
+    }
+    if (!pBuffers) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setCaptureDepth cannot allocate depth %d",
+                      depth);
+        return(asynError);
+    }
+    pBuffers->depth = depth;
+    /* Buffers of a depth which was never armed */
+    freeCaptureBuffers(handoffPut(&pPvt->captureNew, pBuffers));
+    freeCaptureBuffers(handoffTake(&pPvt->captureOld));
+    pPvt->requestedCaptureDepth = depth;
+    return(asynSuccess);
+}
+
+/* Hand the history to the capture thread, with the coefficients in use
+ * at the time of the freeze */
+static void freezeCapture(drvIp330Pvt *pPvt)
+{
+    unsigned int generation;
+
+    pPvt->captureUncalibrated = (pPvt->secondsBetweenCalibrate < 0);
+    do {
+        generation = pPvt->coefGeneration;
+        epicsAtomicReadMemoryBarrier();
+        pPvt->captureCoefficients = pPvt->coefficients[generation & 1];
+        epicsAtomicReadMemoryBarrier();
+    } while (generation != pPvt->coefGeneration);
+    pPvt->captureFreezeTime = pPvt->scanTime;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->captureFrozen = 1;
+    epicsEventSignal(pPvt->captureEventId);
+}
+
+/* Thread that corrects a frozen history and does its callbacks, started
+ * by the first write of a non-zero CAPTURE_DEPTH.  It runs at low
+ * priority, so that a deep history never holds up intTask. */
+static void captureTask(drvIp330Pvt *pPvt)
+{
+    while (1) {
+        epicsEventMustWait(pPvt->captureEventId);
+        if (pPvt->rebooting) epicsThreadSuspendSelf();
+        if (!pPvt->captureFrozen) continue;
+        epicsAtomicReadMemoryBarrier();
+        publishCapture(pPvt);
+        /* intTask may overwrite the history and the state from now on */
+        epicsAtomicWriteMemoryBarrier();
+        pPvt->captureFrozen = 0;
+    }
+}
+
+/* Correct the history into the unpublished data set, publish it and do
+ * the CAPTURE_STATE and CAPTURE_DATA callbacks.  Called by the capture
+ * thread while captureFrozen is set. */
+static void publishCapture(drvIp330Pvt *pPvt)
+{
+    ip330CaptureBuffers *pCapture = pPvt->pCapture;
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    int n = pPvt->captureFilled;
+    int first = pPvt->firstChan;
+    int depth = pCapture->depth;
+    unsigned int generation = pCapture->generation + 1;
+    int start, i, j, k, last;
+    const ip330Coefficients *pCoef = &pPvt->captureCoefficients;
+    epicsUInt16 *pRaw;
+    epicsInt32 *pData, *pSet = pCapture->data[generation & 1];
+    int rawOut[MAX_IP330_CHANNELS], corrected[MAX_IP330_CHANNELS];
+    ip330Dispatch *pd;
+
+    start = (pPvt->captureHead - n + depth) % depth;
+    for (j=0; j<n; j++) {
+        k = (start + j) % depth;
+        pRaw = pCapture->raw + k * nChans;
+        if (pPvt->captureUncalibrated)
+            for (i=0; i<nChans; i++) corrected[i] = pRaw[i];
+        else
+            ip330Correct(pRaw, &pCoef->adj_slope[first], &pCoef->adj_offset[first],
+                         rawOut, corrected, nChans);
+        for (i=0; i<nChans; i++) pSet[i * n + j] = corrected[i];
+    }
+    pCapture->scans[generation & 1] = n;
+    pCapture->time[generation & 1] = pPvt->captureTime;
+    epicsAtomicWriteMemoryBarrier();
+    pCapture->generation = generation;
+    pPvt->captureState = ip330CaptureDone;
+    doCaptureStateCallbacks(pPvt, dispatchCaptureInt32,
+                            &pPvt->captureFreezeTime);
+
+    /* Pass int32Array interrupts */
+    pd = dispatchStart(pPvt, dispatchCaptureInt32Array);
+    if (pd) {
+        last = dispatchFirst(pd, ip330CaptureData, pPvt->lastChan+1);
+        for (i=dispatchFirst(pd, ip330CaptureData, pPvt->firstChan); i<last; i++) {
+            asynInt32ArrayInterrupt *pint32ArrayInterrupt = pd->clients[i];
+            pint32ArrayInterrupt->pasynUser->timestamp = pPvt->captureTime;
+            pint32ArrayInterrupt->callback(pint32ArrayInterrupt->userPvt,
+                     pint32ArrayInterrupt->pasynUser,
+                     pSet + (pint32ArrayInterrupt->addr-first)*n,
+                     n);
+        }
+        dispatchEnd(pd);
+    }
+
+    /* Pass float32Array interrupts */
+    pd = dispatchStart(pPvt, dispatchCaptureFloat32Array);
+    if (pd) {
+        last = dispatchFirst(pd, ip330CaptureData, pPvt->lastChan+1);
+        for (i=dispatchFirst(pd, ip330CaptureData, pPvt->firstChan); i<last; i++) {
+            asynFloat32ArrayInterrupt *pfloat32ArrayInterrupt = pd->clients[i];
+            pData = pSet + (pfloat32ArrayInterrupt->addr-first)*n;
+            for (j=0; j<n; j++)
+                pCapture->float32[j] = (epicsFloat32)pData[j];
+            pfloat32ArrayInterrupt->pasynUser->timestamp = pPvt->captureTime;
+            pfloat32ArrayInterrupt->callback(pfloat32ArrayInterrupt->userPvt,
+                                             pfloat32ArrayInterrupt->pasynUser,
+                                             pCapture->float32, n);
+        }
+        dispatchEnd(pd);
+    }
+}
+
+/* type is dispatchInt32 in intTask, dispatchCaptureInt32 in the capture
+ * thread */
+static void doCaptureStateCallbacks(drvIp330Pvt *pPvt, dispatchType type,
+                                    const epicsTimeStamp *pTime)
+{
+    int i, last;
+    ip330Dispatch *pd;
+
+    pd = dispatchStart(pPvt, type);
+    if (!pd) return;
+    last = dispatchFirst(pd, ip330CaptureState+1, 0);
+    for (i=dispatchFirst(pd, ip330CaptureState, 0); i<last; i++) {
+        asynInt32Interrupt *pint32Interrupt = pd->clients[i];
+        pint32Interrupt->pasynUser->timestamp = *pTime;
+        pint32Interrupt->callback(pint32Interrupt->userPvt,
+                                  pint32Interrupt->pasynUser,
+                                  pPvt->captureState);
+    }
+    dispatchEnd(pd);
+}
+
+static void doOverrunCallbacks(drvIp330Pvt *pPvt)
+{
+    int i, last;
+    ip330Dispatch *pd;
+
+    pPvt->missedTotalSeen = pPvt->missedTotal;
+    pPvt->pingPongErrorsSeen = pPvt->pingPongErrors;
+    pd = dispatchStart(pPvt, dispatchInt32);
+    if (!pd) return;
+    last = dispatchFirst(pd, ip330MissedData, pPvt->lastChan+1);
+    for (i=dispatchFirst(pd, ip330MissedData, pPvt->firstChan); i<last; i++) {
+        asynInt32Interrupt *pint32Interrupt = pd->clients[i];
+        pint32Interrupt->pasynUser->timestamp = pPvt->scanTime;
+        pint32Interrupt->callback(pint32Interrupt->userPvt,
+                                  pint32Interrupt->pasynUser,
+                                  pPvt->missedData[pint32Interrupt->addr]);
+    }
+    last = dispatchFirst(pd, ip330PingPongErrors+1, 0);
+    for (i=dispatchFirst(pd, ip330PingPongErrors, 0); i<last; i++) {
+        asynInt32Interrupt *pint32Interrupt = pd->clients[i];
+        pint32Interrupt->pasynUser->timestamp = pPvt->scanTime;
+        pint32Interrupt->callback(pint32Interrupt->userPvt,
+                                  pint32Interrupt->pasynUser,
+                                  pPvt->pingPongErrors);
+    }
+    dispatchEnd(pd);
+}
+
+static void histogramAdd(ip330Histogram *pHist, double seconds)
+{
+    int bucket = 0;
+
+    if (seconds >= 1.e-6) {
+        /* seconds*1e6 is in [2^(bucket-1), 2^bucket) */
+        frexp(seconds * 1.e6, &bucket);
+        if (bucket >= IP330_HISTOGRAM_BUCKETS) 
+            bucket = IP330_HISTOGRAM_BUCKETS - 1;
+    }
+    /* Saturate rather than wrap, the counts are trended */
+    if (pHist->counts[bucket] < 0x7fffffff) pHist->counts[bucket]++;
+    if (seconds > pHist->max) pHist->max = seconds;
+}
+
+static void updateHistograms(drvIp330Pvt *pPvt, const epicsTimeStamp *frameTime,
+                             int follows, const epicsTimeStamp *dequeueTime,
+                             const epicsTimeStamp *correctTime,
+                             const epicsTimeStamp *doneTime)
+{
+    ip330Histogram *pHist = pPvt->histograms;
+    double period;
+
+    if (pPvt->histogramReset) {
+        pPvt->histogramReset = 0;
+        memset(pHist, 0, sizeof(pPvt->histograms));
+    }
+    histogramAdd(&pHist[histCorrect],
+                 epicsTimeDiffInSeconds(correctTime, dequeueTime));
+    histogramAdd(&pHist[histCallback],
+                 epicsTimeDiffInSeconds(doneTime, correctTime));
+    /* frameTime is NULL if intFunc could not read the time */
+    if (!frameTime) {
+        pPvt->lastFrameTime.secPastEpoch = 0;
+        return;
+    }
+    histogramAdd(&pHist[histQueue],
+                 epicsTimeDiffInSeconds(dequeueTime, frameTime));
+    histogramAdd(&pHist[histTotal],
+                 epicsTimeDiffInSeconds(doneTime, frameTime));
+    if (follows && (pPvt->lastFrameTime.secPastEpoch != 0)) {
+        period = epicsTimeDiffInSeconds(frameTime, &pPvt->lastFrameTime);
+        histogramAdd(&pHist[histJitter], fabs(period - pPvt->actualScanPeriod));
+    }
+    pPvt->lastFrameTime = *frameTime;
+}
+
+static void accumulateAverage(drvIp330Pvt *pPvt)
+{
+    int i;
+
+    if (pPvt->averageUsers == 0) return;
+    pPvt->averageSeq++;
+    epicsAtomicWriteMemoryBarrier();
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
+        pPvt->averageSum[i] += pPvt->correctedData[i];
+    }
+    pPvt->averageCount++;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->averageSeq++;
+}
+
+static void readAverageTotals(drvIp330Pvt *pPvt, int channel,
+                              double *sum, unsigned int *count)
+{
+    unsigned int seq;
+
+    /* intTask never waits for readers, readers retry if they overlap an
+     * update */
+    do {
+        seq = pPvt->averageSeq;
+        epicsAtomicReadMemoryBarrier();
+        *sum = pPvt->averageSum[channel];
+        *count = pPvt->averageCount;
+        epicsAtomicReadMemoryBarrier();
+    } while ((seq & 1) || (seq != pPvt->averageSeq));
+}
+
+/* Returns the average of the channel since the previous read by this
+ * asynUser, or the latest value if there have been no scans since then */
+static void readAverage(drvIp330Pvt *pPvt, asynUser *pasynUser,
+                        int channel, double *value)
+{
+    ip330AverageUser *pAverage = pasynUser->drvUser;
+    double sum;
+    unsigned int count;
+
+    if (!pAverage || channel < 0 || channel >= MAX_IP330_CHANNELS) {
+        *value = 0.;
+        return;
+    }
+    readAverageTotals(pPvt, channel, &sum, &count);
+    if (count == pAverage->count) {
+        *value = pPvt->correctedData[channel];
+    } else {
+        *value = (sum - pAverage->sum) / (double)(count - pAverage->count);
+    }
+    pAverage->sum = sum;
+    pAverage->count = count;
+}
+
+/* Add the scan to the statistics of the current window, in one pass over
+ * the active channels.  Welford's update keeps the variance accurate when
+ * the noise is small compared with the mean. */
+static void accumulateStatistics(drvIp330Pvt *pPvt)
+{
+    int first = pPvt->firstChan;
+    int last = pPvt->lastChan;
+    double scale, delta;
+    int i, x;
+
+    if (pPvt->statScans == 0) {
+        pPvt->statWindow = pPvt->requestedStatWindow;
+        if (pPvt->statWindow == 0) return;
+        for (i=first; i<=last; i++) {
+            pPvt->statAccMean[i] = 0.;
+            pPvt->statAccM2[i] = 0.;
+            pPvt->statAccMin[i] = pPvt->correctedData[i];
+            pPvt->statAccMax[i] = pPvt->correctedData[i];
+        }
+    }
+    scale = 1. / ++pPvt->statScans;
+    for (i=first; i<=last; i++) {
+        x = pPvt->correctedData[i];
+        delta = x - pPvt->statAccMean[i];
+        pPvt->statAccMean[i] += delta * scale;
+        pPvt->statAccM2[i] += delta * (x - pPvt->statAccMean[i]);
+        if (x < pPvt->statAccMin[i]) pPvt->statAccMin[i] = x;
+        if (x > pPvt->statAccMax[i]) pPvt->statAccMax[i] = x;
+    }
+    if (pPvt->statScans >= pPvt->statWindow) {
+        publishStatistics(pPvt);
+        pPvt->statScans = 0;
+    }
+}
+
+/* Publish the statistics of the window just completed and do the float64
+ * callbacks */
+static void publishStatistics(drvIp330Pvt *pPvt)
+{
+    int n = pPvt->statScans;
+    int i, reason, last;
+    double variance;
+    ip330Dispatch *pd;
+
+    pPvt->statSeq++;
+    epicsAtomicWriteMemoryBarrier();
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
+        variance = pPvt->statAccM2[i] / n;
+        if (variance < 0.) variance = 0.;
+        pPvt->statMean[i] = pPvt->statAccMean[i];
+        pPvt->statStdDev[i] = sqrt(variance);
+        pPvt->statRms[i] = sqrt(pPvt->statAccMean[i] * pPvt->statAccMean[i] +
+                                variance);
+        pPvt->statMin[i] = pPvt->statAccMin[i];
+        pPvt->statMax[i] = pPvt->statAccMax[i];
+    }
+    pPvt->statTime = pPvt->scanTime;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->statSeq++;
+
+    /* Pass float64 interrupts */
+    pd = dispatchStart(pPvt, dispatchFloat64);
+    if (!pd) return;
+    for (reason=ip330StatMean; reason<=ip330StatMax; reason++) {
+        last = dispatchFirst(pd, reason, pPvt->lastChan+1);
+        for (i=dispatchFirst(pd, reason, pPvt->firstChan); i<last; i++) {
+            asynFloat64Interrupt *pfloat64Interrupt = pd->clients[i];
+            pfloat64Interrupt->pasynUser->timestamp = pPvt->statTime;
+            pfloat64Interrupt->callback(pfloat64Interrupt->userPvt,
+                    pfloat64Interrupt->pasynUser,
+                    readStatistic(pPvt, reason, pfloat64Interrupt->addr, NULL));
+        }
+    }
+    dispatchEnd(pd);
+}
+
+/* Returns one statistic of a channel from the last complete window, and
+ * the time of its last scan if pTime is not NULL */
+static double readStatistic(drvIp330Pvt *pPvt, int command, int channel,
+                            epicsTimeStamp *pTime)
+{
+    unsigned int seq;
+    double value;
+    epicsTimeStamp time;
+
+    if ((channel < 0) || (channel >= MAX_IP330_CHANNELS)) return(0.);
+    /* intTask never waits for readers, readers retry if they overlap an
+     * update */
+    do {
+        seq = pPvt->statSeq;
+        epicsAtomicReadMemoryBarrier();
+        switch (command) {
+            case ip330StatMean:   value = pPvt->statMean[channel];   break;
+            case ip330StatRms:    value = pPvt->statRms[channel];    break;
+            case ip330StatStdDev: value = pPvt->statStdDev[channel]; break;
+            case ip330StatMin:    value = pPvt->statMin[channel];    break;
+            default:              value = pPvt->statMax[channel];    break;
+        }
+        time = pPvt->statTime;
+        epicsAtomicReadMemoryBarrier();
+    } while ((seq & 1) || (seq != pPvt->statSeq));
+    if (pTime) *pTime = time;
+    return(value);
+}
+
+/* Buffers are handed between the port thread and intTask through slots
+ * which hold one pointer, without a lock.  The port thread puts new
+ * buffers in a new slot, getting back any that intTask did not take, and
+ * takes the buffers intTask swapped out from an old slot.  intTask only
+ * takes new buffers while the old slot is empty, so the port thread
+ * empties it again after each put. */
+static void *handoffPut(EpicsAtomicPtrT *pSlot, void *p)
+{
+    void *old;
+
+    do {
+        old = epicsAtomicGetPtrT(pSlot);
+    } while (epicsAtomicCmpAndSwapPtrT(pSlot, old, p) != old);
+    return(old);
+}
+
+static void *handoffTake(EpicsAtomicPtrT *pSlot)
+{
+    void *p = epicsAtomicGetPtrT(pSlot);
+
+    if (p && (epicsAtomicCmpAndSwapPtrT(pSlot, p, NULL) != p)) p = NULL;
+    return(p);
+}
+
+static void freeBlockBuffers(ip330BlockBuffers *pBuffers)
+{
+    if (!pBuffers) return;
+    free(pBuffers->data);
+    free(pBuffers->interleaved);
+    free(pBuffers->float32);
+    free(pBuffers);
+}
+
+/* Allocate the buffers for a new block size on the port thread, intTask
+ * swaps them in at the start of the next block */
+static asynStatus setBlockSize(drvIp330Pvt *pPvt, asynUser *pasynUser,
+                               int blockSize)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    ip330BlockBuffers *pBuffers;
+
+    if (pPvt->rebooting) epicsThreadSuspendSelf();
+    if (blockSize < 0 || blockSize > MAX_BLOCK_SIZE) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setBlockSize illegal block size %d",
+                      blockSize);
+        return(asynError);
+    }
+    if (blockSize == pPvt->requestedBlockSize) return(asynSuccess);
+    pBuffers = calloc(1, sizeof(*pBuffers));
+    if (pBuffers && (blockSize > 0)) {
+        pBuffers->data = calloc(nChans * blockSize, sizeof(epicsInt32));
+        pBuffers->interleaved = calloc(nChans * blockSize, sizeof(epicsInt32));
+        pBuffers->float32 = calloc(blockSize, sizeof(epicsFloat32));
+        if (!pBuffers->data || !pBuffers->interleaved || !pBuffers->float32) {
+            freeBlockBuffers(pBuffers);
+            pBuffers = NULL;
+        }
+    }
+    if (!pBuffers) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::setBlockSize cannot allocate block size %d",
+                      blockSize);
+        return(asynError);
+    }
+    pBuffers->size = blockSize;
+    /* Buffers of a size intTask never took */
+    freeBlockBuffers(handoffPut(&pPvt->blockNew, pBuffers));
+    freeBlockBuffers(handoffTake(&pPvt->blockOld));
+    pPvt->requestedBlockSize = blockSize;
+    return(asynSuccess);
+}
+
+static void accumulateBlock(drvIp330Pvt *pPvt)
+{
+    int i;
+    epicsInt32 *pData;
+    ip330BlockBuffers *pBuffers, old;
+
+    if ((pPvt->blockCount == 0) && !epicsAtomicGetPtrT(&pPvt->blockOld) &&
+        (pBuffers = handoffTake(&pPvt->blockNew))) {
+        old.size = pPvt->blockSize;
+        old.data = pPvt->blockData;
+        old.interleaved = pPvt->blockInterleaved;
+        old.float32 = pPvt->blockFloat32;
+        pPvt->blockSize = pBuffers->size;
+        pPvt->blockData = pBuffers->data;
+        pPvt->blockInterleaved = pBuffers->interleaved;
+        pPvt->blockFloat32 = pBuffers->float32;
+        *pBuffers = old;
+        handoffPut(&pPvt->blockOld, pBuffers);
+    }
+    if (pPvt->blockSize == 0) return;
+    if (pPvt->blockCount == 0) pPvt->blockTime = pPvt->scanTime;
+    pData = pPvt->blockData + pPvt->blockCount;
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
+        *pData = pPvt->correctedData[i];
+        pData += pPvt->blockSize;
+    }
+    if (++pPvt->blockCount < pPvt->blockSize) return;
+    pPvt->blockCount = 0;
+    doBlockCallbacks(pPvt);
+}
+
+static void doBlockCallbacks(drvIp330Pvt *pPvt)
+{
+    int nChans = pPvt->lastChan - pPvt->firstChan + 1;
+    int n = pPvt->blockSize;
+    int i, j, last;
+    epicsInt32 *pData;
+    ip330Dispatch *pd;
+
+    /* Pass int32Array interrupts */
+    pd = dispatchStart(pPvt, dispatchInt32Array);
+    if (pd) {
+        last = dispatchFirst(pd, ip330BlockData, pPvt->lastChan+1);
+        for (i=dispatchFirst(pd, ip330BlockData, pPvt->firstChan); i<last; i++) {
+            asynInt32ArrayInterrupt *pint32ArrayInterrupt = pd->clients[i];
+            pint32ArrayInterrupt->pasynUser->timestamp = pPvt->blockTime;
+            pint32ArrayInterrupt->callback(pint32ArrayInterrupt->userPvt,
+                     pint32ArrayInterrupt->pasynUser,
+                     pPvt->blockData + (pint32ArrayInterrupt->addr-pPvt->firstChan)*n,
+                     n);
+        }
+        i = dispatchFirst(pd, ip330BlockInterleaved, 0);
+        last = dispatchFirst(pd, ip330BlockInterleaved+1, 0);
+        if (i < last) {
+            /* Transpose to scan-major order once per block */
+            for (j=0; j<nChans; j++) {
+                int k;
+                pData = pPvt->blockData + j*n;
+                for (k=0; k<n; k++)
+                    pPvt->blockInterleaved[k*nChans + j] = pData[k];
+            }
+        }
+        for (; i<last; i++) {
+            asynInt32ArrayInterrupt *pint32ArrayInterrupt = pd->clients[i];
+            pint32ArrayInterrupt->pasynUser->timestamp = pPvt->blockTime;
+            pint32ArrayInterrupt->callback(pint32ArrayInterrupt->userPvt,
+                                           pint32ArrayInterrupt->pasynUser,
+                                           pPvt->blockInterleaved,
+                                           n * nChans);
+        }
+        dispatchEnd(pd);
+    }
+
+    /* Pass float32Array interrupts */
+    pd = dispatchStart(pPvt, dispatchFloat32Array);
+    if (pd) {
+        last = dispatchFirst(pd, ip330BlockData, pPvt->lastChan+1);
+        for (i=dispatchFirst(pd, ip330BlockData, pPvt->firstChan); i<last; i++) {
+            asynFloat32ArrayInterrupt *pfloat32ArrayInterrupt = pd->clients[i];
+            pData = pPvt->blockData + (pfloat32ArrayInterrupt->addr-pPvt->firstChan)*n;
+            for (j=0; j<n; j++)
+                pPvt->blockFloat32[j] = (epicsFloat32)pData[j];
+            pfloat32ArrayInterrupt->pasynUser->timestamp = pPvt->blockTime;
+            pfloat32ArrayInterrupt->callback(pfloat32ArrayInterrupt->userPvt,
+                                             pfloat32ArrayInterrupt->pasynUser,
+                                             pPvt->blockFloat32, n);
+        }
+        dispatchEnd(pd);
+    }
+}
+
+/* Interrupt dispatch tables.
+ * The asyn base classes fill in registerInterruptUser and cancelInterruptUser
+ * in our interface structures when the first port is initialized.  We wrap
+ * them so that every register or cancel marks the dispatch table dirty.
+ * intTask then rebuilds the table inside interruptStart/interruptEnd, so the
+ * per-scan fan-out only touches the clients of the active channels.
+ * Because asyn defers list changes made during a callback pass to
+ * interruptEnd, the table is also rebuilt whenever the list length changes. */
+static asynStatus (*baseInt32Register)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackInt32 callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseInt32Cancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+static asynStatus (*baseFloat64Register)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackFloat64 callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseFloat64Cancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+static asynStatus (*baseInt16ArrayRegister)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackInt16Array callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseInt16ArrayCancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+static asynStatus (*baseInt32ArrayRegister)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackInt32Array callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseInt32ArrayCancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+static asynStatus (*baseFloat32ArrayRegister)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackFloat32Array callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseFloat32ArrayCancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+static asynStatus (*baseFloat64ArrayRegister)(void *drvPvt, asynUser *pasynUser,
+                       interruptCallbackFloat64Array callback, void *userPvt,
+                       void **registrarPvt);
+static asynStatus (*baseFloat64ArrayCancel)(void *drvPvt, asynUser *pasynUser,
+                       void *registrarPvt);
+
+static void freeClientArray(ip330ClientArray *pArray)
+{
+    if (!pArray) return;
+    free(pArray->clients);
+    free(pArray);
+}
+
+/* Called before a client is added, makes room for it in every table of
+ * the interface */
+static asynStatus dispatchReserve(drvIp330Pvt *pPvt, asynUser *pasynUser,
+                                  dispatchType type)
+{
+    ip330Dispatch *pd;
+    ip330ClientArray *pArray;
+    int i, size;
+
+    epicsMutexLock(pPvt->lock);
+    for (i=0; i<nDispatchTypes; i++) {
+        if (dispatchInterface[i] != type) continue;
+        pd = &pPvt->dispatch[i];
+        if (pd->reserved < pd->allocated) continue;
+        size = pd->allocated ? 2 * pd->allocated : DISPATCH_MIN_CLIENTS;
+        pArray = calloc(1, sizeof(*pArray));
+        if (pArray) pArray->clients = calloc(size, sizeof(void *));
+        if (!pArray || !pArray->clients) {
+            free(pArray);
+            epicsMutexUnlock(pPvt->lock);
+            epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                          "drvIp330::dispatchReserve cannot allocate %d clients",
+                          size);
+            return(asynError);
+        }
+        pArray->size = size;
+        /* An array the owner never took, and one it swapped out */
+        freeClientArray(handoffPut(&pd->spare, pArray));
+        freeClientArray(handoffTake(&pd->retired));
+        pd->allocated = size;
+    }
+    for (i=0; i<nDispatchTypes; i++)
+        if (dispatchInterface[i] == type) pPvt->dispatch[i].reserved++;
+    epicsMutexUnlock(pPvt->lock);
+    return(asynSuccess);
+}
+
+/* Called when a client was not added after all, or has been removed */
+static void dispatchUnreserve(drvIp330Pvt *pPvt, dispatchType type)
+{
+    int i;
+
+    epicsMutexLock(pPvt->lock);
+    for (i=0; i<nDispatchTypes; i++)
+        if (dispatchInterface[i] == type) pPvt->dispatch[i].reserved--;
+    epicsMutexUnlock(pPvt->lock);
+}
+
+/* These mark every table of the interface */
+static void dispatchRegistered(drvIp330Pvt *pPvt, dispatchType type)
+{
+    int i;
+
+    /* Called after the client is added */
+    for (i=0; i<nDispatchTypes; i++) {
+        if (dispatchInterface[i] != type) continue;
+        epicsAtomicIncrIntT(&pPvt->dispatch[i].nRegistered);
+        epicsAtomicSetIntT(&pPvt->dispatch[i].dirty, 1);
+    }
+}
+
+static void dispatchCancelled(drvIp330Pvt *pPvt, dispatchType type)
+{
+    int i;
+
+    /* Called before the client is removed */
+    for (i=0; i<nDispatchTypes; i++) {
+        if (dispatchInterface[i] != type) continue;
+        epicsAtomicSetIntT(&pPvt->dispatch[i].dirty, 1);
+        epicsAtomicDecrIntT(&pPvt->dispatch[i].nRegistered);
+    }
+}
+
+static asynStatus int32Register(void *drvPvt, asynUser *pasynUser,
+                                interruptCallbackInt32 callback, void *userPvt,
+                                void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchInt32) != asynSuccess)
+        return(asynError);
+    status = baseInt32Register(drvPvt, pasynUser, callback,
+                               userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchInt32);
+    else dispatchUnreserve(drvPvt, dispatchInt32);
+    return(status);
+}
+
+static asynStatus int32Cancel(void *drvPvt, asynUser *pasynUser,
+                              void *registrarPvt)
+{
+    asynStatus status;
+
+    dispatchCancelled(drvPvt, dispatchInt32);
+    status = baseInt32Cancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchInt32);
+    return(status);
+}
+
+static asynStatus float64Register(void *drvPvt, asynUser *pasynUser,
+                                  interruptCallbackFloat64 callback, 
+                                  void *userPvt, void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchFloat64) != asynSuccess)
+        return(asynError);
+    status = baseFloat64Register(drvPvt, pasynUser, callback,
+                                 userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchFloat64);
+    else dispatchUnreserve(drvPvt, dispatchFloat64);
+    return(status);
+}
+
+static asynStatus float64Cancel(void *drvPvt, asynUser *pasynUser,
+                                void *registrarPvt)
+{
+    asynStatus status;
+
+    dispatchCancelled(drvPvt, dispatchFloat64);
+    status = baseFloat64Cancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchFloat64);
+    return(status);
+}
+
+static asynStatus int16ArrayRegister(void *drvPvt, asynUser *pasynUser,
+                                     interruptCallbackInt16Array callback,
+                                     void *userPvt, void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchInt16Array) != asynSuccess)
+        return(asynError);
+    status = baseInt16ArrayRegister(drvPvt, pasynUser, callback,
+                                    userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchInt16Array);
+    else dispatchUnreserve(drvPvt, dispatchInt16Array);
+    return(status);
+}
+
+static asynStatus int16ArrayCancel(void *drvPvt, asynUser *pasynUser,
+                                   void *registrarPvt)
+{
+    asynStatus status;
+
+    dispatchCancelled(drvPvt, dispatchInt16Array);
+    status = baseInt16ArrayCancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchInt16Array);
+    return(status);
+}
+
+static asynStatus int32ArrayRegister(void *drvPvt, asynUser *pasynUser,
+                                     interruptCallbackInt32Array callback,
+                                     void *userPvt, void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchInt32Array) != asynSuccess)
+        return(asynError);
+    status = baseInt32ArrayRegister(drvPvt, pasynUser, callback,
+                                    userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchInt32Array);
+    else dispatchUnreserve(drvPvt, dispatchInt32Array);
+    return(status);
+}
+
+static asynStatus int32ArrayCancel(void *drvPvt, asynUser *pasynUser,
+                                   void *registrarPvt)
+{
+    asynStatus status;
+
+    dispatchCancelled(drvPvt, dispatchInt32Array);
+    status = baseInt32ArrayCancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchInt32Array);
+    return(status);
+}
+
+static asynStatus float32ArrayRegister(void *drvPvt, asynUser *pasynUser,
+                                       interruptCallbackFloat32Array callback,
+                                       void *userPvt, void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchFloat32Array) != asynSuccess)
+        return(asynError);
+    status = baseFloat32ArrayRegister(drvPvt, pasynUser, callback,
+                                      userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchFloat32Array);
+    else dispatchUnreserve(drvPvt, dispatchFloat32Array);
+    return(status);
+}
+
+static asynStatus float32ArrayCancel(void *drvPvt, asynUser *pasynUser,
+                                     void *registrarPvt)
+{
+    asynStatus status;
 
-    pasynManager->getAddr(pasynUser, &channel);
+    dispatchCancelled(drvPvt, dispatchFloat32Array);
+    status = baseFloat32ArrayCancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchFloat32Array);
+    return(status);
+}
 
-    if (pPvt->rebooting) epicsThreadSuspendSelf();
-    if(gain<0 || gain>nGains || channel<0 || channel>pPvt->lastChan) 
-       return(-1);
-    if(gain != pPvt->chanSettings[channel].gain) 
-       status = setGainPrivate(pPvt, pPvt->range, gain, channel);
+static asynStatus float64ArrayRegister(void *drvPvt, asynUser *pasynUser,
+                                       interruptCallbackFloat64Array callback,
+                                       void *userPvt, void **registrarPvt)
+{
+    asynStatus status;
+
+    if (dispatchReserve(drvPvt, pasynUser, dispatchFloat64Array) != asynSuccess)
+        return(asynError);
+    status = baseFloat64ArrayRegister(drvPvt, pasynUser, callback,
+                                      userPvt, registrarPvt);
+    if (status == asynSuccess) dispatchRegistered(drvPvt, dispatchFloat64Array);
+    else dispatchUnreserve(drvPvt, dispatchFloat64Array);
     return(status);
 }
 
-static int setGainPrivate(drvIp330Pvt *pPvt, int range, int gain, int channel)
+static asynStatus float64ArrayCancel(void *drvPvt, asynUser *pasynUser,
+                                     void *registrarPvt)
 {
-    unsigned short saveControl;
+    asynStatus status;
 
-    if (pPvt->rebooting) epicsThreadSuspendSelf();
-    if(gain<0 || gain>=nGains) {
-        asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
-                  "drvIp330::setGainPrivate illegal gain value %d\n", gain);
-        return(-1);
-    }
-    saveControl = pPvt->regs->control;
-    pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
-    pPvt->chanSettings[channel].gain = gain;
-    pPvt->chanSettings[channel].volt_callo = 
-                                calibrationSettings[range][gain].volt_callo;
-    pPvt->chanSettings[channel].volt_calhi = 
-                                calibrationSettings[range][gain].volt_calhi;
-    pPvt->chanSettings[channel].ctl_callo = 
-                                calibrationSettings[range][gain].ctl_callo;
-    pPvt->chanSettings[channel].ctl_calhi = 
-                                calibrationSettings[range][gain].ctl_calhi;
-    pPvt->chanSettings[channel].ideal_span = 
-                                calibrationSettings[range][gain].ideal_span;
-    pPvt->chanSettings[channel].ideal_zero = 
-                                calibrationSettings[range][gain].ideal_zero;
-    pPvt->regs->gain[channel] = gain;
-    pPvt->regs->control = saveControl;
-    calibrate(pPvt, channel);
-    return(0);
+    dispatchCancelled(drvPvt, dispatchFloat64Array);
+    status = baseFloat64ArrayCancel(drvPvt, pasynUser, registrarPvt);
+    if (status == asynSuccess) dispatchUnreserve(drvPvt, dispatchFloat64Array);
+    return(status);
 }
 
-static int setTrigger(drvIp330Pvt *pPvt, triggerType trig)
+static void installDispatchHooks(void)
 {
-    if (pPvt->rebooting) epicsThreadSuspendSelf();
-    if (trig < 0 || trig >= nTriggers) return(-1);
-    pPvt->trigger = trig;
-    if (pPvt->trigger == output) pPvt->regs->control |= CTL_TRIGGER_OUTPUT;
-    return(0);
+    if (baseInt32Register) return;
+    baseInt32Register = drvIp330Int32.registerInterruptUser;
+    baseInt32Cancel = drvIp330Int32.cancelInterruptUser;
+    drvIp330Int32.registerInterruptUser = int32Register;
+    drvIp330Int32.cancelInterruptUser = int32Cancel;
+    baseFloat64Register = drvIp330Float64.registerInterruptUser;
+    baseFloat64Cancel = drvIp330Float64.cancelInterruptUser;
+    drvIp330Float64.registerInterruptUser = float64Register;
+    drvIp330Float64.cancelInterruptUser = float64Cancel;
+    baseInt16ArrayRegister = drvIp330Int16Array.registerInterruptUser;
+    baseInt16ArrayCancel = drvIp330Int16Array.cancelInterruptUser;
+    drvIp330Int16Array.registerInterruptUser = int16ArrayRegister;
+    drvIp330Int16Array.cancelInterruptUser = int16ArrayCancel;
+    baseInt32ArrayRegister = drvIp330Int32Array.registerInterruptUser;
+    baseInt32ArrayCancel = drvIp330Int32Array.cancelInterruptUser;
+    drvIp330Int32Array.registerInterruptUser = int32ArrayRegister;
+    drvIp330Int32Array.cancelInterruptUser = int32ArrayCancel;
+    baseFloat32ArrayRegister = drvIp330Float32Array.registerInterruptUser;
+    baseFloat32ArrayCancel = drvIp330Float32Array.cancelInterruptUser;
+    drvIp330Float32Array.registerInterruptUser = float32ArrayRegister;
+    drvIp330Float32Array.cancelInterruptUser = float32ArrayCancel;
+    baseFloat64ArrayRegister = drvIp330Float64Array.registerInterruptUser;
+    baseFloat64ArrayCancel = drvIp330Float64Array.cancelInterruptUser;
+    drvIp330Float64Array.registerInterruptUser = float64ArrayRegister;
+    drvIp330Float64Array.cancelInterruptUser = float64ArrayCancel;
 }
 
-static int setScanMode(drvIp330Pvt *pPvt, scanModeType mode)
+static int dispatchBucket(dispatchType type, void *pinterrupt)
 {
-    if (pPvt->rebooting) epicsThreadSuspendSelf();
-    if ((mode < disable) || (mode > convertOnExternalTriggerOnly)) return(-1);
-    pPvt->scanMode = mode;
-    pPvt->regs->control &= ~CTL_SCAN_MASK; /* Kill all scan bits first */
-    pPvt->regs->control |= pPvt->scanMode << CTL_SCAN_SHIFT;
-    return(0);
+    asynUser *pasynUser = NULL;
+    int addr = 0;
+
+    switch (dispatchInterface[type]) {
+    case dispatchInt32:
+        pasynUser = ((asynInt32Interrupt *)pinterrupt)->pasynUser;
+        addr = ((asynInt32Interrupt *)pinterrupt)->addr;
+        break;
+    case dispatchFloat64:
+        pasynUser = ((asynFloat64Interrupt *)pinterrupt)->pasynUser;
+        addr = ((asynFloat64Interrupt *)pinterrupt)->addr;
+        break;
+    case dispatchInt16Array:
+        pasynUser = ((asynInt16ArrayInterrupt *)pinterrupt)->pasynUser;
+        addr = ((asynInt16ArrayInterrupt *)pinterrupt)->addr;
+        break;
+    case dispatchInt32Array:
+        pasynUser = ((asynInt32ArrayInterrupt *)pinterrupt)->pasynUser;
+        addr = ((asynInt32ArrayInterrupt *)pinterrupt)->addr;
+        break;
+    case dispatchFloat32Array:
+        pasynUser = ((asynFloat32ArrayInterrupt *)pinterrupt)->pasynUser;
+        addr = ((asynFloat32ArrayInterrupt *)pinterrupt)->addr;
+        break;
+    case dispatchFloat64Array:
+    default:
+        pasynUser = ((asynFloat64ArrayInterrupt *)pinterrupt)->pasynUser;
+        addr = ((asynFloat64ArrayInterrupt *)pinterrupt)->addr;
+        break;
+    }
+    /* Unknown reasons go into a final bucket which is never dispatched */
+    if (pasynUser->reason < 0 || pasynUser->reason >= MAX_IP330_COMMANDS)
+        return(MAX_IP330_COMMANDS*DISPATCH_BUCKETS);
+    if (addr < 0 || addr >= MAX_IP330_CHANNELS) addr = MAX_IP330_CHANNELS;
+    return(pasynUser->reason*DISPATCH_BUCKETS + addr);
 }
 
-static void intFunc(int card)
+/* Counting sort of the client list into the dispatch table.
+ * Must be called between interruptStart and interruptEnd.  Returns -1,
+ * leaving the table unusable, if there is no room for the clients. */
+static int buildDispatch(ip330Dispatch *pd, dispatchType type,
+                         ELLLIST *pclientList)
 {
-    drvIp330Pvt *pPvt = driverTable[card];
-    int i;
-    int data[MAX_IP330_CHANNELS];
+    interruptNode *pnode;
+    int nClients = ellCount(pclientList);
+    int b;
+    ip330ClientArray *pArray;
+    void **clients;
 
-#ifdef linux
-    asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
-              "drvIp330::intFunc entry, card=%d\n", card);
-#endif
-    if (pPvt->type == differential) {
-       /* Must alternate between reading data from mailBox[i] and mailBox[i+16]
-        * Except in case of uniform/burstSingle, where only half of mailbox is 
-        * used. */
-       if(pPvt->scanMode == uniformSingle || pPvt->scanMode==burstSingle 
-                                          || pPvt->mailBoxOffset==16)
-          pPvt->mailBoxOffset = 0; 
-       else 
-          pPvt->mailBoxOffset = 16;
+    if ((nClients > pd->maxClients) && !epicsAtomicGetPtrT(&pd->retired) &&
+        (pArray = handoffTake(&pd->spare))) {
+        /* Swap in the array a registering thread allocated */
+        clients = pd->clients;
+        b = pd->maxClients;
+        pd->clients = pArray->clients;
+        pd->maxClients = pArray->size;
+        pArray->clients = clients;
+        pArray->size = b;
+        handoffPut(&pd->retired, pArray);
     }
-    for (i = pPvt->firstChan; i <= pPvt->lastChan; i++) {
-        data[i] = (pPvt->regs->mailBox[i + pPvt->mailBoxOffset]);
+    /* dispatchReserve makes room before a client is added, so this
+     * should not happen */
+    if (nClients > pd->maxClients) return(-1);
+    memset(pd->index, 0, sizeof(pd->index));
+    for (pnode = (interruptNode *)ellFirst(pclientList); pnode;
+         pnode = (interruptNode *)ellNext(&pnode->node)) {
+        pd->index[dispatchBucket(type, pnode->drvPvt) + 1]++;
     }
-    /* Wake up task which calls callback routines */
-    if (epicsMessageQueueTrySend(pPvt->intMsgQId, data, sizeof(data)) == 0)
-        pPvt->messagesSent++;
-    else
-        pPvt->messagesFailed++;
-    if (pPvt->rebooting) 
-        pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+    for (b=1; b<DISPATCH_INDEX_SIZE; b++) pd->index[b] += pd->index[b-1];
+    /* index[b] is the first free slot in bucket b.  After filling, index[b]
+     * is the end of bucket b, so shift it back to be the start. */
+    for (pnode = (interruptNode *)ellFirst(pclientList); pnode;
+         pnode = (interruptNode *)ellNext(&pnode->node)) {
+        b = dispatchBucket(type, pnode->drvPvt);
+        pd->clients[pd->index[b]++] = pnode->drvPvt;
+    }
+    memmove(&pd->index[1], &pd->index[0], 
+            (DISPATCH_INDEX_SIZE-1)*sizeof(pd->index[0]));
+    pd->index[0] = 0;
+    pd->nListed = nClients;
+    return(0);
 }
 
-static void intTask(drvIp330Pvt *pPvt)
+/* Start a callback pass on one interface.  Returns NULL, without calling
+ * interruptStart, if no client has ever been registered. */
+static ip330Dispatch *dispatchStart(drvIp330Pvt *pPvt, dispatchType type)
 {
-    int  i;
-    int addr, reason;
-    int data[MAX_IP330_CHANNELS];
+    ip330Dispatch *pd = &pPvt->dispatch[type];
     ELLLIST *pclientList;
-    interruptNode *pnode;
 
-    while(1) {
-        /* Wait for event from interrupt routine */
-        epicsMessageQueueReceive(pPvt->intMsgQId, data, sizeof(data));
-        for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
-            pPvt->chanData[i] = data[i];
-        }
-        /* Correct the data */
-        correctAll(pPvt);
-                 
-        /* Pass int32 interrupts */
-        pasynManager->interruptStart(pPvt->int32InterruptPvt, &pclientList);
-        pnode = (interruptNode *)ellFirst(pclientList);
-        while (pnode) {
-            asynInt32Interrupt *pint32Interrupt = pnode->drvPvt;
-            addr = pint32Interrupt->addr;
-            reason = pint32Interrupt->pasynUser->reason;
-            if (reason == ip330Data) {
-                pint32Interrupt->callback(pint32Interrupt->userPvt, 
-                                          pint32Interrupt->pasynUser,
-                                          pPvt->correctedData[addr]);
-            }
-            pnode = (interruptNode *)ellNext(&pnode->node);
+    if ((pd->nListed == 0) && (epicsAtomicGetIntT(&pd->nRegistered) == 0) &&
+        !epicsAtomicGetIntT(&pd->dirty)) return(NULL);
+    pasynManager->interruptStart(pd->interruptPvt, &pclientList);
+    if (epicsAtomicCmpAndSwapIntT(&pd->dirty, 1, 0) ||
+        (ellCount(pclientList) != pd->nListed)) {
+        if (buildDispatch(pd, type, pclientList)) {
+            /* Skip this scan's callbacks and retry on the next */
+            pasynManager->interruptEnd(pd->interruptPvt);
+            epicsAtomicSetIntT(&pd->dirty, 1);
+            return(NULL);
         }
-        pasynManager->interruptEnd(pPvt->int32InterruptPvt);
+    }
+    return(pd);
+}
 
-        /* Pass float64 interrupts */
-        pasynManager->interruptStart(pPvt->float64InterruptPvt, &pclientList);
-        pnode = (interruptNode *)ellFirst(pclientList);
-        while (pnode) {
-            asynFloat64Interrupt *pfloat64Interrupt = pnode->drvPvt;
-            addr = pfloat64Interrupt->addr;
-            reason = pfloat64Interrupt->pasynUser->reason;
-            if (reason == ip330Data) {
-                pfloat64Interrupt->callback(pfloat64Interrupt->userPvt, 
-                                            pfloat64Interrupt->pasynUser,
-                                            (double)pPvt->correctedData[addr]);
-            }
-            pnode = (interruptNode *)ellNext(&pnode->node);
-        }
-        pasynManager->interruptEnd(pPvt->float64InterruptPvt);
+static void dispatchEnd(ip330Dispatch *pd)
+{
+    pasynManager->interruptEnd(pd->interruptPvt);
+}
 
-        /* Pass int32Array interrupts */
-        pasynManager->interruptStart(pPvt->int32ArrayInterruptPvt, &pclientList);
-        pnode = (interruptNode *)ellFirst(pclientList);
-        while (pnode) {
-            asynInt32ArrayInterrupt *pint32ArrayInterrupt = pnode->drvPvt;
-            reason = pint32ArrayInterrupt->pasynUser->reason;
-            if (reason == ip330Data) {
-                pint32ArrayInterrupt->callback(pint32ArrayInterrupt->userPvt, 
-                                               pint32ArrayInterrupt->pasynUser,
-                                               pPvt->correctedData, 
-                                               MAX_IP330_CHANNELS);
-            }
-            pnode = (interruptNode *)ellNext(&pnode->node);
-        }
-        pasynManager->interruptEnd(pPvt->int32ArrayInterruptPvt);
+
+/* Start a calibration burst.  If interrupts are enabled, calibrate has
+ * set CTL_INTERRUPT_AFTER_ALL and intFunc will wake up waitNewData. */
+static void startBurst(drvIp330Pvt *pPvt)
+{
+    if (pPvt->irqEnabled) {
+        epicsEventTryWait(pPvt->calEventId);
+        pPvt->calWaiting = 1;
+        epicsAtomicWriteMemoryBarrier();
     }
+    pPvt->regs->startConvert = 0x0001;
 }
 
-
-#define MAX_TIMES 1000000
-static void waitNewData(drvIp330Pvt *pPvt)
+/* Wait for a burst of nConversions to complete.  A calibration burst only
+ * takes about 0.5 ms, so spin briefly first, then sleep until intFunc
+ * signals the end of the burst.  Without interrupts this polls with short
+ * sleeps.  The scan timer may still delay the burst by one scan period. */
+static asynStatus waitNewData(drvIp330Pvt *pPvt, int nConversions)
 {
-    int ntimes=0;
-    while(ntimes++ < MAX_TIMES) {
-        if (pPvt->regs->newData[1]==0xffff) return;
+    double timeout;
+    epicsTimeStamp start, now;
+    int i;
+
+    timeout = WAIT_MARGIN * (nConversions * CONVERSION_MICROSECONDS / 1.e6 +
+                             pPvt->actualScanPeriod);
+    if (timeout < WAIT_MIN_SECONDS) timeout = WAIT_MIN_SECONDS;
+    epicsTimeGetCurrent(&start);
+    for (i=0; i<WAIT_SPIN_COUNT; i++) {
+        if (pPvt->regs->newData[1]==0xffff) goto finish;
+        if (pPvt->irqEnabled && !pPvt->calWaiting) goto finish;
+    }
+    while (1) {
+        if (pPvt->irqEnabled)
+            epicsEventWaitWithTimeout(pPvt->calEventId, WAIT_POLL_SECONDS);
+        else
+            epicsThreadSleep(WAIT_POLL_SECONDS);
+        if (pPvt->regs->newData[1]==0xffff) goto finish;
+        /* intFunc clears calWaiting at the end of the burst */
+        if (pPvt->irqEnabled && !pPvt->calWaiting) goto finish;
+        epicsTimeGetCurrent(&now);
+        if (epicsTimeDiffInSeconds(&now, &start) > timeout) break;
+    }
+    /* calWaiting stays set, so that intFunc drops the interrupt if the
+     * burst completes late rather than reading it as a scan */
+    errlogPrintf("drvIp330::waitNewData time out after %f seconds\n", timeout);
+    return(asynTimeout);
+
+finish:
+    /* Take the interrupt for this burst here, so that intFunc does not
+     * treat it as a scan once calibrate restores normal scanning.  If it
+     * does not come in time calWaiting stays set and intFunc drops it. */
+    while (pPvt->calWaiting) {
+        epicsEventWaitWithTimeout(pPvt->calEventId, WAIT_POLL_SECONDS);
+        epicsTimeGetCurrent(&now);
+        if (epicsTimeDiffInSeconds(&now, &start) > timeout) break;
     }
-    errlogPrintf("drvIp330::waitNewData time out\n");
+    return(asynSuccess);
 }
 
 static asynStatus setSecondsBetweenCalibrate(void *drvPvt, asynUser *pasynUser,
@@ -883,32 +4317,78 @@ static void autoCalibrate(void *drvPvt)
 {
     drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     int i;
+    int gainMask = 0;
 
     if (pPvt->rebooting) epicsThreadSuspendSelf();
     epicsTimerCancel(pPvt->timerId);
+    /* Only the gains in use need to be calibrated */
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++)
+        gainMask |= 1 << pPvt->chanSettings[i].gain;
     asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
               "drvIp330::autoCalibrate starting calibration\n");
-    for(i=pPvt->firstChan; i<= pPvt->lastChan; i++)
-        calibrate(pPvt, i);
+    if (pPvt->pWorker && 
+        ((pPvt->scanMode == uniformContinuous) ||
+         (pPvt->scanMode == burstContinuous))) {
+        /* Scanning continuously, let intFunc calibrate between scans */
+        if (!pPvt->calPassActive) {
+            for (i=0; !(gainMask & (1 << i)); i++);
+            pPvt->calGain = i;
+            pPvt->calGainMask = gainMask;
+            pPvt->calHigh = 0;
+            epicsAtomicWriteMemoryBarrier();
+            pPvt->calPassActive = 1;
+        }
+    } else {
+        for (i=0; i<nGains; i++)
+            if (gainMask & (1 << i)) calibrate(pPvt, i);
+    }
     if (pPvt->secondsBetweenCalibrate > 0)
         epicsTimerStartDelay(pPvt->timerId, pPvt->secondsBetweenCalibrate);
 }
 
 
-/* See Acromag User's Manual for details about callibration */
-static int calibrate(drvIp330Pvt *pPvt, int channel)
+/* See Acromag User's Manual for details about callibration.
+ * All 32 channels are converted at the given gain against the internal
+ * references, so the result applies to every channel with that gain. */
+static int calibrate(drvIp330Pvt *pPvt, int gain)
 {
+    const calibrationSetting *pSetting = &calibrationSettings[pPvt->range][gain];
     unsigned short saveControl;
     unsigned char saveStartChanVal;
     unsigned char saveEndChanVal;
     unsigned short val;
+    unsigned short interrupt;
     double count_callo;
     double count_calhi;
-    double m, cal1, cal2;
     long sum;
     int i;
+    int status = 0;
+    int key;
+    double timeout;
 
     if (pPvt->rebooting) epicsThreadSuspendSelf();
+    /* Stop intFunc from starting calibration steps, and wait for a step in
+     * progress to finish.  A step takes 2 bursts of 32 conversions after
+     * a scan. */
+    epicsEventTryWait(pPvt->calIdleEventId);
+    key = epicsInterruptLock();
+    pPvt->calBlocking = 1;
+    epicsInterruptUnlock(key);
+    if (pPvt->calState != calIdle) {
+        timeout = WAIT_MARGIN * (2 * MAX_IP330_CHANNELS * 
+                                 CONVERSION_MICROSECONDS / 1.e6 +
+                                 pPvt->actualScanPeriod);
+        if (timeout < WAIT_MIN_SECONDS) timeout = WAIT_MIN_SECONDS;
+        epicsEventWaitWithTimeout(pPvt->calIdleEventId, timeout);
+        if (pPvt->calState != calIdle) {
+            /* Leave the step to intFunc, it still owns the registers */
+            pPvt->calBlocking = 0;
+            asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
+                      "drvIp330::calibrate time out waiting for a calibration"
+                      " step, gain %d not calibrated\n", gain);
+            return(-1);
+        }
+    }
     saveControl = pPvt->regs->control;
     pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
     /* Disable scan mode and interrupts */
@@ -918,17 +4398,19 @@ static int calibrate(drvIp330Pvt *pPvt, int channel)
     pPvt->regs->endChanVal = 31;
     pPvt->regs->startChanVal = 0;
     for (i = 0; i < MAX_IP330_CHANNELS; i++) 
-        pPvt->regs->gain[i] = pPvt->chanSettings[channel].gain;
+        pPvt->regs->gain[i] = gain;
+    /* Let intFunc wake us up at the end of each burst */
+    interrupt = pPvt->irqEnabled ? CTL_INTERRUPT_AFTER_ALL : 0;
     pPvt->regs->control = CTL_SCAN_BURST_SINGLE | CTL_OUTPUT_STRAIGHT_BINARY | 
-                         (CTL_INPUT_MASK & (pPvt->chanSettings[channel].ctl_callo));
-    pPvt->regs->startConvert = 0x0001;
-    waitNewData(pPvt);
+                          interrupt | (CTL_INPUT_MASK & (pSetting->ctl_callo));
+    startBurst(pPvt);
+    if (waitNewData(pPvt, MAX_IP330_CHANNELS) != asynSuccess) goto restore;
     /* Ignore first set of data so that adc has time to settle */
-    pPvt->regs->startConvert = 0x0001;
-    waitNewData(pPvt);
+    startBurst(pPvt);
+    if (waitNewData(pPvt, MAX_IP330_CHANNELS) != asynSuccess) goto restore;
     asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
-              "drvIp330::calibrate. Raw values low channel=%d\n",
-              channel);
+              "drvIp330::calibrate. Raw values low gain=%d\n",
+              gain);
     sum = 0;
     for (i = 0; i < MAX_IP330_CHANNELS; i++) {
         val = pPvt->regs->mailBox[i];
@@ -939,15 +4421,15 @@ static int calibrate(drvIp330Pvt *pPvt, int channel)
     count_callo = ((double)sum)/(double)MAX_IP330_CHANNELS;
     /* determine count_calhi */
     pPvt->regs->control = CTL_SCAN_BURST_SINGLE | CTL_OUTPUT_STRAIGHT_BINARY | 
-                         (CTL_INPUT_MASK & (pPvt->chanSettings[channel].ctl_calhi));
-    pPvt->regs->startConvert = 0x0001;
-    waitNewData(pPvt);
+                          interrupt | (CTL_INPUT_MASK & (pSetting->ctl_calhi));
+    startBurst(pPvt);
+    if (waitNewData(pPvt, MAX_IP330_CHANNELS) != asynSuccess) goto restore;
     /* Ignore first set of data so that adc has time to settle */
-    pPvt->regs->startConvert = 0x0001;
-    waitNewData(pPvt);
+    startBurst(pPvt);
+    if (waitNewData(pPvt, MAX_IP330_CHANNELS) != asynSuccess) goto restore;
     asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
-              "drvIp33::calibrate. Raw values high channel=%d\n",
-              channel);
+              "drvIp33::calibrate. Raw values high gain=%d\n",
+              gain);
     sum = 0;
     for (i = 0; i < MAX_IP330_CHANNELS; i++) {
         val = pPvt->regs->mailBox[i];
@@ -957,23 +4439,14 @@ static int calibrate(drvIp330Pvt *pPvt, int channel)
     }
     count_calhi = ((double)sum)/(double)MAX_IP330_CHANNELS;
 
-    m = pgaGain[pPvt->chanSettings[channel].gain] *
-        ((pPvt->chanSettings[channel].volt_calhi - 
-          pPvt->chanSettings[channel].volt_callo) /
-         (count_calhi - count_callo));
-    cal1 = (65536.0 * m) / pPvt->chanSettings[channel].ideal_span;
-    cal2 =
-          ((pPvt->chanSettings[channel].volt_callo * 
-            pgaGain[pPvt->chanSettings[channel].gain])
-            - pPvt->chanSettings[channel].ideal_zero)
-          / m - count_callo;
-    epicsMutexLock(pPvt->lock);
-    pPvt->chanSettings[channel].adj_slope = cal1;
-    pPvt->chanSettings[channel].adj_offset = cal2;
-    epicsMutexUnlock(pPvt->lock);
-    asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
-              "drvIp330::calibrate channel %d adj_slope %e adj_offset %e\n",
-              channel, cal1, cal2);
+    computeCoefficients(pPvt, gain, count_callo, count_calhi);
+    goto done;
+
+restore:
+    asynPrint(pPvt->pasynUser, ASYN_TRACE_ERROR,
+              "drvIp330::calibrate time out, gain %d not calibrated\n", gain);
+    status = -1;
+done:
     /* restore control and gain values */
     pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
     pPvt->regs->control = saveControl;
@@ -989,8 +4462,133 @@ static int calibrate(drvIp330Pvt *pPvt, int channel)
     }
     if (pPvt->rebooting) 
         pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+    pPvt->missedDataStale = 1;
+    pPvt->regs->startConvert = 0x0001;
+    pPvt->calBlocking = 0;
+    return (status);
+}
+
+static void computeCoefficients(drvIp330Pvt *pPvt, int gain,
+                                double count_callo, double count_calhi)
+{
+    const calibrationSetting *pSetting = &calibrationSettings[pPvt->range][gain];
+    double m, cal1, cal2;
+
+    m = pgaGain[gain] *
+        ((pSetting->volt_calhi - pSetting->volt_callo) /
+         (count_calhi - count_callo));
+    cal1 = (65536.0 * m) / pSetting->ideal_span;
+    cal2 =
+          ((pSetting->volt_callo * pgaGain[gain]) - pSetting->ideal_zero)
+          / m - count_callo;
+    setGainCoefficients(pPvt, gain, cal1, cal2);
+    asynPrint(pPvt->pasynUser, ASYN_TRACEIO_DRIVER,
+              "drvIp330::calibrate gain %d adj_slope %e adj_offset %e\n",
+              gain, cal1, cal2);
+}
+
+/* Incremental calibration, called from intFunc.
+ * These only touch registers and integers, so they are safe at interrupt 
+ * level.  The floating point work is done by finishCalibrateStep in 
+ * intTask. */
+static void startCalibrateStep(drvIp330Pvt *pPvt)
+{
+    const calibrationSetting *pSetting = 
+                          &calibrationSettings[pPvt->range][pPvt->calGain];
+    unsigned char ctl;
+    int i;
+
+    getInterruptTime(&pPvt->calStepStart);
+    pPvt->calSaveControl = pPvt->regs->control;
+    pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+    pPvt->calSaveStartChanVal = pPvt->regs->startChanVal;
+    pPvt->calSaveEndChanVal = pPvt->regs->endChanVal;
+    pPvt->regs->endChanVal = 31;
+    pPvt->regs->startChanVal = 0;
+    for (i = 0; i < MAX_IP330_CHANNELS; i++) 
+        pPvt->regs->gain[i] = pPvt->calGain;
+    ctl = pPvt->calHigh ? pSetting->ctl_calhi : pSetting->ctl_callo;
+    pPvt->regs->control = CTL_SCAN_BURST_SINGLE | CTL_OUTPUT_STRAIGHT_BINARY |
+                          CTL_INTERRUPT_AFTER_ALL | (CTL_INPUT_MASK & ctl);
+    pPvt->calState = calSettle;
+    pPvt->regs->startConvert = 0x0001;
+}
+
+static void calibrateInterrupt(drvIp330Pvt *pPvt)
+{
+    unsigned long sum;
+    int i;
+
+    if (pPvt->calState == calSettle) {
+        /* Ignore first set of data so that adc has time to settle */
+        pPvt->calState = calMeasure;
+        pPvt->regs->startConvert = 0x0001;
+        return;
+    }
+    sum = 0;
+    for (i = 0; i < MAX_IP330_CHANNELS; i++) 
+        sum += pPvt->regs->mailBox[i];
+    /* Restore normal scanning */
+    pPvt->regs->control &= DISABLE_SCAN_AND_INTERRUPT;
+    pPvt->regs->startChanVal = pPvt->calSaveStartChanVal;
+    pPvt->regs->endChanVal = pPvt->calSaveEndChanVal;
+    for (i = 0; i < MAX_IP330_CHANNELS; i++) 
+        pPvt->regs->gain[i] = pPvt->chanSettings[i].gain;
+    if (pPvt->type == differential) {
+        pPvt->mailBoxOffset = 16; /* make it start over*/
+    } else {
+        pPvt->mailBoxOffset = 0;
+    }
+    pPvt->regs->control = pPvt->calSaveControl;
+    pPvt->calState = calIdle;
+    pPvt->missedDataStale = 1;
     pPvt->regs->startConvert = 0x0001;
-    return (0);
+    getInterruptTime(&pPvt->calStepEnd);
+    pPvt->calSteps++;
+    epicsEventSignal(pPvt->calIdleEventId);
+    if (!pPvt->calHigh) {
+        pPvt->calSumLo = sum;
+        pPvt->calHigh = 1;
+        return;
+    }
+    pPvt->calResultGain = pPvt->calGain;
+    pPvt->calResultLo = pPvt->calSumLo;
+    pPvt->calResultHi = sum;
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->calResultReady = 1;
+    pPvt->calHigh = 0;
+    pPvt->calGainMask &= ~(1 << pPvt->calGain);
+    if (pPvt->calGainMask == 0) {
+        pPvt->calPassActive = 0;
+    } else {
+        while (!(pPvt->calGainMask & (1 << pPvt->calGain))) pPvt->calGain++;
+    }
+}
+
+/* Called from intTask to complete the calibration of a gain and to
+ * record the length of the hole in the data */
+static void finishCalibrateStep(drvIp330Pvt *pPvt)
+{
+    double gap;
+
+    if (pPvt->calSteps != pPvt->calStepsSeen) {
+        pPvt->calStepsSeen = pPvt->calSteps;
+        /* No gap if intFunc could not read the time */
+        if ((pPvt->calStepStart.secPastEpoch != 0) &&
+            (pPvt->calStepEnd.secPastEpoch != 0)) {
+            gap = epicsTimeDiffInSeconds(&pPvt->calStepEnd,
+                                         &pPvt->calStepStart);
+            pPvt->calLastGap = gap;
+            if (gap > pPvt->calMaxGap) pPvt->calMaxGap = gap;
+        }
+    }
+    if (!pPvt->calResultReady) return;
+    epicsAtomicReadMemoryBarrier();
+    computeCoefficients(pPvt, pPvt->calResultGain,
+                        (double)pPvt->calResultLo/(double)MAX_IP330_CHANNELS,
+                        (double)pPvt->calResultHi/(double)MAX_IP330_CHANNELS);
+    epicsAtomicWriteMemoryBarrier();
+    pPvt->calResultReady = 0;
 }
 
 static void rebootCallback(void *drvPvt)
@@ -1005,11 +4603,53 @@ static double getActualScanPeriod(drvIp330Pvt *pPvt)
     double microSeconds;
 
     if (pPvt->rebooting) epicsThreadSuspendSelf();
-    microSeconds = (15. * (pPvt->lastChan - pPvt->firstChan + 1)) +
+    if (pPvt->scanMode == uniformContinuous)
+        /* The timer starts the conversion of each channel */
+        microSeconds = (pPvt->lastChan - pPvt->firstChan + 1) *
+          (pPvt->regs->timePrescale * pPvt->regs->conversionTime) / 8.;
+    else
+        microSeconds = 
+          (CONVERSION_MICROSECONDS * (pPvt->lastChan - pPvt->firstChan + 1)) +
           (pPvt->regs->timePrescale * pPvt->regs->conversionTime) / 8.;
     return(microSeconds / 1.e6);
 }
 
+static void setSampleInterval(drvIp330Pvt *pPvt)
+{
+    if (pPvt->scanMode == uniformContinuous)
+        pPvt->sampleInterval = 
+          (pPvt->regs->timePrescale * pPvt->regs->conversionTime) / 8.e6;
+    else
+        pPvt->sampleInterval = CONVERSION_MICROSECONDS / 1.e6;
+}
+
+/* Time for code which can run at interrupt level.  Often only vxWorks and
+ * RTEMS register an interrupt safe time provider.  Elsewhere intFunc is
+ * called in thread context, by the ipac interrupt thread or the simulator,
+ * and the normal time is used.  Returns -1 with the time zeroed if there is
+ * no time. */
+static int getInterruptTime(epicsTimeStamp *pTime)
+{
+    if (epicsTimeGetCurrentInt(pTime) == epicsTimeOK) return(0);
+    if (!epicsInterruptIsInterruptContext() &&
+        (epicsTimeGetCurrent(pTime) == epicsTimeOK)) return(0);
+    pTime->secPastEpoch = 0;
+    pTime->nsec = 0;
+    return(-1);
+}
+
+static void computeSampleTimes(drvIp330Pvt *pPvt)
+{
+    int i;
+
+    /* The interrupt comes at the end of the conversion of lastChan */
+    for (i=pPvt->firstChan; i<=pPvt->lastChan; i++) {
+        pPvt->sampleTime[i] = pPvt->scanTime;
+        epicsTimeAddSeconds(&pPvt->sampleTime[i],
+                            -(pPvt->lastChan - i) * pPvt->sampleInterval);
+    }
+}
+
 /* Note: we cache actualScanPeriod for efficiency, so that
  * getActualScanPeriod is only called when the time registers are
  * changed.  It is important for getScanPeriod to be efficient, since
@@ -1068,6 +4708,8 @@ finish:
     pPvt->regs->timePrescale = timePrescale;
     pPvt->regs->conversionTime = timeConvert;
     pPvt->actualScanPeriod = getActualScanPeriod(pPvt);
+    setSampleInterval(pPvt);
+    pPvt->scanBreak = 1;
     /* Call the callback routines which have registered to be notified when
        the scan period changes */
     pasynManager->interruptStart(pPvt->float64InterruptPvt, &pclientList);
@@ -1097,13 +4739,47 @@ static asynStatus drvUserCreate(void *drvPvt, asynUser *pasynUser,
                                 const char *drvInfo, 
                                 const char **pptypeName, size_t *psize)
 {
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
     int i;
+    int addr;
     char *pstring;
+    const char *options;
+    size_t len;
+    ip330RateUser *pRate;
 
+    /* Options follow the command after '?', e.g. "DATA?decimate=100" */
+    options = strchr(drvInfo, '?');
+    len = options ? (size_t)(options - drvInfo) : strlen(drvInfo);
     for (i=0; i<MAX_IP330_COMMANDS; i++) {
         pstring = ip330Commands[i].commandString;
-        if (epicsStrCaseCmp(drvInfo, pstring) == 0) {
+        if ((strlen(pstring) == len) &&
+            (epicsStrnCaseCmp(drvInfo, pstring, len) == 0)) {
             pasynUser->reason = ip330Commands[i].command;
+            if (options) {
+                if ((pasynUser->reason != ip330Data) &&
+                    (pasynUser->reason != ip330Filtered) &&
+                    (pasynUser->reason != ip330Egu)) {
+                    epicsSnprintf(pasynUser->errorMessage,
+                                  pasynUser->errorMessageSize,
+                                  "drvIp330::drvUserCreate, %s takes no "
+                                  "options", pstring);
+                    return(asynError);
+                }
+                if (parseRateOptions(pasynUser, options+1, &pRate))
+                    return(asynError);
+                if (pasynUser->drvUser) free(pRate);
+                else pasynUser->drvUser = pRate;
+            }
+            if ((pasynUser->reason == ip330Average) && !pasynUser->drvUser) {
+                ip330AverageUser *pAverage = callocMustSucceed(1, 
+                                  sizeof(*pAverage), "drvIp330::drvUserCreate");
+                pasynManager->getAddr(pasynUser, &addr);
+                if (addr >= 0 && addr < MAX_IP330_CHANNELS)
+                    readAverageTotals(pPvt, addr, &pAverage->sum, 
+                                      &pAverage->count);
+                pasynUser->drvUser = pAverage;
+                epicsAtomicIncrIntT(&pPvt->averageUsers);
+            }
             if (pptypeName) *pptypeName = epicsStrDup(pstring);
             if (psize) *psize = sizeof(ip330Commands[i].command);
             asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
@@ -1115,6 +4791,58 @@ static asynStatus drvUserCreate(void *drvPvt, asynUser *pasynUser,
                   "drvIp330::drvUserCreate, unknown command=%s", drvInfo);
     return(asynError);
 }
+
+/* Parse the options of a value client, separated by '&':
+ *     decimate=N      callback every N scans
+ *     rate=F[Hz]      callback at most F times a second
+ *     average         callback with the average of the scans since the last
+ * Exactly one of decimate and rate must be given. */
+static asynStatus parseRateOptions(asynUser *pasynUser, const char *options,
+                                   ip330RateUser **ppRate)
+{
+    ip330RateUser rate;
+    const char *p = options;
+    char *end;
+    long decimate;
+    double frequency;
+
+    memset(&rate, 0, sizeof(rate));
+    while (*p) {
+        if (epicsStrnCaseCmp(p, "decimate=", 9) == 0) {
+            decimate = strtol(p+9, &end, 10);
+            if ((end == p+9) || (decimate < 1)) goto bad;
+            rate.decimate = (int)decimate;
+        } else if (epicsStrnCaseCmp(p, "rate=", 5) == 0) {
+            frequency = strtod(p+5, &end);
+            if ((end == p+5) || !(frequency > 0.)) goto bad;
+            while (*end == ' ') end++;
+            if (epicsStrnCaseCmp(end, "Hz", 2) == 0) end += 2;
+            rate.period = 1. / frequency;
+        } else if (epicsStrnCaseCmp(p, "average", 7) == 0) {
+            end = (char *)p + 7;
+            rate.average = 1;
+        } else {
+            goto bad;
+        }
+        if (*end == '&') end++;
+        else if (*end) goto bad;
+        p = end;
+    }
+    if (!rate.decimate == !(rate.period > 0.)) {
+        epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                      "drvIp330::drvUserCreate, need one of decimate= or "
+                      "rate= in \"%s\"", options);
+        return(asynError);
+    }
+    *ppRate = callocMustSucceed(1, sizeof(rate), "drvIp330::drvUserCreate");
+    **ppRate = rate;
+    return(asynSuccess);
+
+bad:
+    epicsSnprintf(pasynUser->errorMessage, pasynUser->errorMessageSize,
+                  "drvIp330::drvUserCreate, illegal option \"%s\"", p);
+    return(asynError);
+}
     
 static asynStatus drvUserGetType(void *drvPvt, asynUser *pasynUser,
                                  const char **pptypeName, size_t *psize)
@@ -1128,6 +4856,18 @@ static asynStatus drvUserGetType(void *drvPvt, asynUser *pasynUser,
 
 static asynStatus drvUserDestroy(void *drvPvt, asynUser *pasynUser)
 {
+    drvIp330Pvt *pPvt = (drvIp330Pvt *)drvPvt;
+
+    if ((pasynUser->reason == ip330Average) && pasynUser->drvUser) {
+        free(pasynUser->drvUser);
+        pasynUser->drvUser = NULL;
+        epicsAtomicDecrIntT(&pPvt->averageUsers);
+    } else if (((pasynUser->reason == ip330Data) ||
+                (pasynUser->reason == ip330Filtered) ||
+                (pasynUser->reason == ip330Egu)) && pasynUser->drvUser) {
+        free(pasynUser->drvUser);
+        pasynUser->drvUser = NULL;
+    }
     return(asynSuccess);
 }
 
@@ -1140,19 +4880,91 @@ static void report(void *drvPvt, FILE *fp, int details)
     int i;
     interruptNode *pnode;
     ELLLIST *pclientList;
+    const ip330Coefficients *pCoef = 
+                        &pPvt->coefficients[pPvt->coefGeneration & 1];
 
     fprintf(fp, "Port: %s, carrier %d slot %d, base address=%p\n", 
             pPvt->portName, pPvt->carrier, pPvt->slot, (void *)pPvt->regs);
+#ifdef linux
+    if (pPvt->pSim) ip330SimReport(pPvt->pSim, fp);
+#endif
     if (details >= 1) {
-        fprintf(fp, "    messages sent OK=%d; send failed (queue full)=%d\n",
-                pPvt->messagesSent, pPvt->messagesFailed);
+        fprintf(fp, "    frame ring depth=%d, high water=%d, frames received=%d,"
+                    " overruns (ring full)=%d\n",
+                pPvt->ringMask + 1, pPvt->ringHighWater,
+                pPvt->framesReceived, pPvt->ringOverruns);
+        if (pPvt->pWorker)
+            fprintf(fp, "    dispatch worker %d of %d, cards=%d, batches=%lu,"
+                        " steals=%lu\n",
+                    pPvt->pWorker->index, numWorkers, pPvt->pWorker->nCards,
+                    pPvt->pWorker->batches, pPvt->pWorker->steals);
+        if (pPvt->pWorker)
+            reportThreadPolicy(fp, "dispatch worker",
+                               &workerPolicy[pPvt->pWorker->index]);
+        reportThreadPolicy(fp, "calibration", &calPolicy);
+        if (memoryLocked || memoryLockStatus)
+            fprintf(fp, "    memory lock: %s\n",
+                    memoryLocked ? "locked" : strerror(memoryLockStatus));
         fprintf(fp, "    firstChan=%d, lastChan=%d, scanPeriod=%f\n",
                 pPvt->firstChan, pPvt->lastChan, pPvt->actualScanPeriod);
+        fprintf(fp, "    missed data total=%u, ping-pong errors=%d\n",
+                pPvt->missedTotal, pPvt->pingPongErrors);
+        fprintf(fp, "    max latency queue=%f, correct=%f, callback=%f,"
+                    " total=%f, max jitter=%f\n",
+                pPvt->histograms[histQueue].max,
+                pPvt->histograms[histCorrect].max,
+                pPvt->histograms[histCallback].max,
+                pPvt->histograms[histTotal].max,
+                pPvt->histograms[histJitter].max);
+        fprintf(fp, "    correction kernel=%s, calibration generation=%u\n",
+                ip330CorrectKernelName, pPvt->coefGeneration);
+        fprintf(fp, "    filter kernel=%s, biquad sections=%d, FIR taps=%d\n",
+                ip330FilterKernelName, pPvt->filter.nSections,
+                pPvt->filter.nTaps);
+        fprintf(fp, "    incremental calibration active=%d, steps=%u,"
+                    " last gap=%f, max gap=%f\n",
+                pPvt->calPassActive, pPvt->calSteps, pPvt->calLastGap,
+                pPvt->calMaxGap);
+        for (i=0; i<nGains; i++) {
+            if (!pPvt->gainCalibration[i].valid) continue;
+            fprintf(fp, "    gain %d calibration offset=%f slope=%f\n", i,
+                    pPvt->gainCalibration[i].adj_offset,
+                    pPvt->gainCalibration[i].adj_slope);
+        }
+        fprintf(fp, "    statistics window=%d, requested window=%d\n",
+                pPvt->statWindow, pPvt->requestedStatWindow);
+        fprintf(fp, "    channels with a deadband=%d\n", pPvt->deadbandChans);
+        fprintf(fp, "    blockSize=%d, requested blockSize=%d\n",
+                pPvt->blockSize, pPvt->requestedBlockSize);
+        fprintf(fp, "    capture state=%d, depth=%d, post=%d, filled=%d,"
+                    " frozen=%d\n",
+                pPvt->captureState, pPvt->captureDepth, pPvt->capturePost,
+                pPvt->captureFilled, pPvt->captureFrozen);
+        epicsMutexLock(pPvt->lock);
+        if (pPvt->pRecorder)
+            ip330RecorderReport(pPvt->pRecorder, fp);
+        else if (pPvt->closedRecorder)
+            ip330RecorderReport(pPvt->closedRecorder, fp);
+        epicsMutexUnlock(pPvt->lock);
+        fprintf(fp, "    spectrum size=%d, requested size=%d, window=%d,"
+                    " averages=%d, spectra=%lu, skipped blocks=%lu\n",
+                pPvt->spectrumSize, pPvt->requestedSpectrumSize,
+                pPvt->spectrumWindow, pPvt->spectrumAverages,
+                pPvt->spectrumCount, pPvt->spectrumSkipped);
+        fprintf(fp, "    dispatch clients int32=%d, float64=%d, int16Array=%d,"
+                    " int32Array=%d, float32Array=%d, float64Array=%d\n",
+                pPvt->dispatch[dispatchInt32].nListed,
+                pPvt->dispatch[dispatchFloat64].nListed,
+                pPvt->dispatch[dispatchInt16Array].nListed,
+                pPvt->dispatch[dispatchInt32Array].nListed,
+                pPvt->dispatch[dispatchFloat32Array].nListed,
+                pPvt->dispatch[dispatchFloat64Array].nListed);
         for (i=0; i<MAX_IP330_CHANNELS; i++) {
-           fprintf(fp, "    chan %d, offset=%f slope=%f, raw=%d corrected=%d\n",
-                   i, pPvt->chanSettings[i].adj_offset, 
-                   pPvt->chanSettings[i].adj_slope, 
-                   pPvt->chanData[i], pPvt->correctedData[i]);
+           fprintf(fp, "    chan %d, offset=%f slope=%f, raw=%d corrected=%d,"
+                       " missed=%d\n",
+                   i, pCoef->adj_offset[i], pCoef->adj_slope[i], 
+                   pPvt->chanData[i], pPvt->correctedData[i],
+                   pPvt->missedData[i]);
         }
         fprintf(fp, "    regs->control        = 0x%x\n",      pPvt->regs->control);
         fprintf(fp, "    regs->timePrescale   = 0x%x\n",      pPvt->regs->timePrescale);
@@ -1202,6 +5014,18 @@ static void report(void *drvPvt, FILE *fp, int details)
             pnode = (interruptNode *)ellNext(&pnode->node);
         }
         pasynManager->interruptEnd(pPvt->int32ArrayInterruptPvt);
+
+        /* Report float32Array interrupts */
+        pasynManager->interruptStart(pPvt->float32ArrayInterruptPvt, &pclientList);
+        pnode = (interruptNode *)ellFirst(pclientList);
+        while (pnode) {
+            asynFloat32ArrayInterrupt *pfloat32ArrayInterrupt = pnode->drvPvt;
+            fprintf(fp, "    float32Array callback client address=%p, addr=%d, reason=%d\n",
+                    pfloat32ArrayInterrupt->callback, pfloat32ArrayInterrupt->addr,
+                    pfloat32ArrayInterrupt->pasynUser->reason);
+            pnode = (interruptNode *)ellNext(&pnode->node);
+        }
+        pasynManager->interruptEnd(pPvt->float32ArrayInterruptPvt);
     }
 }
 
@@ -1243,6 +5067,25 @@ static void initCallFunc(const iocshArgBuf *args)
               args[6].ival, args[7].ival);
 }
 
+static const iocshArg initSimArg0 = { "portName",iocshArgString};
+static const iocshArg initSimArg1 = { "typeString",iocshArgString};
+static const iocshArg initSimArg2 = { "rangeString",iocshArgString};
+static const iocshArg initSimArg3 = { "firstChan",iocshArgInt};
+static const iocshArg initSimArg4 = { "lastChan",iocshArgInt};
+static const iocshArg initSimArg5 = { "signalString",iocshArgString};
+static const iocshArg * const initSimArgs[6] = {&initSimArg0,
+                                                &initSimArg1,
+                                                &initSimArg2,
+                                                &initSimArg3,
+                                                &initSimArg4,
+                                                &initSimArg5};
+static const iocshFuncDef initSimFuncDef = {"initIp330Sim",6,initSimArgs};
+static void initSimCallFunc(const iocshArgBuf *args)
+{
+    initIp330Sim(args[0].sval, args[1].sval, args[2].sval,
+                 args[3].ival, args[4].ival, args[5].sval);
+}
+
 static const iocshArg configArg0 = { "portName",iocshArgString};
 static const iocshArg configArg1 = { "scanMode",iocshArgInt};
 static const iocshArg configArg2 = { "triggerString",iocshArgString};
@@ -1256,14 +5099,64 @@ static const iocshArg * configArgs[5] = {&configArg0,
 static const iocshFuncDef configFuncDef = {"configIp330",5,configArgs};
 static void configCallFunc(const iocshArgBuf *args)
 {
-    configIp330(args[0].sval, (scanModeType)args[1].ival, args[2].sval,
+    configIp330(args[0].sval, args[1].ival, args[2].sval,
                 args[3].ival, args[4].ival);
 }
 
+static const iocshArg poolArg0 = { "nWorkers",iocshArgInt};
+static const iocshArg * poolArgs[1] = {&poolArg0};
+static const iocshFuncDef poolFuncDef = {"ip330SetDispatchPool",1,poolArgs};
+static void poolCallFunc(const iocshArgBuf *args)
+{
+    ip330SetDispatchPool(args[0].ival);
+}
+
+static const iocshArg policyArg0 = { "target",iocshArgString};
+static const iocshArg policyArg1 = { "cpuList",iocshArgString};
+static const iocshArg policyArg2 = { "priority",iocshArgInt};
+static const iocshArg policyArg3 = { "lockMemory",iocshArgInt};
+static const iocshArg * policyArgs[4] = {&policyArg0,
+                                         &policyArg1,
+                                         &policyArg2,
+                                         &policyArg3};
+static const iocshFuncDef policyFuncDef = {"ip330SetThreadPolicy",4,policyArgs};
+static void policyCallFunc(const iocshArgBuf *args)
+{
+    ip330SetThreadPolicy(args[0].sval, args[1].sval, args[2].ival,
+                         args[3].ival);
+}
+
+static const iocshArg startRecorderArg0 = { "portName",iocshArgString};
+static const iocshArg startRecorderArg1 = { "directory",iocshArgString};
+static const iocshArg startRecorderArg2 = { "segmentScans",iocshArgInt};
+static const iocshArg * startRecorderArgs[3] = {&startRecorderArg0,
+                                                &startRecorderArg1,
+                                                &startRecorderArg2};
+static const iocshFuncDef startRecorderFuncDef = {"ip330StartRecorder",3,
+                                                  startRecorderArgs};
+static void startRecorderCallFunc(const iocshArgBuf *args)
+{
+    ip330StartRecorder(args[0].sval, args[1].sval, args[2].ival);
+}
+
+static const iocshArg stopRecorderArg0 = { "portName",iocshArgString};
+static const iocshArg * stopRecorderArgs[1] = {&stopRecorderArg0};
+static const iocshFuncDef stopRecorderFuncDef = {"ip330StopRecorder",1,
+                                                 stopRecorderArgs};
+static void stopRecorderCallFunc(const iocshArgBuf *args)
+{
+    ip330StopRecorder(args[0].sval);
+}
+
 void ip330Register(void)
 {
     iocshRegister(&initFuncDef,initCallFunc);
+    iocshRegister(&initSimFuncDef,initSimCallFunc);
     iocshRegister(&configFuncDef,configCallFunc);
+    iocshRegister(&poolFuncDef,poolCallFunc);
+    iocshRegister(&policyFuncDef,policyCallFunc);
+    iocshRegister(&startRecorderFuncDef,startRecorderCallFunc);
+    iocshRegister(&stopRecorderFuncDef,stopRecorderCallFunc);
 }
 
 epicsExportRegistrar(ip330Register);
@@ -19,13 +19,88 @@ of this distribution.
 #define asynIp330H
 
 typedef enum {ip330Data, 
+              ip330Average,
+              ip330BlockSize,
+              ip330BlockData,
+              ip330BlockInterleaved,
               ip330Gain, 
               ip330ScanPeriod, 
               ip330CalibratePeriod,
-              ip330ScanMode
+              ip330CalibrateGap,
+              ip330ScanMode,
+              ip330RingDepth,
+              ip330RingHighWater,
+              ip330RingOverruns,
+              ip330LatencyQueue,
+              ip330LatencyCorrect,
+              ip330LatencyCallback,
+              ip330LatencyTotal,
+              ip330ScanJitter,
+              ip330HistogramReset,
+              ip330MissedData,
+              ip330PingPongErrors,
+              ip330CaptureDepth,
+              ip330CapturePost,
+              ip330CaptureState,
+              ip330CaptureData,
+              ip330Filtered,
+              ip330FilterBiquad,
+              ip330FilterFir,
+              ip330SpectrumSize,
+              ip330SpectrumWindow,
+              ip330SpectrumAverages,
+              ip330SpectrumMagnitude,
+              ip330SpectrumPsd,
+              ip330SpectrumFreq,
+              ip330StatWindow,
+              ip330StatMean,
+              ip330StatRms,
+              ip330StatStdDev,
+              ip330StatMin,
+              ip330StatMax,
+              ip330Egu,
+              ip330EguSlope,
+              ip330EguOffset,
+              ip330FirstChan,
+              ip330LastChan,
+              ip330Deadband,
+              ip330DeadbandEgu,
+              ip330DeadbandHeartbeat,
+              ip330DeadbandSuppressed
 } ip330Command;
 
-#define MAX_IP330_COMMANDS 5
+#define MAX_IP330_COMMANDS 49
+
+/* Number of buckets in the latency histograms */
+#define IP330_HISTOGRAM_BUCKETS 24
+
+/* Values of CAPTURE_STATE */
+typedef enum {ip330CaptureIdle, 
+              ip330CaptureArmed, 
+              ip330CaptureTriggered,
+              ip330CaptureDone
+} ip330CaptureStateType;
+
+/* Values of SPECTRUM_WINDOW */
+typedef enum {ip330WindowRectangular,
+              ip330WindowHann,
+              ip330WindowBlackmanHarris,
+              ip330WindowFlatTop
+} ip330WindowType;
+
+/* Startup functions, also registered as iocsh commands.  scanMode is
+ * 0=disable, 1=uniformContinuous, 2=uniformSingle, 3=burstContinuous,
+ * 4=burstSingle or 5=convertOnExternalTriggerOnly. */
+int initIp330(const char *portName, unsigned short carrier,
+              unsigned short slot, const char *typeString,
+              const char *rangeString, int firstChan, int lastChan,
+              int intVec);
+int initIp330Sim(const char *portName, const char *typeString,
+                 const char *rangeString, int firstChan, int lastChan,
+                 const char *signalString);
+int configIp330(const char *portName, int scanMode,
+                const char *triggerString, int microSecondsPerScan,
+                int secondsBetweenCalibrate);
 
 /* Implements the following asyn interfaces:
     Interface:          asynInt32   
@@ -34,12 +109,79 @@ typedef enum {ip330Data,
     asynDrvUser->create "DATA"
     Description:        read the current value of a channel
 
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330Average
+    asynDrvUser->create "AVERAGE"
+    Description:        read the average value of a channel since the previous
+                        read by this asynUser.  The driver keeps the running
+                        sums, so no callback is done per scan.
+
+    Interface:          asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330Average
+    asynDrvUser->create "AVERAGE"
+    Description:        same as asynInt32 read, without rounding
+
     Interface:          asynInt32   
     Method:             write 
     asynUser->drvUser:  0 or &ip330Data 
     asynDrvUser->create "DATA"
     Description:        Error, undefined
 
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330BlockSize
+    asynDrvUser->create "BLOCK_SIZE"
+    Description:        read the number of scans per block in block mode
+
+    Interface:          asynInt32
+    Method:             write
+    asynUser->drvUser:  &ip330BlockSize
+    asynDrvUser->create "BLOCK_SIZE"
+    Description:        set the number of scans per block, 0 disables block mode.
+                        Takes effect at the start of the next block.
+
+    Interface:          asynInt32ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330BlockData
+    asynDrvUser->create "BLOCK_DATA"
+    Description:        register callback with the last BLOCK_SIZE values
+                        of a channel, called once per block
+
+    Interface:          asynFloat32ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330BlockData
+    asynDrvUser->create "BLOCK_DATA"
+    Description:        register callback with the last BLOCK_SIZE values
+                        of a channel, called once per block
+
+    Interface:          asynInt32ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330BlockInterleaved
+    asynDrvUser->create "BLOCK_INTERLEAVED"
+    Description:        register callback with the last BLOCK_SIZE scans of
+                        channels firstChan to lastChan, scan-major order,
+                        called once per block
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330RingDepth
+    asynDrvUser->create "RING_DEPTH"
+    Description:        read the number of frames in the interrupt frame ring
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330RingHighWater
+    asynDrvUser->create "RING_HIGH_WATER"
+    Description:        read the maximum number of frames ever queued in the ring
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330RingOverruns
+    asynDrvUser->create "RING_OVERRUNS"
+    Description:        read the number of scans dropped because the ring was full
+
     Interface:          asynUInt32Digital 
     Method:             read   
     asynUser->drvUser:  0 or &ip330Gain
@@ -94,6 +236,329 @@ typedef enum {ip330Data,
     asynDrvUser->create "CALIBRATE_PERIOD"
     Description:        Write the calibration period
 
+    Interface:          asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330CalibrateGap
+    asynDrvUser->create "CALIBRATE_GAP"
+    Description:        Read the time in seconds that normal scanning was
+                        stopped for the last incremental calibration step
+
+    Interface:          asynInt32Array
+    Method:             read
+    asynUser->drvUser:  &ip330LatencyQueue, &ip330LatencyCorrect,
+                        &ip330LatencyCallback, &ip330LatencyTotal or
+                        &ip330ScanJitter
+    asynDrvUser->create "LATENCY_QUEUE", "LATENCY_CORRECT",
+                        "LATENCY_CALLBACK", "LATENCY_TOTAL" or "SCAN_JITTER"
+    Description:        Read a histogram of the time each scan spent in one
+                        stage of the driver.  LATENCY_QUEUE is from interrupt
+                        entry until intTask takes the scan from the ring,
+                        LATENCY_CORRECT is the calibration correction,
+                        LATENCY_CALLBACK is from the correction until the last
+                        callback returns and LATENCY_TOTAL is from interrupt
+                        entry until the last callback returns.  SCAN_JITTER is
+                        the difference between the time from one interrupt to
+                        the next and the actual scan period.
+                        Bucket 0 counts times below 1 microsecond, bucket n
+                        times from 2^(n-1) to 2^n microseconds.  There are
+                        IP330_HISTOGRAM_BUCKETS buckets, the last one also
+                        counts everything longer.
+
+    Interface:          asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330LatencyQueue ... &ip330ScanJitter
+    asynDrvUser->create "LATENCY_QUEUE" ... "SCAN_JITTER"
+    Description:        Read the longest time in seconds in the histogram
+
+    Interface:          asynInt32
+    Method:             write
+    asynUser->drvUser:  &ip330HistogramReset
+    asynDrvUser->create "HISTOGRAM_RESET"
+    Description:        Clear all of the histograms
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330MissedData
+    asynDrvUser->create "MISSED_DATA"
+    Description:        Read the number of scans in which the card
+                        overwrote the mailbox of a channel before it was
+                        read, from the missedData registers
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330PingPongErrors
+    asynDrvUser->create "PING_PONG_ERRORS"
+    Description:        Read the number of interrupts where the differential
+                        mailbox half with new data was not the one the driver
+                        expected.  The driver switches to the other half.
+
+    Interface:          asynInt32Callback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330MissedData or &ip330PingPongErrors
+    asynDrvUser->create "MISSED_DATA" or "PING_PONG_ERRORS"
+    Description:        Register callback with the new count when it changes
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330CaptureDepth
+    asynDrvUser->create "CAPTURE_DEPTH"
+    Description:        Number of scans kept in the capture history, before
+                        and after the trigger.  0 disables capture.  A new
+                        depth is applied at the next arm.
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330CapturePost
+    asynDrvUser->create "CAPTURE_POST"
+    Description:        Number of scans captured after the trigger
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330CaptureState
+    asynDrvUser->create "CAPTURE_STATE"
+    Description:        Read the capture state, ip330CaptureStateType.
+                        Write ip330CaptureArmed to start filling the history,
+                        or ip330CaptureTriggered to trigger it.  The history
+                        is frozen CAPTURE_POST scans after the trigger and
+                        corrected by a low priority thread, then the state
+                        goes to ip330CaptureDone until it is armed again.
+                        An arm written before then takes effect once the
+                        history has been corrected.
+
+    Interface:          asynInt32Callback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330CaptureState
+    asynDrvUser->create "CAPTURE_STATE"
+    Description:        Register callback with the new capture state
+
+    Interface:          asynInt32Array
+    Method:             read
+    asynUser->drvUser:  &ip330CaptureData
+    asynDrvUser->create "CAPTURE_DATA"
+    Description:        Read the captured scans of a channel, oldest first
+
+    Interface:          asynInt32ArrayCallback, asynFloat32ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330CaptureData
+    asynDrvUser->create "CAPTURE_DATA"
+    Description:        Register callback with the captured scans of a
+                        channel, called when the history is corrected.  The
+                        timestamp is the time of the trigger scan.
+
+    Interface:          asynInt32, asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330Filtered
+    asynDrvUser->create "FILTERED"
+    Description:        Read the output of the channel's filter, in counts.
+                        Same as DATA for a channel with no filter.  The
+                        asynInt32 value is rounded.
+
+    Interface:          asynInt32Callback, asynFloat64Callback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330Filtered
+    asynDrvUser->create "FILTERED"
+    Description:        Register callback with the filter output of a
+                        channel, called every scan
+
+    Interface:          asynFloat64Array
+    Method:             read, write
+    asynUser->drvUser:  &ip330FilterBiquad
+    asynDrvUser->create "FILTER_BIQUAD"
+    Description:        Biquad sections of the channel's filter, 5 values
+                        b0 b1 b2 a1 a2 per section with a0 = 1, up to
+                        IP330_FILTER_SECTIONS sections.  An empty array
+                        removes them.  The sections are applied in order,
+                        before the FIR filter.
+
+    Interface:          asynFloat64Array
+    Method:             read, write
+    asynUser->drvUser:  &ip330FilterFir
+    asynDrvUser->create "FILTER_FIR"
+    Description:        FIR filter taps of the channel, newest sample first,
+                        up to IP330_FILTER_TAPS taps.  An empty array
+                        removes the FIR filter.
+
+   When the filter of a channel is changed its state is set as if the
+   current input had been there for ever, so the output starts at the
+   filter's DC gain times the input rather than ringing up from 0.
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330SpectrumSize
+    asynDrvUser->create "SPECTRUM_SIZE"
+    Description:        Number of scans per FFT block, a power of 2 from 16
+                        to 65536.  0, the default, turns the spectra off.
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330SpectrumWindow
+    asynDrvUser->create "SPECTRUM_WINDOW"
+    Description:        Window applied to each block, ip330WindowType.
+                        Blocks overlap by half except with the rectangular
+                        window.
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330SpectrumAverages
+    asynDrvUser->create "SPECTRUM_AVERAGES"
+    Description:        Number of blocks averaged for each spectrum, default 1
+
+    Interface:          asynFloat64Array
+    Method:             read
+    asynUser->drvUser:  &ip330SpectrumMagnitude, &ip330SpectrumPsd or
+                        &ip330SpectrumFreq
+    asynDrvUser->create "SPECTRUM_MAGNITUDE", "SPECTRUM_PSD" or
+                        "SPECTRUM_FREQ"
+    Description:        Read the last spectrum of a channel, SPECTRUM_SIZE/2+1
+                        points from DC to half the scan rate.
+                        SPECTRUM_MAGNITUDE is the RMS amplitude at each
+                        frequency in counts, SPECTRUM_PSD the power spectral
+                        density in counts^2/Hz, and SPECTRUM_FREQ the
+                        frequency of each point in Hz, the same for every
+                        channel.
+
+    Interface:          asynFloat64ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330SpectrumMagnitude, &ip330SpectrumPsd or
+                        &ip330SpectrumFreq
+    asynDrvUser->create "SPECTRUM_MAGNITUDE", "SPECTRUM_PSD" or
+                        "SPECTRUM_FREQ"
+    Description:        Register callback with each new spectrum.  The
+                        timestamp is the time of the last scan in it.
+
+   The spectra are computed from the corrected data on a low priority
+   thread of the port, so they never delay the scan callbacks.  If the
+   thread falls behind, blocks are skipped rather than queued.
+
+    Interface:          asynInt32
+    Method:             read, write
+    asynUser->drvUser:  &ip330StatWindow
+    asynDrvUser->create "STAT_WINDOW"
+    Description:        Number of scans in each statistics window, 0, the
+                        default, turns the statistics off.  A new window
+                        length is applied at the start of the next window.
+
+    Interface:          asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330StatMean, &ip330StatRms, &ip330StatStdDev,
+                        &ip330StatMin or &ip330StatMax
+    asynDrvUser->create "STAT_MEAN", "STAT_RMS", "STAT_STDDEV", "STAT_MIN"
+                        or "STAT_MAX"
+    Description:        Read a statistic of the corrected data of a channel,
+                        in counts, over the last complete window.
+                        STAT_RMS is the root mean square including the mean,
+                        STAT_STDDEV the population standard deviation.
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330StatMean ... &ip330StatMax
+    asynDrvUser->create "STAT_MEAN" ... "STAT_MAX"
+    Description:        same as asynFloat64 read, rounded
+
+    Interface:          asynFloat64Callback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330StatMean ... &ip330StatMax
+    asynDrvUser->create "STAT_MEAN" ... "STAT_MAX"
+    Description:        Register callback with the statistic at the end of
+                        each window.  The timestamp is the time of the last
+                        scan in the window.
+
+    Interface:          asynFloat64
+    Method:             read
+    asynUser->drvUser:  &ip330Egu
+    asynDrvUser->create "EGU"
+    Description:        Read the current value of a channel in engineering
+                        units, EGU_OFFSET + EGU_SLOPE * DATA.  By default
+                        this is the input voltage.
+
+    Interface:          asynFloat64Callback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330Egu
+    asynDrvUser->create "EGU"
+    Description:        Register callback with the value of a channel in
+                        engineering units, called every scan
+
+    Interface:          asynFloat64Array
+    Method:             read
+    asynUser->drvUser:  &ip330Egu
+    asynDrvUser->create "EGU"
+    Description:        Read the last scan in engineering units,
+                        MAX_IP330_CHANNELS values indexed by channel
+
+    Interface:          asynFloat64ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  &ip330Egu
+    asynDrvUser->create "EGU"
+    Description:        Register callback with each scan in engineering
+                        units, MAX_IP330_CHANNELS values indexed by channel.
+                        Only the active channels are valid.
+
+    Interface:          asynFloat64
+    Method:             read, write
+    asynUser->drvUser:  &ip330EguSlope or &ip330EguOffset
+    asynDrvUser->create "EGU_SLOPE" or "EGU_OFFSET"
+    Description:        Scaling of a channel to engineering units.  The
+                        default is volts at the input, from the range and
+                        the gain of the channel, and follows changes of the
+                        gain.  Writing either one sets the channel's own
+                        scaling, which is kept when the gain changes.
+                        Writing an EGU_SLOPE of 0 goes back to volts.
+
+    Interface:          asynInt16Array, asynFloat32Array
+    Method:             read
+    asynUser->drvUser:  0 or &ip330Data
+    asynDrvUser->create "DATA"
+    Description:        Read the last scan of the active channels only,
+                        FIRST_CHAN first.  asynInt16Array values are the
+                        corrected counts minus 32768, so that they fit a
+                        signed 16 bit integer, limited to -32768 to 32767.
+                        asynFloat32Array values are the corrected counts.
+
+    Interface:          asynInt16ArrayCallback, asynFloat32ArrayCallback
+    Method:             registerCallback
+    asynUser->drvUser:  0 or &ip330Data
+    asynDrvUser->create "DATA"
+    Description:        Register callback with every scan of the active
+                        channels, in the same form as the read.  These copy
+                        2 or 4 bytes per active channel instead of the 4
+                        bytes per channel of all MAX_IP330_CHANNELS of the
+                        int32Array callback.
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330FirstChan or &ip330LastChan
+    asynDrvUser->create "FIRST_CHAN" or "LAST_CHAN"
+    Description:        Read the first and last active channel, the channels
+                        of the first and last element of the compact arrays
+
+    Interface:          asynFloat64
+    Method:             read, write
+    asynUser->drvUser:  &ip330Deadband or &ip330DeadbandEgu
+    asynDrvUser->create "DEADBAND" or "DEADBAND_EGU"
+    Description:        Deadband of a channel, in corrected counts or in
+                        engineering units.  DEADBAND_EGU is converted to
+                        counts with the EGU_SLOPE of the channel when it is
+                        written.  The int32 and float64 DATA, FILTERED and
+                        EGU callbacks of the channel are only called when
+                        the corrected value has moved by more than the
+                        deadband since the last callback.  0, the default,
+                        calls them with every scan.
+
+    Interface:          asynFloat64
+    Method:             read, write
+    asynUser->drvUser:  &ip330DeadbandHeartbeat
+    asynDrvUser->create "DEADBAND_HEARTBEAT"
+    Description:        Seconds after which the callbacks of a channel with a
+                        deadband are called even if the value has not moved.
+                        0, the default, is never.
+
+    Interface:          asynInt32
+    Method:             read
+    asynUser->drvUser:  &ip330DeadbandSuppressed
+    asynDrvUser->create "DEADBAND_SUPPRESSED"
+    Description:        Number of callbacks of a channel not called because
+                        of its deadband
+
     Interface:          asynFloat64Callback
     Method:             registerCallback
     asynUser->drvUser:  0 or &ip330Data
@@ -105,6 +570,28 @@ typedef enum {ip330Data,
     asynUser->drvUser:  &ip330ScanPeriod
     asynDrvUser->create "SCAN_PERIOD"
     Description:        Register callback with the new scan period
+
+   The int32 and float64 DATA, FILTERED and EGU callbacks can be slowed
+   down for one client with options after the command in drvInfo, separated
+   by '&', e.g. "DATA?decimate=100" or "EGU?rate=10Hz&average":
+       decimate=N      callback every N scans
+       rate=F[Hz]      callback at most F times a second, by scan time
+       average         callback with the average of the scans since the
+                       previous callback instead of the latest value
+   One of decimate and rate must be given.  The options are kept in
+   pasynUser->drvUser and apply to the callbacks of that asynUser only;
+   other clients of the same channel still get every scan.  With a DEADBAND
+   a client that is due waits until the value moves.
+
+   All data callbacks set pasynUser->timestamp to the time the scan was
+   acquired, taken when the interrupt routine is entered, or when the scan
+   is dequeued if no time can be read there.  DATA callbacks for
+   one channel get the time that channel was converted: in uniformContinuous
+   mode the channels are spaced by the conversion timer, in the other modes
+   by the 15 microsecond conversion time, ending with lastChan at the
+   interrupt.  DATA array callbacks get the time of the scan, and
+   BLOCK_DATA and BLOCK_INTERLEAVED callbacks the time of the first scan in
+   the block.
 */
 
 #endif /* ip330H */
@@ -0,0 +1,356 @@
+/* ip330Bench.c
+
+    End-to-end benchmark of the IP330 scan pipeline, without hardware.
+    Each combination of input type and channel count gets a port with the
+    simulated carrier (initIp330Sim), which is reconfigured for each point
+    of the parameter matrix and stopped afterwards, so that only one
+    simulation runs at a time.  Each point measures the path
+        intFunc -> frame ring -> intTask -> correctAll -> callbacks
+    for the given number of int32, float64 and int32Array DATA clients.
+
+    The simulation uses the "count" signal, so a probe int32Array client
+    registered after all the others can tell which scan it was called for
+    and compute the latency from the interrupt to the end of the int32 and
+    float64 fan-out.  For each combination of input type, channel count and
+    client count the scan period is decreased until the frame ring starts
+    to drop scans.
+
+    Usage: ip330Bench [secondsPerPoint]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsString.h>
+#include <cantProceed.h>
+#include <asynDriver.h>
+#include <asynInt32.h>
+#include <asynFloat64.h>
+#include <asynInt32Array.h>
+#include <asynDrvUser.h>
+
+#include "drvIp330.h"
+#include "ip330Regs.h"
+#include "ip330Sim.h"
+
+#define BURST_CONTINUOUS 3
+/* setScanPeriod needs at least 4 microseconds on top of the conversions */
+#define CONVERSION_MICROSECONDS 15
+#define MIN_DELAY_MICROSECONDS 4
+#define DEFAULT_SECONDS 1.0
+#define WARMUP_SECONDS 0.2
+#define MAX_CLIENTS 1024
+/* Latency histogram, 1 microsecond bins */
+#define HIST_BINS 100000
+
+typedef struct benchClient {
+    asynUser *pasynUser;
+    asynInterface *pasynInterface;
+    void *registrarPvt;
+} benchClient;
+
+typedef struct benchPoint {
+    ip330Sim *pSim;
+    int first;
+    volatile int running;
+    unsigned long scans;
+    unsigned long unmatched;
+    unsigned long histogram[HIST_BINS+1];
+} benchPoint;
+
+static benchClient clients[MAX_CLIENTS];
+static int nClients;
+static volatile epicsInt32 sink;
+static int portNumber;
+
+static void int32Callback(void *userPvt, asynUser *pasynUser, epicsInt32 data)
+{
+    sink += data;
+}
+
+static void float64Callback(void *userPvt, asynUser *pasynUser,
+                            epicsFloat64 data)
+{
+    sink += (epicsInt32)data;
+}
+
+static void int32ArrayCallback(void *userPvt, asynUser *pasynUser,
+                               epicsInt32 *data, size_t nelements)
+{
+    sink += data[0];
+}
+
+static void probeCallback(void *userPvt, asynUser *pasynUser,
+                          epicsInt32 *data, size_t nelements)
+{
+    benchPoint *pPoint = (benchPoint *)userPvt;
+    epicsTimeStamp now, scanTime;
+    unsigned long latest, scan;
+    int low;
+    double latency;
+
+    if (!pPoint->running) return;
+    epicsTimeGetCurrent(&now);
+    pPoint->scans++;
+    /* Recover the scan number from the count signal */
+    low = (int)((data[pPoint->first] - IP330_SIM_COUNT_BASE +
+                 IP330_SIM_COUNT_STEP/2) / IP330_SIM_COUNT_STEP);
+    latest = ip330SimScans(pPoint->pSim) - 1;
+    scan = latest - ((latest - low) & IP330_SIM_COUNT_MASK);
+    if (ip330SimScanTime(pPoint->pSim, scan, &scanTime) != 0) {
+        pPoint->unmatched++;
+        return;
+    }
+    latency = epicsTimeDiffInSeconds(&now, &scanTime) * 1.e6;
+    if (latency < 0) latency = 0;
+    if (latency > HIST_BINS) latency = HIST_BINS;
+    pPoint->histogram[(int)latency]++;
+}
+
+static asynUser *connectClient(const char *portName, int addr,
+                               const char *drvInfo, const char *interfaceType,
+                               asynInterface **ppInterface)
+{
+    asynUser *pasynUser = pasynManager->createAsynUser(0, 0);
+    asynInterface *pDrvUserInterface;
+    asynDrvUser *pasynDrvUser;
+
+    if (pasynManager->connectDevice(pasynUser, portName, addr) != asynSuccess) {
+        printf("connectDevice failed: %s\n", pasynUser->errorMessage);
+        exit(1);
+    }
+    pDrvUserInterface = pasynManager->findInterface(pasynUser, asynDrvUserType, 1);
+    *ppInterface = pasynManager->findInterface(pasynUser, interfaceType, 1);
+    if (!pDrvUserInterface || !*ppInterface) {
+        printf("Cannot find %s interface on %s\n", interfaceType, portName);
+        exit(1);
+    }
+    pasynDrvUser = (asynDrvUser *)pDrvUserInterface->pinterface;
+    pasynDrvUser->create(pDrvUserInterface->drvPvt, pasynUser, drvInfo, 0, 0);
+    return(pasynUser);
+}
+
+static void addClient(const char *portName, int addr, const char *interfaceType,
+                      void *callback, void *userPvt)
+{
+    benchClient *pClient;
+
+    if (nClients >= MAX_CLIENTS) return;
+    pClient = &clients[nClients++];
+    pClient->pasynUser = connectClient(portName, addr, "DATA", interfaceType,
+                                       &pClient->pasynInterface);
+    /* The registerInterruptUser methods have the same signature apart from
+     * the callback type */
+    if (strcmp(interfaceType, asynInt32Type) == 0) {
+        asynInt32 *pasynInt32 = pClient->pasynInterface->pinterface;
+        pasynInt32->registerInterruptUser(pClient->pasynInterface->drvPvt,
+            pClient->pasynUser, (interruptCallbackInt32)callback, userPvt,
+            &pClient->registrarPvt);
+    } else if (strcmp(interfaceType, asynFloat64Type) == 0) {
+        asynFloat64 *pasynFloat64 = pClient->pasynInterface->pinterface;
+        pasynFloat64->registerInterruptUser(pClient->pasynInterface->drvPvt,
+            pClient->pasynUser, (interruptCallbackFloat64)callback, userPvt,
+            &pClient->registrarPvt);
+    } else {
+        asynInt32Array *pasynInt32Array = pClient->pasynInterface->pinterface;
+        pasynInt32Array->registerInterruptUser(pClient->pasynInterface->drvPvt,
+            pClient->pasynUser, (interruptCallbackInt32Array)callback, userPvt,
+            &pClient->registrarPvt);
+    }
+}
+
+static void removeClients(void)
+{
+    benchClient *pClient;
+    const char *type;
+    int i;
+
+    for (i=0; i<nClients; i++) {
+        pClient = &clients[i];
+        type = pClient->pasynInterface->interfaceType;
+        if (strcmp(type, asynInt32Type) == 0) {
+            asynInt32 *pasynInt32 = pClient->pasynInterface->pinterface;
+            pasynInt32->cancelInterruptUser(pClient->pasynInterface->drvPvt,
+                pClient->pasynUser, pClient->registrarPvt);
+        } else if (strcmp(type, asynFloat64Type) == 0) {
+            asynFloat64 *pasynFloat64 = pClient->pasynInterface->pinterface;
+            pasynFloat64->cancelInterruptUser(pClient->pasynInterface->drvPvt,
+                pClient->pasynUser, pClient->registrarPvt);
+        } else {
+            asynInt32Array *pasynInt32Array = pClient->pasynInterface->pinterface;
+            pasynInt32Array->cancelInterruptUser(pClient->pasynInterface->drvPvt,
+                pClient->pasynUser, pClient->registrarPvt);
+        }
+        pasynManager->freeAsynUser(pClient->pasynUser);
+    }
+    nClients = 0;
+}
+
+static epicsInt32 readInt32(const char *portName, const char *drvInfo)
+{
+    asynInterface *pInterface;
+    asynUser *pasynUser = connectClient(portName, 0, drvInfo, asynInt32Type,
+                                        &pInterface);
+    asynInt32 *pasynInt32 = pInterface->pinterface;
+    epicsInt32 value = 0;
+
+    pasynManager->lockPort(pasynUser);
+    pasynInt32->read(pInterface->drvPvt, pasynUser, &value);
+    pasynManager->unlockPort(pasynUser);
+    pasynManager->freeAsynUser(pasynUser);
+    return(value);
+}
+
+static void writeInt32(const char *portName, const char *drvInfo,
+                       epicsInt32 value)
+{
+    asynInterface *pInterface;
+    asynUser *pasynUser = connectClient(portName, 0, drvInfo, asynInt32Type,
+                                        &pInterface);
+    asynInt32 *pasynInt32 = pInterface->pinterface;
+
+    pasynManager->lockPort(pasynUser);
+    pasynInt32->write(pInterface->drvPvt, pasynUser, value);
+    pasynManager->unlockPort(pasynUser);
+    pasynManager->freeAsynUser(pasynUser);
+}
+
+static void writeFloat64(const char *portName, const char *drvInfo,
+                         epicsFloat64 value)
+{
+    asynInterface *pInterface;
+    asynUser *pasynUser = connectClient(portName, 0, drvInfo, asynFloat64Type,
+                                        &pInterface);
+    asynFloat64 *pasynFloat64 = pInterface->pinterface;
+
+    pasynManager->lockPort(pasynUser);
+    pasynFloat64->write(pInterface->drvPvt, pasynUser, value);
+    pasynManager->unlockPort(pasynUser);
+    pasynManager->freeAsynUser(pasynUser);
+}
+
+static double percentile(benchPoint *pPoint, double fraction)
+{
+    unsigned long total = 0, sum = 0;
+    int i;
+
+    for (i=0; i<=HIST_BINS; i++) total += pPoint->histogram[i];
+    if (total == 0) return(0.);
+    for (i=0; i<=HIST_BINS; i++) {
+        sum += pPoint->histogram[i];
+        if (sum >= fraction * total) break;
+    }
+    return((double)i);
+}
+
+/* Create a port for one input type and channel count, not scanning */
+static ip330Sim *createPort(char *portName, const char *type, int nChans)
+{
+    sprintf(portName, "BENCH%d", portNumber++);
+    if (initIp330Sim(portName, type, "-10to10", 0, nChans - 1, "count") != 0 ||
+        configIp330(portName, 0, "Input",
+                    CONVERSION_MICROSECONDS * nChans + MIN_DELAY_MICROSECONDS,
+                    0) != 0) {
+        printf("Cannot create port %s\n", portName);
+        exit(1);
+    }
+    return(ip330SimFind(portName));
+}
+
+/* Run one point of the matrix on the port.  Returns the number of scans
+ * dropped by the frame ring. */
+static int runPoint(const char *portName, ip330Sim *pSim, const char *type,
+                    int nChans, int nSubs, int period, double seconds)
+{
+    static benchPoint point;
+    int lastChan = nChans - 1;
+    int overruns, chan, i;
+    epicsTimeStamp start, end;
+    double elapsed;
+
+    memset(&point, 0, sizeof(point));
+    point.pSim = pSim;
+    point.first = 0;
+    for (chan=0; chan<=lastChan; chan++) {
+        for (i=0; i<nSubs; i++) {
+            addClient(portName, chan, asynInt32Type, int32Callback, 0);
+            addClient(portName, chan, asynFloat64Type, float64Callback, 0);
+        }
+    }
+    for (i=0; i<nSubs; i++)
+        addClient(portName, 0, asynInt32ArrayType, int32ArrayCallback, 0);
+    addClient(portName, 0, asynInt32ArrayType, probeCallback, &point);
+    /* The scan period depends on the scan mode, so set the mode first */
+    writeInt32(portName, "SCAN_MODE", BURST_CONTINUOUS);
+    writeFloat64(portName, "SCAN_PERIOD", period / 1.e6);
+    /* Start converting, as a software start convert or trigger would */
+    ((ip330ADCregs *)ip330SimRegs(pSim))->startConvert = 0x0001;
+
+    epicsThreadSleep(WARMUP_SECONDS);
+    overruns = readInt32(portName, "RING_OVERRUNS");
+    epicsTimeGetCurrent(&start);
+    point.running = 1;
+    epicsThreadSleep(seconds);
+    point.running = 0;
+    epicsTimeGetCurrent(&end);
+    overruns = readInt32(portName, "RING_OVERRUNS") - overruns;
+    elapsed = epicsTimeDiffInSeconds(&end, &start);
+
+    writeInt32(portName, "SCAN_MODE", 0);
+    removeClients();
+
+    printf("%4s %6d %6d %8d %12.0f %9.0f %9.0f %9.0f %9d\n",
+           type, nChans, nSubs, period, point.scans / elapsed,
+           percentile(&point, 0.5), percentile(&point, 0.99),
+           percentile(&point, 0.999), overruns);
+    return(overruns);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *types[] = {"S", "D"};
+    static const int chans[] = {4, 16, 32};
+    static const int subs[] = {1, 8};
+    static const int periods[] = {1000, 500, 300, 200, 100, 50, 20};
+    double seconds = DEFAULT_SECONDS;
+    unsigned int t, c, s, p;
+    int dropPeriod;
+    char portName[32];
+    ip330Sim *pSim;
+
+    if (argc > 1) seconds = atof(argv[1]);
+    if (seconds <= 0) seconds = DEFAULT_SECONDS;
+
+    printf("%4s %6s %6s %8s %12s %9s %9s %9s %9s\n",
+           "type", "chans", "subs", "period", "scans/s",
+           "p50 us", "p99 us", "p99.9 us", "dropped");
+    for (t=0; t<sizeof(types)/sizeof(types[0]); t++) {
+        for (c=0; c<sizeof(chans)/sizeof(chans[0]); c++) {
+            /* Differential inputs have only 16 channels */
+            if ((types[t][0] == 'D') && (chans[c] > 16)) continue;
+            pSim = createPort(portName, types[t], chans[c]);
+            for (s=0; s<sizeof(subs)/sizeof(subs[0]); s++) {
+                dropPeriod = 0;
+                for (p=0; p<sizeof(periods)/sizeof(periods[0]); p++) {
+                    if (periods[p] < CONVERSION_MICROSECONDS * chans[c] +
+                                     MIN_DELAY_MICROSECONDS) break;
+                    /* Stop at the first period where the ring drops scans */
+                    if (runPoint(portName, pSim, types[t], chans[c], subs[s],
+                                 periods[p], seconds) > 0) {
+                        dropPeriod = periods[p];
+                        break;
+                    }
+                }
+                if (dropPeriod)
+                    printf("# drops start at %d us\n", dropPeriod);
+                else
+                    printf("# no drops down to the minimum period\n");
+            }
+            ip330SimStop(pSim);
+        }
+    }
+    return(0);
+}
@@ -0,0 +1,94 @@
+/* ip330Correct.c
+
+    Calibration correction kernel for the IP330 driver.
+
+    The SIMD versions are only used when the compiler does all double
+    arithmetic in SSE registers.  With x87 arithmetic the scalar code
+    could round differently than the vector code.
+*/
+
+#include "ip330Correct.h"
+
+#if defined(__SSE2__) && defined(__SSE2_MATH__)
+#include <emmintrin.h>
+#define IP330_CORRECT_SSE2
+#endif
+#if defined(IP330_CORRECT_SSE2) && defined(__AVX__)
+#include <immintrin.h>
+#define IP330_CORRECT_AVX
+#endif
+
+void ip330CorrectScalar(const epicsUInt16 *raw, const double *slope,
+                        const double *offset, int *rawOut, int *corrected,
+                        int n)
+{
+    int i;
+
+    for (i=0; i<n; i++) {
+        rawOut[i] = raw[i];
+        corrected[i] = (int)(slope[i] * ((double)raw[i] + offset[i]));
+    }
+}
+
+#if defined(IP330_CORRECT_AVX)
+
+const char *ip330CorrectKernelName = "AVX";
+
+void ip330Correct(const epicsUInt16 *raw, const double *slope,
+                  const double *offset, int *rawOut, int *corrected, int n)
+{
+    int i;
+    __m128i zero = _mm_setzero_si128();
+
+    for (i=0; i+4<=n; i+=4) {
+        __m128i r = _mm_unpacklo_epi16(
+                        _mm_loadl_epi64((const __m128i *)(raw + i)), zero);
+        __m256d v = _mm256_cvtepi32_pd(r);
+        v = _mm256_add_pd(v, _mm256_loadu_pd(offset + i));
+        v = _mm256_mul_pd(_mm256_loadu_pd(slope + i), v);
+        _mm_storeu_si128((__m128i *)(rawOut + i), r);
+        _mm_storeu_si128((__m128i *)(corrected + i), _mm256_cvttpd_epi32(v));
+    }
+    ip330CorrectScalar(raw + i, slope + i, offset + i, rawOut + i,
+                       corrected + i, n - i);
+}
+
+#elif defined(IP330_CORRECT_SSE2)
+
+const char *ip330CorrectKernelName = "SSE2";
+
+void ip330Correct(const epicsUInt16 *raw, const double *slope,
+                  const double *offset, int *rawOut, int *corrected, int n)
+{
+    int i;
+    __m128i zero = _mm_setzero_si128();
+
+    for (i=0; i+4<=n; i+=4) {
+        __m128i r = _mm_unpacklo_epi16(
+                        _mm_loadl_epi64((const __m128i *)(raw + i)), zero);
+        __m128d lo = _mm_cvtepi32_pd(r);
+        __m128d hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(r, 0xEE));
+        lo = _mm_add_pd(lo, _mm_loadu_pd(offset + i));
+        hi = _mm_add_pd(hi, _mm_loadu_pd(offset + i + 2));
+        lo = _mm_mul_pd(_mm_loadu_pd(slope + i), lo);
+        hi = _mm_mul_pd(_mm_loadu_pd(slope + i + 2), hi);
+        _mm_storeu_si128((__m128i *)(rawOut + i), r);
+        _mm_storeu_si128((__m128i *)(corrected + i),
+                         _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo),
+                                            _mm_cvttpd_epi32(hi)));
+    }
+    ip330CorrectScalar(raw + i, slope + i, offset + i, rawOut + i,
+                       corrected + i, n - i);
+}
+
+#else
+
+const char *ip330CorrectKernelName = "scalar";
+
+void ip330Correct(const epicsUInt16 *raw, const double *slope,
+                  const double *offset, int *rawOut, int *corrected, int n)
+{
+    ip330CorrectScalar(raw, slope, offset, rawOut, corrected, n);
+}
+
+#endif
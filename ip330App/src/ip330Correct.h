@@ -0,0 +1,39 @@
+/* ip330Correct.h
+
+    Calibration correction kernel for the IP330 driver.
+
+    The slope and offset coefficients are kept as separate arrays indexed
+    by channel, so the correction for a range of channels is a straight
+    vector loop.  Every implementation computes
+        corrected = (int)(slope * ((double)raw + offset))
+    with the same operation order and truncation, so the results are
+    bit-identical to the scalar code.
+*/
+
+#ifndef ip330CorrectH
+#define ip330CorrectH
+
+#include <epicsTypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Name of the kernel selected at compile time: "AVX", "SSE2" or "scalar" */
+extern const char *ip330CorrectKernelName;
+
+/* Correct n channels.  raw[i] is copied to rawOut[i] and the corrected value
+ * is written to corrected[i]. */
+void ip330Correct(const epicsUInt16 *raw, const double *slope,
+                  const double *offset, int *rawOut, int *corrected, int n);
+
+/* Portable reference implementation */
+void ip330CorrectScalar(const epicsUInt16 *raw, const double *slope,
+                        const double *offset, int *rawOut, int *corrected,
+                        int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ip330CorrectH */
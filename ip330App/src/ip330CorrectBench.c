@@ -0,0 +1,112 @@
+/* ip330CorrectBench.c
+
+    Microbenchmark for the IP330 calibration correction kernel.
+    Checks that the selected kernel gives the same results as the scalar
+    reference for every raw value, then times both for several channel
+    counts.
+
+    Usage: ip330CorrectBench [nScans]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <epicsTime.h>
+
+#include "ip330Correct.h"
+
+#define MAX_CHANNELS 32
+#define DEFAULT_SCANS 2000000
+
+static double slope[MAX_CHANNELS];
+static double offset[MAX_CHANNELS];
+static epicsUInt16 raw[MAX_CHANNELS];
+
+typedef void (*kernelFunc)(const epicsUInt16 *raw, const double *slope,
+                           const double *offset, int *rawOut, int *corrected,
+                           int n);
+
+static void setCoefficients(unsigned int seed)
+{
+    int i;
+
+    srand(seed);
+    for (i=0; i<MAX_CHANNELS; i++) {
+        /* Typical calibration: slope within 1%, offset within 300 counts */
+        slope[i] = 1.0 + 0.02 * ((double)rand()/RAND_MAX - 0.5);
+        offset[i] = 600.0 * ((double)rand()/RAND_MAX - 0.5);
+    }
+}
+
+static int checkKernel(void)
+{
+    int rawOut1[MAX_CHANNELS], rawOut2[MAX_CHANNELS];
+    int corr1[MAX_CHANNELS], corr2[MAX_CHANNELS];
+    int seed, value, i, n;
+    int errors = 0;
+
+    for (seed=1; seed<=8; seed++) {
+        setCoefficients(seed);
+        for (value=0; value<65536; value+=MAX_CHANNELS) {
+            for (i=0; i<MAX_CHANNELS; i++) raw[i] = value + i;
+            for (n=1; n<=MAX_CHANNELS; n++) {
+                ip330CorrectScalar(raw, slope, offset, rawOut1, corr1, n);
+                ip330Correct(raw, slope, offset, rawOut2, corr2, n);
+                for (i=0; i<n; i++) {
+                    if ((rawOut1[i] != rawOut2[i]) || (corr1[i] != corr2[i])) {
+                        if (errors++ < 10)
+                            printf("Mismatch seed=%d n=%d chan=%d raw=%d"
+                                   " scalar=%d %s=%d\n", seed, n, i, raw[i],
+                                   corr1[i], ip330CorrectKernelName, corr2[i]);
+                    }
+                }
+            }
+        }
+    }
+    return(errors);
+}
+
+static double timeKernel(kernelFunc kernel, int n, int nScans)
+{
+    int rawOut[MAX_CHANNELS], corrected[MAX_CHANNELS];
+    epicsTimeStamp start, end;
+    int scan, i;
+    volatile int sink = 0;
+
+    for (i=0; i<MAX_CHANNELS; i++) raw[i] = 1000 * i;
+    epicsTimeGetCurrent(&start);
+    for (scan=0; scan<nScans; scan++) {
+        raw[scan & (MAX_CHANNELS-1)] = scan & 0xffff;
+        kernel(raw, slope, offset, rawOut, corrected, n);
+        sink += corrected[0];
+    }
+    epicsTimeGetCurrent(&end);
+    return(epicsTimeDiffInSeconds(&end, &start) * 1.e9 / nScans);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int nChans[] = {4, 8, 16, 32};
+    int nScans = DEFAULT_SCANS;
+    int errors;
+    unsigned int i;
+    double tScalar, tKernel;
+
+    if (argc > 1) nScans = atoi(argv[1]);
+    if (nScans <= 0) nScans = DEFAULT_SCANS;
+
+    errors = checkKernel();
+    printf("Kernel %s: %d mismatches against scalar reference\n",
+           ip330CorrectKernelName, errors);
+
+    setCoefficients(1);
+    printf("%8s %14s %14s %8s\n", "channels", "scalar ns/scan",
+           "kernel ns/scan", "speedup");
+    for (i=0; i<sizeof(nChans)/sizeof(nChans[0]); i++) {
+        tScalar = timeKernel(ip330CorrectScalar, nChans[i], nScans);
+        tKernel = timeKernel(ip330Correct, nChans[i], nScans);
+        printf("%8d %14.2f %14.2f %8.2f\n", nChans[i], tScalar, tKernel,
+               tScalar / tKernel);
+    }
+    return(errors ? 1 : 0);
+}
@@ -0,0 +1,219 @@
+/* ip330Filter.c
+
+    Digital filter kernel for the IP330 driver.  See ip330Filter.h.
+
+    As for ip330Correct.c, the SIMD versions are only used when the
+    compiler does all double arithmetic in SSE registers, so that they
+    round the same as the scalar code.
+*/
+
+#include <string.h>
+
+#include "ip330Filter.h"
+
+#if defined(__SSE2__) && defined(__SSE2_MATH__)
+#include <emmintrin.h>
+#define IP330_FILTER_SSE2
+#endif
+#if defined(IP330_FILTER_SSE2) && defined(__AVX__)
+#include <immintrin.h>
+#define IP330_FILTER_AVX
+#endif
+
+#define TAP_MASK (IP330_FILTER_TAPS - 1)
+
+void ip330FilterInit(ip330FilterCoefficients *pCoef)
+{
+    int i, k;
+
+    memset(pCoef, 0, sizeof(*pCoef));
+    for (i=0; i<IP330_FILTER_CHANNELS; i++) {
+        for (k=0; k<IP330_FILTER_SECTIONS; k++)
+            pCoef->biquad[k][filterB0][i] = 1.0;
+        pCoef->fir[0][i] = 1.0;
+    }
+}
+
+void ip330FilterSet(ip330FilterCoefficients *pCoef, int channel,
+                    const double *biquad, int nSections,
+                    const double *fir, int nTaps)
+{
+    int i, k, c;
+
+    if (biquad) {
+        for (k=0; k<IP330_FILTER_SECTIONS; k++) {
+            for (c=0; c<IP330_BIQUAD_COEFS; c++) {
+                if (k < nSections)
+                    pCoef->biquad[k][c][channel] = biquad[k*IP330_BIQUAD_COEFS + c];
+                else
+                    pCoef->biquad[k][c][channel] = (c == filterB0) ? 1.0 : 0.0;
+            }
+        }
+        pCoef->sections[channel] = nSections;
+    }
+    if (fir) {
+        for (k=0; k<IP330_FILTER_TAPS; k++) {
+            if (nTaps == 0)
+                pCoef->fir[k][channel] = (k == 0) ? 1.0 : 0.0;
+            else
+                pCoef->fir[k][channel] = (k < nTaps) ? fir[k] : 0.0;
+        }
+        pCoef->taps[channel] = nTaps;
+    }
+    pCoef->serial[channel]++;
+    pCoef->nSections = 0;
+    pCoef->nTaps = 0;
+    for (i=0; i<IP330_FILTER_CHANNELS; i++) {
+        if (pCoef->sections[i] > pCoef->nSections)
+            pCoef->nSections = pCoef->sections[i];
+        if (pCoef->taps[i] > pCoef->nTaps) pCoef->nTaps = pCoef->taps[i];
+    }
+}
+
+void ip330FilterPrime(const ip330FilterCoefficients *pCoef,
+                      ip330FilterState *pState, int channel, double x)
+{
+    int i = channel;
+    int k, t;
+    double den, y;
+
+    for (k=0; k<IP330_FILTER_SECTIONS; k++) {
+        const double (*b)[IP330_FILTER_CHANNELS] = pCoef->biquad[k];
+        /* DC gain of the section, a section with a pole at 1 starts at 0 */
+        den = 1.0 + b[filterA1][i] + b[filterA2][i];
+        y = (den != 0.0) ?
+            (b[filterB0][i] + b[filterB1][i] + b[filterB2][i]) / den * x : 0.0;
+        pState->s2[k][i] = b[filterB2][i]*x - b[filterA2][i]*y;
+        pState->s1[k][i] = b[filterB1][i]*x - b[filterA1][i]*y + pState->s2[k][i];
+        x = y;
+    }
+    for (t=0; t<IP330_FILTER_TAPS; t++) pState->history[t][i] = x;
+}
+
+/* Filter channels lo to hi-1 one at a time */
+static void filterRange(const ip330FilterCoefficients *pCoef,
+                        ip330FilterState *pState, const double *x,
+                        double *out, int lo, int hi)
+{
+    int pos = pState->pos;
+    int i, k, t;
+    double v, y;
+
+    for (i=lo; i<hi; i++) {
+        v = x[i];
+        for (k=0; k<pCoef->nSections; k++) {
+            const double (*b)[IP330_FILTER_CHANNELS] = pCoef->biquad[k];
+            y = b[filterB0][i]*v + pState->s1[k][i];
+            pState->s1[k][i] = b[filterB1][i]*v - b[filterA1][i]*y +
+                               pState->s2[k][i];
+            pState->s2[k][i] = b[filterB2][i]*v - b[filterA2][i]*y;
+            v = y;
+        }
+        if (pCoef->nTaps) {
+            pState->history[pos][i] = v;
+            y = 0.0;
+            for (t=0; t<pCoef->nTaps; t++)
+                y = y + pCoef->fir[t][i] * pState->history[(pos - t) & TAP_MASK][i];
+            v = y;
+        }
+        out[i] = v;
+    }
+}
+
+#if defined(IP330_FILTER_AVX)
+
+const char *ip330FilterKernelName = "AVX";
+typedef __m256d vector;
+#define VECTOR_WIDTH 4
+#define vload  _mm256_loadu_pd
+#define vstore _mm256_storeu_pd
+#define vadd   _mm256_add_pd
+#define vsub   _mm256_sub_pd
+#define vmul   _mm256_mul_pd
+#define vzero  _mm256_setzero_pd
+
+#elif defined(IP330_FILTER_SSE2)
+
+const char *ip330FilterKernelName = "SSE2";
+typedef __m128d vector;
+#define VECTOR_WIDTH 2
+#define vload  _mm_loadu_pd
+#define vstore _mm_storeu_pd
+#define vadd   _mm_add_pd
+#define vsub   _mm_sub_pd
+#define vmul   _mm_mul_pd
+#define vzero  _mm_setzero_pd
+
+#else
+
+const char *ip330FilterKernelName = "scalar";
+
+#endif
+
+#ifdef VECTOR_WIDTH
+/* Filter VECTOR_WIDTH channels at a time from lo, the same as filterRange.
+ * Returns the first channel not done. */
+static int filterVector(const ip330FilterCoefficients *pCoef,
+                        ip330FilterState *pState, const double *x,
+                        double *out, int lo, int hi)
+{
+    int pos = pState->pos;
+    int i, k, t;
+    vector v, y;
+
+    for (i=lo; i+VECTOR_WIDTH<=hi; i+=VECTOR_WIDTH) {
+        v = vload(x + i);
+        for (k=0; k<pCoef->nSections; k++) {
+            const double (*b)[IP330_FILTER_CHANNELS] = pCoef->biquad[k];
+            y = vadd(vmul(vload(&b[filterB0][i]), v), vload(&pState->s1[k][i]));
+            vstore(&pState->s1[k][i],
+                   vadd(vsub(vmul(vload(&b[filterB1][i]), v),
+                             vmul(vload(&b[filterA1][i]), y)),
+                        vload(&pState->s2[k][i])));
+            vstore(&pState->s2[k][i],
+                   vsub(vmul(vload(&b[filterB2][i]), v),
+                        vmul(vload(&b[filterA2][i]), y)));
+            v = y;
+        }
+        if (pCoef->nTaps) {
+            vstore(&pState->history[pos][i], v);
+            y = vzero();
+            for (t=0; t<pCoef->nTaps; t++)
+                y = vadd(y, vmul(vload(&pCoef->fir[t][i]),
+                                 vload(&pState->history[(pos - t) & TAP_MASK][i])));
+            v = y;
+        }
+        vstore(out + i, v);
+    }
+    return(i);
+}
+#endif
+
+void ip330FilterScalar(const ip330FilterCoefficients *pCoef,
+                       ip330FilterState *pState, const int *in, double *out,
+                       int first, int n)
+{
+    double x[IP330_FILTER_CHANNELS];
+    int i;
+
+    for (i=first; i<first+n; i++) x[i] = in[i];
+    pState->pos = (pState->pos + 1) & TAP_MASK;
+    filterRange(pCoef, pState, x, out, first, first+n);
+}
+
+void ip330Filter(const ip330FilterCoefficients *pCoef,
+                 ip330FilterState *pState, const int *in, double *out,
+                 int first, int n)
+{
+#ifdef VECTOR_WIDTH
+    double x[IP330_FILTER_CHANNELS];
+    int i;
+
+    for (i=first; i<first+n; i++) x[i] = in[i];
+    pState->pos = (pState->pos + 1) & TAP_MASK;
+    i = filterVector(pCoef, pState, x, out, first, first+n);
+    filterRange(pCoef, pState, x, out, i, first+n);
+#else
+    ip330FilterScalar(pCoef, pState, in, out, first, n);
+#endif
+}
@@ -0,0 +1,90 @@
+/* ip330Filter.h
+
+    Digital filter kernel for the IP330 driver.
+
+    Each channel has a cascade of up to IP330_FILTER_SECTIONS biquad
+    sections followed by an FIR filter of up to IP330_FILTER_TAPS taps.
+    The coefficients and the filter state are kept as arrays indexed by
+    channel, so every step of the filter is a vector loop across the
+    active channels.  Channels with fewer sections or taps than the longest
+    filter are padded with pass-through sections and taps.
+
+    Each biquad section is evaluated in transposed direct form II:
+        y  = b0*x + s1
+        s1 = b1*x - a1*y + s2
+        s2 = b2*x - a2*y
+    and the FIR filter as y = sum over t of fir[t] * x[n-t].  Every
+    implementation uses the same operation order, so the results do not
+    depend on the kernel.
+*/
+
+#ifndef ip330FilterH
+#define ip330FilterH
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IP330_FILTER_CHANNELS 32
+#define IP330_FILTER_SECTIONS 4
+/* Must be a power of 2 */
+#define IP330_FILTER_TAPS 64
+
+/* Index of each coefficient in a biquad section */
+typedef enum {filterB0, filterB1, filterB2, filterA1, filterA2} ip330BiquadCoef;
+#define IP330_BIQUAD_COEFS 5
+
+typedef struct ip330FilterCoefficients {
+    /* Longest filter of any channel */
+    int nSections;
+    int nTaps;
+    /* Filter of each channel, serial is incremented when it changes */
+    int sections[IP330_FILTER_CHANNELS];
+    int taps[IP330_FILTER_CHANNELS];
+    unsigned int serial[IP330_FILTER_CHANNELS];
+    double biquad[IP330_FILTER_SECTIONS][IP330_BIQUAD_COEFS][IP330_FILTER_CHANNELS];
+    double fir[IP330_FILTER_TAPS][IP330_FILTER_CHANNELS];
+} ip330FilterCoefficients;
+
+typedef struct ip330FilterState {
+    double s1[IP330_FILTER_SECTIONS][IP330_FILTER_CHANNELS];
+    double s2[IP330_FILTER_SECTIONS][IP330_FILTER_CHANNELS];
+    double history[IP330_FILTER_TAPS][IP330_FILTER_CHANNELS];
+    int pos;
+} ip330FilterState;
+
+/* Name of the kernel selected at compile time: "AVX", "SSE2" or "scalar" */
+extern const char *ip330FilterKernelName;
+
+/* Set every channel to pass-through */
+void ip330FilterInit(ip330FilterCoefficients *pCoef);
+
+/* Set the filter of one channel.  biquad has nSections*IP330_BIQUAD_COEFS
+ * values, b0 b1 b2 a1 a2 for each section, with a0 = 1.  Either pointer
+ * may be NULL to leave that part of the filter alone; nSections or nTaps
+ * 0 makes it pass-through. */
+void ip330FilterSet(ip330FilterCoefficients *pCoef, int channel,
+                    const double *biquad, int nSections,
+                    const double *fir, int nTaps);
+
+/* Set the state of one channel as if its input had been x for ever, so
+ * that a new filter starts without a transient */
+void ip330FilterPrime(const ip330FilterCoefficients *pCoef,
+                      ip330FilterState *pState, int channel, double x);
+
+/* Filter one scan of channels first to first+n-1.  in and out are indexed
+ * by channel. */
+void ip330Filter(const ip330FilterCoefficients *pCoef,
+                 ip330FilterState *pState, const int *in, double *out,
+                 int first, int n);
+
+/* Portable reference implementation */
+void ip330FilterScalar(const ip330FilterCoefficients *pCoef,
+                       ip330FilterState *pState, const int *in, double *out,
+                       int first, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ip330FilterH */
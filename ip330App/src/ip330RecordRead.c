@@ -0,0 +1,190 @@
+/* ip330RecordRead.c
+
+    Converts segment files written by the IP330 raw scan recorder to text.
+    Each scan is printed as one line with its time, sequence number and
+    the input voltage of each recorded channel, computed with the
+    calibration stored in the segment.  See ip330Recorder.h.
+
+    Usage: ip330RecordRead [-r] [-s] file ...
+        -r  print the corrected values in counts instead of volts
+        -s  only print a summary of each segment
+
+    Lines starting with # are comments: the segment header, and a note
+    where scans are missing, either dropped by the recorder (a gap in the
+    sequence numbers) or lost before they reached it.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTime.h>
+
+#include "ip330Correct.h"
+#include "ip330Recorder.h"
+
+static const ip330RecordCalibration *findCalibration(
+    const ip330RecordHeader *pHeader, epicsUInt32 generation)
+{
+    epicsUInt32 i;
+
+    for (i=0; i<pHeader->nCalibrations; i++) {
+        if (pHeader->calibration[i].generation == generation)
+            return(&pHeader->calibration[i]);
+    }
+    return(NULL);
+}
+
+/* Where the previous segment left off, so that a recording split over
+ * several segments is checked for gaps across them */
+typedef struct readState {
+    char port[64];
+    epicsUInt32 segment;
+    epicsUInt32 nextSequence;
+    int haveSequence;
+} readState;
+
+static int readSegment(const char *path, int counts, int summary,
+                       readState *pState)
+{
+    ip330RecordHeader *pHeader;
+    const ip330RecordCalibration *pCal = NULL;
+    ip330RecordScan *pScan;
+    epicsUInt32 i, nScans, generation = 0;
+    epicsUInt16 raw[IP330_RECORD_CHANNELS];
+    int rawOut[IP330_RECORD_CHANNELS], corrected[IP330_RECORD_CHANNELS];
+    int first, nChans, j, status = 0;
+    unsigned long missing = 0, breaks = 0, uncalibrated = 0;
+    epicsTimeStamp time;
+    char timeString[40];
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return(-1);
+    }
+    pHeader = malloc(sizeof(*pHeader));
+    pScan = malloc(IP330_RECORD_SIZE(IP330_RECORD_CHANNELS));
+    if (!pHeader || !pScan) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        status = -1;
+        goto done;
+    }
+    if ((fread(pHeader, sizeof(*pHeader), 1, fp) != 1) ||
+        (memcmp(pHeader->magic, IP330_RECORD_MAGIC, sizeof(pHeader->magic)) != 0)) {
+        fprintf(stderr, "%s: not an IP330 recorder segment\n", path);
+        status = -1;
+        goto done;
+    }
+    if ((pHeader->version != IP330_RECORD_VERSION) ||
+        (pHeader->headerSize != sizeof(*pHeader)) ||
+        (pHeader->nChans < 1) || (pHeader->firstChan < 0) ||
+        (pHeader->firstChan + pHeader->nChans > IP330_RECORD_CHANNELS) ||
+        (pHeader->recordSize != IP330_RECORD_SIZE(pHeader->nChans)) ||
+        (pHeader->nCalibrations > IP330_RECORD_MAX_CALIBRATIONS)) {
+        fprintf(stderr, "%s: unsupported segment version %u\n", path,
+                pHeader->version);
+        status = -1;
+        goto done;
+    }
+    first = pHeader->firstChan;
+    nChans = pHeader->nChans;
+    nScans = pHeader->nScans;
+    printf("# %s: port %s, segment %u, channels %d to %d, range %g to %g V,"
+           " scan period %g s, %u scans, %u calibrations\n",
+           path, pHeader->port, pHeader->segment, first, first + nChans - 1,
+           pHeader->zero, pHeader->zero + pHeader->span, pHeader->scanPeriod,
+           nScans, pHeader->nCalibrations);
+    if ((pHeader->segment != pState->segment + 1) ||
+        (strncmp(pHeader->port, pState->port, sizeof(pState->port)) != 0))
+        pState->haveSequence = 0;
+    strncpy(pState->port, pHeader->port, sizeof(pState->port));
+    pState->segment = pHeader->segment;
+
+    for (i=0; i<nScans; i++) {
+        if (fread(pScan, pHeader->recordSize, 1, fp) != 1) {
+            fprintf(stderr, "%s: file ends after %u of %u scans\n", path, i,
+                    nScans);
+            status = -1;
+            break;
+        }
+        if (pState->haveSequence && (pScan->sequence != pState->nextSequence)) {
+            missing += pScan->sequence - pState->nextSequence;
+            if (!summary)
+                printf("# %u scans dropped by the recorder\n",
+                       pScan->sequence - pState->nextSequence);
+        }
+        if (pState->haveSequence && (pScan->flags & IP330_RECORD_BREAK)) {
+            breaks++;
+            if (!summary) printf("# scans lost before this one\n");
+        }
+        pState->nextSequence = pScan->sequence + 1;
+        pState->haveSequence = 1;
+        if (!pCal || (pScan->generation != generation)) {
+            generation = pScan->generation;
+            pCal = findCalibration(pHeader, generation);
+        }
+        if (!pCal) uncalibrated++;
+        if (summary) continue;
+
+        time.secPastEpoch = pScan->secPastEpoch;
+        time.nsec = pScan->nsec;
+        epicsTimeToStrftime(timeString, sizeof(timeString),
+                            "%Y/%m/%d %H:%M:%S.%09f", &time);
+        printf("%s %u", timeString, pScan->sequence);
+        memcpy(raw, pScan + 1, 2 * nChans);
+        if (!pCal) {
+            /* Calibration not recorded, print the raw values */
+            for (j=0; j<nChans; j++) printf(" %u", raw[j]);
+            printf(" # uncalibrated\n");
+            continue;
+        }
+        ip330CorrectScalar(raw, &pCal->slope[first], &pCal->offset[first],
+                           rawOut, corrected, nChans);
+        for (j=0; j<nChans; j++) {
+            if (counts)
+                printf(" %d", corrected[j]);
+            else
+                printf(" %.6f", (pHeader->zero +
+                                 corrected[j] * pHeader->span / 65536.) /
+                                pCal->gain[first + j]);
+        }
+        printf("\n");
+    }
+    printf("# %s: %lu scans dropped by the recorder, %lu breaks,"
+           " %lu scans without calibration\n", path, missing, breaks,
+           uncalibrated);
+
+done:
+    free(pScan);
+    free(pHeader);
+    fclose(fp);
+    return(status);
+}
+
+int main(int argc, char *argv[])
+{
+    int counts = 0, summary = 0, status = 0;
+    readState state;
+    int i;
+
+    for (i=1; (i<argc) && (argv[i][0] == '-'); i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            counts = 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            summary = 1;
+        } else {
+            break;
+        }
+    }
+    if (i == argc) {
+        fprintf(stderr, "Usage: ip330RecordRead [-r] [-s] file ...\n");
+        return(2);
+    }
+    memset(&state, 0, sizeof(state));
+    for (; i<argc; i++) {
+        if (readSegment(argv[i], counts, summary, &state)) status = 1;
+    }
+    return(status);
+}
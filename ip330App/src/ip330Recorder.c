@@ -0,0 +1,433 @@
+/* ip330Recorder.c
+
+    Raw scan recorder for the IP330 driver.  See ip330Recorder.h.
+
+    The scan ring and the calibration ring each have one producer, the
+    scan path, and one consumer, the writer thread.  The writer polls the
+    rings every RECORDER_POLL_SECONDS, so the scan path never has to wake
+    it.  The writer always has the next segment created and mapped, so
+    switching segments only costs the unmap of the full one.  Segments
+    are only supported where there are memory mapped files, which is
+    Linux for now.
+*/
+
+#if defined(linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef linux
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <epicsAtomic.h>
+#include <errlog.h>
+#include <cantProceed.h>
+#include <epicsString.h>
+
+#include "ip330Recorder.h"
+
+/* Number of scans in the ring, must be a power of 2.  At 20 kHz this
+ * rides out a 3 second stall of the disk. */
+#define RECORDER_RING_SCANS 65536
+/* Number of calibrations in the ring, must be a power of 2 */
+#define RECORDER_CAL_RING 16
+/* Number of calibrations the writer remembers for new segments */
+#define RECORDER_CAL_HISTORY 16
+#define RECORDER_POLL_SECONDS 0.01
+/* The writer hands ring slots back every this many records */
+#define RECORDER_BATCH 256
+
+typedef struct ip330Segment {
+    int fd;
+    char *path;
+    size_t size;
+    ip330RecordHeader *pHeader;
+    char *records;
+} ip330Segment;
+
+struct ip330Recorder {
+    char *name;
+    char *directory;
+    char startTime[32];
+    int firstChan;
+    int nChans;
+    size_t recordSize;
+    double zero;
+    double span;
+    double scanPeriod;
+    epicsUInt32 segmentScans;
+    /* Written only by the scan path */
+    char *ring;
+    volatile unsigned int ringHead;
+    epicsUInt32 sequence;
+    unsigned long dropped;
+    ip330RecordCalibration calRing[RECORDER_CAL_RING];
+    volatile unsigned int calHead;
+    unsigned long calDropped;
+    volatile int closing;
+    /* Written only by the writer thread */
+    volatile unsigned int ringTail;
+    volatile unsigned int calTail;
+    ip330RecordCalibration history[RECORDER_CAL_HISTORY];
+    int nHistory;
+    ip330Segment current;
+    ip330Segment next;
+    epicsUInt32 lastGeneration;
+    epicsUInt32 segments;
+    unsigned long recorded;
+    unsigned long unknownGeneration;
+    unsigned long lostWriting;
+    int writeError;
+    volatile int done;
+};
+
+#ifdef linux
+
+static int openSegment(ip330Recorder *pRec, ip330Segment *pSeg)
+{
+    ip330RecordHeader *pHeader;
+    char path[256];
+    void *base;
+    int status;
+
+    epicsSnprintf(path, sizeof(path), "%s/%s_%s_%06u.ip330", pRec->directory,
+                  pRec->name, pRec->startTime, pRec->segments);
+    pSeg->size = sizeof(ip330RecordHeader) +
+                 (size_t)pRec->segmentScans * pRec->recordSize;
+    pSeg->fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (pSeg->fd < 0) {
+        status = errno;
+        goto error;
+    }
+    /* Allocate the blocks now, so that a full disk is found here and not
+     * with a SIGBUS while the segment fills */
+    status = posix_fallocate(pSeg->fd, 0, pSeg->size);
+    if ((status == EOPNOTSUPP) || (status == EINVAL))
+        status = ftruncate(pSeg->fd, pSeg->size) ? errno : 0;
+    if (status) goto error;
+#ifdef MAP_POPULATE
+    base = mmap(NULL, pSeg->size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, pSeg->fd, 0);
+#else
+    base = mmap(NULL, pSeg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                pSeg->fd, 0);
+#endif
+    if (base == MAP_FAILED) {
+        status = errno;
+        goto error;
+    }
+    madvise(base, pSeg->size, MADV_SEQUENTIAL);
+    pHeader = base;
+    memcpy(pHeader->magic, IP330_RECORD_MAGIC, sizeof(pHeader->magic));
+    pHeader->version = IP330_RECORD_VERSION;
+    pHeader->headerSize = sizeof(ip330RecordHeader);
+    pHeader->recordSize = pRec->recordSize;
+    pHeader->firstChan = pRec->firstChan;
+    pHeader->nChans = pRec->nChans;
+    pHeader->segment = pRec->segments++;
+    pHeader->maxScans = pRec->segmentScans;
+    pHeader->zero = pRec->zero;
+    pHeader->span = pRec->span;
+    pHeader->scanPeriod = pRec->scanPeriod;
+    strncpy(pHeader->port, pRec->name, sizeof(pHeader->port)-1);
+    pSeg->pHeader = pHeader;
+    pSeg->records = (char *)base + sizeof(ip330RecordHeader);
+    pSeg->path = epicsStrDup(path);
+    return(0);
+
+error:
+    if (!pRec->writeError)
+        errlogPrintf("ip330Recorder %s: cannot create %s: %s\n",
+                     pRec->name, path, strerror(status));
+    pRec->writeError = status;
+    if (pSeg->fd >= 0) {
+        close(pSeg->fd);
+        unlink(path);
+    }
+    pSeg->pHeader = NULL;
+    return(-1);
+}
+
+/* Unmap and close a segment.  An unfinished segment is cut back to the
+ * records written, an empty one is removed. */
+static void closeSegment(ip330Recorder *pRec, ip330Segment *pSeg)
+{
+    epicsUInt32 nScans;
+
+    if (!pSeg->pHeader) return;
+    nScans = pSeg->pHeader->nScans;
+    msync(pSeg->pHeader, pSeg->size, MS_ASYNC);
+    munmap(pSeg->pHeader, pSeg->size);
+    if (nScans == 0) {
+        unlink(pSeg->path);
+    } else if (nScans < pRec->segmentScans) {
+        if (ftruncate(pSeg->fd, sizeof(ip330RecordHeader) +
+                                (size_t)nScans * pRec->recordSize))
+            errlogPrintf("ip330Recorder %s: cannot truncate %s: %s\n",
+                         pRec->name, pSeg->path, strerror(errno));
+    }
+    close(pSeg->fd);
+    free(pSeg->path);
+    pSeg->pHeader = NULL;
+}
+
+/* Make the prepared segment current.  The next one is prepared by
+ * recorderTask.  After an error it only tries again once per poll, and
+ * the scans in between are lost. */
+static int nextSegment(ip330Recorder *pRec)
+{
+    closeSegment(pRec, &pRec->current);
+    if (!pRec->next.pHeader &&
+        (pRec->writeError || openSegment(pRec, &pRec->next))) return(-1);
+    pRec->current = pRec->next;
+    pRec->next.pHeader = NULL;
+    return(0);
+}
+
+/* Copy a calibration into the current segment header if it is not
+ * already there.  Starts a new segment if the header is full. */
+static int addCalibration(ip330Recorder *pRec, epicsUInt32 generation)
+{
+    ip330RecordHeader *pHeader = pRec->current.pHeader;
+    const ip330RecordCalibration *pCal = NULL;
+    int i;
+
+    for (i=pHeader->nCalibrations-1; i>=0; i--) {
+        if (pHeader->calibration[i].generation == generation) return(0);
+    }
+    for (i=0; (i<RECORDER_CAL_HISTORY) && (i<pRec->nHistory); i++) {
+        pCal = &pRec->history[(pRec->nHistory-1-i) % RECORDER_CAL_HISTORY];
+        if (pCal->generation == generation) break;
+        pCal = NULL;
+    }
+    if (!pCal) {
+        pRec->unknownGeneration++;
+        return(0);
+    }
+    if (pHeader->nCalibrations == IP330_RECORD_MAX_CALIBRATIONS) {
+        if (nextSegment(pRec)) return(-1);
+        pHeader = pRec->current.pHeader;
+    }
+    pHeader->calibration[pHeader->nCalibrations] = *pCal;
+    pHeader->nCalibrations++;
+    return(0);
+}
+
+static void writeRecord(ip330Recorder *pRec, const char *pRecord)
+{
+    const ip330RecordScan *pScan = (const ip330RecordScan *)pRecord;
+    ip330RecordHeader *pHeader;
+
+    if (!pRec->current.pHeader ||
+        (pRec->current.pHeader->nScans == pRec->segmentScans)) {
+        if (nextSegment(pRec)) {
+            pRec->lostWriting++;
+            return;
+        }
+    }
+    if ((pRec->current.pHeader->nScans == 0) ||
+        (pScan->generation != pRec->lastGeneration)) {
+        if (addCalibration(pRec, pScan->generation)) {
+            pRec->lostWriting++;
+            return;
+        }
+        pRec->lastGeneration = pScan->generation;
+    }
+    pHeader = pRec->current.pHeader;
+    memcpy(pRec->current.records + (size_t)pHeader->nScans * pRec->recordSize,
+           pRecord, pRec->recordSize);
+    pHeader->nScans++;
+    pRec->recorded++;
+}
+
+static void recorderTask(ip330Recorder *pRec)
+{
+    unsigned int head, tail, calHead;
+    unsigned int ringMask = RECORDER_RING_SCANS - 1;
+    const char *pRecord;
+    int closing, n;
+
+    while (1) {
+        closing = pRec->closing;
+        epicsAtomicReadMemoryBarrier();
+        head = pRec->ringHead;
+        /* Calibrations are put before the scans that use them, so every
+         * scan up to head has its calibration in the ring by now */
+        calHead = pRec->calHead;
+        epicsAtomicReadMemoryBarrier();
+        while (pRec->calTail != calHead) {
+            pRec->history[pRec->nHistory % RECORDER_CAL_HISTORY] =
+                pRec->calRing[pRec->calTail & (RECORDER_CAL_RING - 1)];
+            pRec->nHistory++;
+            epicsAtomicWriteMemoryBarrier();
+            pRec->calTail++;
+        }
+        tail = pRec->ringTail;
+        for (n=1; tail != head; n++) {
+            pRecord = pRec->ring + (size_t)(tail & ringMask) * pRec->recordSize;
+            writeRecord(pRec, pRecord);
+            tail++;
+            if ((n % RECORDER_BATCH) == 0) {
+                epicsAtomicWriteMemoryBarrier();
+                pRec->ringTail = tail;
+            }
+        }
+        epicsAtomicWriteMemoryBarrier();
+        pRec->ringTail = tail;
+        if (closing) break;
+        if (!pRec->next.pHeader && (openSegment(pRec, &pRec->next) == 0))
+            pRec->writeError = 0;
+        epicsThreadSleep(RECORDER_POLL_SECONDS);
+    }
+    closeSegment(pRec, &pRec->current);
+    closeSegment(pRec, &pRec->next);
+    free(pRec->ring);
+    pRec->ring = NULL;
+    pRec->done = 1;
+}
+
+#endif /* linux */
+
+ip330Recorder *ip330RecorderCreate(const char *name, const char *directory,
+                                   int firstChan, int nChans,
+                                   double zero, double span,
+                                   double scanPeriod, int segmentScans)
+{
+#ifdef linux
+    ip330Recorder *pRec;
+    epicsTimeStamp now;
+
+    if ((nChans < 1) || (firstChan < 0) ||
+        (firstChan + nChans > IP330_RECORD_CHANNELS)) {
+        errlogPrintf("ip330RecorderCreate: bad channels %d to %d\n",
+                     firstChan, firstChan + nChans - 1);
+        return(NULL);
+    }
+    if (segmentScans < 1) {
+        errlogPrintf("ip330RecorderCreate: segmentScans must be > 0\n");
+        return(NULL);
+    }
+    pRec = callocMustSucceed(1, sizeof(*pRec), "ip330RecorderCreate");
+    pRec->name = epicsStrDup(name);
+    pRec->directory = epicsStrDup(directory);
+    epicsTimeGetCurrent(&now);
+    epicsTimeToStrftime(pRec->startTime, sizeof(pRec->startTime),
+                        "%Y%m%dT%H%M%S", &now);
+    pRec->firstChan = firstChan;
+    pRec->nChans = nChans;
+    pRec->recordSize = IP330_RECORD_SIZE(nChans);
+    pRec->zero = zero;
+    pRec->span = span;
+    pRec->scanPeriod = scanPeriod;
+    pRec->segmentScans = segmentScans;
+    pRec->ring = callocMustSucceed(RECORDER_RING_SCANS, pRec->recordSize,
+                                   "ip330RecorderCreate");
+    /* Create the first segment here so that a bad directory is reported
+     * to the caller */
+    if (openSegment(pRec, &pRec->next)) {
+        free(pRec->ring);
+        free(pRec->directory);
+        free(pRec->name);
+        free(pRec);
+        return(NULL);
+    }
+    if (epicsThreadCreate("ip330Recorder",
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)recorderTask,
+                          pRec) == NULL) {
+        errlogPrintf("ip330RecorderCreate epicsThreadCreate failure\n");
+        closeSegment(pRec, &pRec->next);
+        free(pRec->ring);
+        free(pRec->directory);
+        free(pRec->name);
+        free(pRec);
+        return(NULL);
+    }
+    return(pRec);
+#else
+    errlogPrintf("ip330RecorderCreate: only supported on Linux\n");
+    return(NULL);
+#endif
+}
+
+int ip330RecorderCalibration(ip330Recorder *pRec,
+                             const ip330RecordCalibration *pCal)
+{
+    unsigned int head = pRec->calHead;
+
+    if (head - pRec->calTail >= RECORDER_CAL_RING) {
+        pRec->calDropped++;
+        return(-1);
+    }
+    pRec->calRing[head & (RECORDER_CAL_RING - 1)] = *pCal;
+    epicsAtomicWriteMemoryBarrier();
+    pRec->calHead = head + 1;
+    return(0);
+}
+
+int ip330RecorderPut(ip330Recorder *pRec, const epicsUInt16 *data,
+                     const epicsTimeStamp *pTime, epicsUInt32 generation,
+                     epicsUInt32 flags)
+{
+    unsigned int head = pRec->ringHead;
+    epicsUInt32 sequence = pRec->sequence++;
+    ip330RecordScan *pScan;
+
+    if (head - pRec->ringTail >= RECORDER_RING_SCANS) {
+        pRec->dropped++;
+        return(-1);
+    }
+    /* The slot must not be written before the writer has moved past it */
+    epicsAtomicReadMemoryBarrier();
+    pScan = (ip330RecordScan *)(pRec->ring +
+                (size_t)(head & (RECORDER_RING_SCANS - 1)) * pRec->recordSize);
+    pScan->secPastEpoch = pTime->secPastEpoch;
+    pScan->nsec = pTime->nsec;
+    pScan->generation = generation;
+    pScan->sequence = sequence;
+    pScan->flags = flags;
+    memcpy(pScan + 1, data, 2 * pRec->nChans);
+    epicsAtomicWriteMemoryBarrier();
+    pRec->ringHead = head + 1;
+    return(0);
+}
+
+void ip330RecorderClose(ip330Recorder *pRec)
+{
+    epicsAtomicWriteMemoryBarrier();
+    pRec->closing = 1;
+}
+
+void ip330RecorderDestroy(ip330Recorder *pRec)
+{
+    if (!pRec) return;
+    if (!pRec->closing) ip330RecorderClose(pRec);
+    while (!pRec->done) epicsThreadSleep(RECORDER_POLL_SECONDS);
+    /* The writer thread has freed the ring and closed the segments */
+    free(pRec->directory);
+    free(pRec->name);
+    free(pRec);
+}
+
+void ip330RecorderReport(ip330Recorder *pRec, FILE *fp)
+{
+    fprintf(fp, "    recorder %s/%s_%s, %s, segments=%u, scans recorded=%lu,"
+                " dropped=%lu\n",
+            pRec->directory, pRec->name, pRec->startTime,
+            pRec->done ? "closed" : pRec->closing ? "closing" : "recording",
+            pRec->segments, pRec->recorded, pRec->dropped);
+    fprintf(fp, "    recorder ring=%u of %d, lost writing=%lu, calibrations"
+                " dropped=%lu, unknown generation=%lu%s%s\n",
+            pRec->ringHead - pRec->ringTail, RECORDER_RING_SCANS,
+            pRec->lostWriting, pRec->calDropped, pRec->unknownGeneration,
+            pRec->writeError ? ", error: " : "",
+            pRec->writeError ? strerror(pRec->writeError) : "");
+}
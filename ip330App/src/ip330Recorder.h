@@ -0,0 +1,133 @@
+/* ip330Recorder.h
+
+    Raw scan recorder for the IP330 driver.
+
+    The recorder streams every scan of a port to disk as the raw 16-bit
+    mailbox values, with the scan time and the calibration generation that
+    was used to correct it.  The scan path only copies each scan into a
+    ring in memory, it never waits for the disk.  A writer thread empties
+    the ring into segment files.  Each segment is created at its full size
+    and memory mapped before it is needed, so the writer only copies
+    memory while a segment fills.  If the ring fills up the scan is
+    dropped and counted, and the gap shows up in the sequence numbers.
+
+    A segment file is an ip330RecordHeader followed by up to maxScans
+    records of recordSize bytes.  Each record is an ip330RecordScan
+    followed by nChans raw values for firstChan ... firstChan+nChans-1.
+    nScans in the header is updated as records are written, so a segment
+    that was not closed can still be read.  A segment that is closed
+    before it is full is truncated to the records written.  The header
+    holds every calibration used by the scans in the segment, so the
+    segment can be converted to volts on its own, see ip330RecordRead.
+    All values are in the byte order of the IOC.
+
+    The corrected value of a raw value is computed as in the driver:
+        corrected = (int)(slope * ((double)raw + offset))
+    and the input voltage is
+        volts = (zero + corrected * span / 65536) / gain
+    where zero and span are the ADC range and gain is the programmable
+    gain of the channel.
+*/
+
+#ifndef ip330RecorderH
+#define ip330RecorderH
+
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IP330_RECORD_MAGIC "IP330REC"
+#define IP330_RECORD_VERSION 1
+#define IP330_RECORD_CHANNELS 32
+#define IP330_RECORD_MAX_CALIBRATIONS 256
+
+/* Generation of scans recorded when calibration is turned off
+ * (secondsBetweenCalibrate < 0).  Its calibration has slope 1, offset 0. */
+#define IP330_RECORD_UNCALIBRATED 0xffffffffu
+
+/* Set in flags if scans were lost before this one, by the driver or by a
+ * calibration burst.  Scans dropped by the recorder itself show up as a
+ * gap in sequence instead. */
+#define IP330_RECORD_BREAK 0x1
+
+/* Coefficients of one calibration generation, indexed by channel */
+typedef struct ip330RecordCalibration {
+    epicsUInt32 generation;
+    epicsUInt32 spare;
+    double slope[IP330_RECORD_CHANNELS];
+    double offset[IP330_RECORD_CHANNELS];
+    double gain[IP330_RECORD_CHANNELS];
+} ip330RecordCalibration;
+
+typedef struct ip330RecordHeader {
+    char magic[8];
+    epicsUInt32 version;
+    epicsUInt32 headerSize;
+    epicsUInt32 recordSize;
+    epicsInt32 firstChan;
+    epicsInt32 nChans;
+    epicsUInt32 segment;
+    epicsUInt32 maxScans;
+    volatile epicsUInt32 nScans;
+    volatile epicsUInt32 nCalibrations;
+    epicsUInt32 spare;
+    double zero;
+    double span;
+    double scanPeriod;
+    char port[64];
+    ip330RecordCalibration calibration[IP330_RECORD_MAX_CALIBRATIONS];
+} ip330RecordHeader;
+
+typedef struct ip330RecordScan {
+    epicsUInt32 secPastEpoch;
+    epicsUInt32 nsec;
+    epicsUInt32 generation;
+    epicsUInt32 sequence;
+    epicsUInt32 flags;
+} ip330RecordScan;
+
+/* Size of a record with nChans raw values, a multiple of 4 bytes */
+#define IP330_RECORD_SIZE(nChans) \
+    ((sizeof(ip330RecordScan) + 2*(nChans) + 3) & ~(size_t)3)
+
+typedef struct ip330Recorder ip330Recorder;
+
+/* Create a recorder and start its writer thread.  Segments are written to
+ * directory as <name>_<start time>_<segment>.ip330, segmentScans scans
+ * each.  zero and span are the ADC range, scanPeriod is recorded in the
+ * header.  Returns NULL on error, or if the OS has no memory mapped files. */
+ip330Recorder *ip330RecorderCreate(const char *name, const char *directory,
+                                   int firstChan, int nChans,
+                                   double zero, double span,
+                                   double scanPeriod, int segmentScans);
+
+/* Called by the scan path, these never block.  The calibration of a
+ * generation must be put before the first scan that uses it.  They return
+ * -1 if the ring was full and the entry was dropped. */
+int ip330RecorderCalibration(ip330Recorder *pRec,
+                             const ip330RecordCalibration *pCal);
+int ip330RecorderPut(ip330Recorder *pRec, const epicsUInt16 *data,
+                     const epicsTimeStamp *pTime, epicsUInt32 generation,
+                     epicsUInt32 flags);
+
+/* Called by the scan path after its last put.  The writer thread writes
+ * what is left in the ring, closes the segment and exits.  The recorder
+ * keeps its statistics for ip330RecorderReport. */
+void ip330RecorderClose(ip330Recorder *pRec);
+
+/* Free a recorder, once the scan path no longer uses it.  Closes it if
+ * that was not done, and waits for the writer thread to finish. */
+void ip330RecorderDestroy(ip330Recorder *pRec);
+
+void ip330RecorderReport(ip330Recorder *pRec, FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ip330RecorderH */
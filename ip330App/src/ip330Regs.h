@@ -0,0 +1,70 @@
+/* ip330Regs.h
+
+    Register block of the Acromag IP330 ADC.
+    Shared by the driver and the simulated carrier in ip330Sim.c.
+*/
+
+#ifndef ip330RegsH
+#define ip330RegsH
+
+#define MAX_IP330_CHANNELS 32
+
+/* Control register bits */
+#define CTL_OUTPUT_SHIFT              1
+#define CTL_OUTPUT_MASK             0x0002
+#define CTL_OUTPUT_TWOS_COMPLEMENT  0x0000
+#define CTL_OUTPUT_STRAIGHT_BINARY  0x0002
+
+#define CTL_TRIGGER_SHIFT             2
+#define CTL_TRIGGER_MASK            0x0004
+#define CTL_TRIGGER_INPUT           0x0000
+#define CTL_TRIGGER_OUTPUT          0x0004
+
+#define CTL_INPUT_SHIFT               3
+#define CTL_INPUT_MASK              0x0038
+#define CTL_INPUT_DIFFERENTIAL      0x0000
+#define CTL_INPUT_SINGLE_ENDED      0x0008
+#define CTL_INPUT_4900MV            0x0018
+#define CTL_INPUT_2450MV            0x0020
+#define CTL_INPUT_1225MV            0x0028
+#define CTL_INPUT_612MV             0x0030
+#define CTL_INPUT_AUTO_ZERO         0x0038
+
+#define CTL_SCAN_SHIFT                8
+#define CTL_SCAN_MASK               0x0700
+#define CTL_SCAN_DISABLE            0x0000
+#define CTL_SCAN_UNIFORM_CONTINUOUS 0x0100
+#define CTL_SCAN_UNIFORM_SINGLE     0x0200
+#define CTL_SCAN_BURST_CONTINUOUS   0x0300
+#define CTL_SCAN_BURST_SINGLE       0x0400
+#define CTL_SCAN_EXTERNAL           0x0500
+
+#define CTL_TIMER_SHIFT              11
+#define CTL_TIMER_MASK              0x0800
+#define CTL_TIMER_DISABLE           0x0000
+#define CTL_TIMER_ENABLE            0x0800
+
+#define CTL_INTERRUPT_SHIFT          12
+#define CTL_INTERRUPT_MASK          0x3000
+#define CTL_INTERRUPT_DISABLE       0x0000
+#define CTL_INTERRUPT_AFTER_EACH    0x1000
+#define CTL_INTERRUPT_AFTER_ALL     0x2000
+
+#define DISABLE_SCAN_AND_INTERRUPT ~(CTL_SCAN_MASK | CTL_INTERRUPT_MASK) 
+
+typedef struct ip330ADCregs {
+    unsigned short control;
+    unsigned char timePrescale;
+    unsigned char intVector;
+    unsigned short conversionTime;
+    unsigned char endChanVal;
+    unsigned char startChanVal;
+    unsigned short newData[2];
+    unsigned short missedData[2];
+    unsigned short startConvert;
+    unsigned char pad[0x0E];
+    unsigned char gain[MAX_IP330_CHANNELS];
+    unsigned short mailBox[MAX_IP330_CHANNELS];
+} ip330ADCregs;
+
+#endif /* ip330RegsH */
@@ -0,0 +1,337 @@
+/* ip330Sim.c
+
+    Simulated IP carrier with an IP330 ADC.  See ip330Sim.h.
+
+    The simulation thread polls the register block the way the card
+    would see bus writes.  A write of startConvert starts scanning in the
+    mode selected by the control register.  Scans are timed from the
+    prescale and conversion time registers, using the same 15 microseconds
+    per conversion as the driver.  If the thread falls behind it converts
+    the scans that are due back to back, so the average rate is right even
+    though the sleep resolution is coarse.  If it falls more than
+    SIM_MAX_LAG seconds behind the late scans are dropped and the
+    missedData bits are set.
+
+    Both interrupt modes raise one interrupt per scan.  newData bits are
+    cleared when the interrupt routine returns, or when a conversion is
+    started, since the simulation can not see reads of the mailbox.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsTime.h>
+#include <errlog.h>
+#include <cantProceed.h>
+#include <epicsString.h>
+
+#include "ip330Regs.h"
+#include "ip330Sim.h"
+
+#define CONVERSION_SECONDS 15.e-6
+#define SIM_POLL_SECONDS 0.0005
+#define SIM_MAX_LAG 0.1
+
+/* Gain and offset error of the simulated ADC, and noise in LSB */
+#define SIM_GAIN_ERROR 0.002
+#define SIM_OFFSET_ERROR 0.005
+#define SIM_NOISE_LSB 1.0
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+typedef enum {simSine, simStep, simNoise, simDC, simCount} simSignalType;
+
+struct ip330Sim {
+    struct ip330Sim *next;
+    char *name;
+    volatile ip330ADCregs *regs;
+    double zero;
+    double span;
+    simSignalType signal;
+    double amplitude;
+    double frequency;
+    void (*routine)(int parameter);
+    int parameter;
+    volatile int irqEnabled;
+    unsigned int seed;
+    epicsTimeStamp startTime;
+    int running;
+    int half;
+    double nextScan;
+    volatile unsigned long scans;
+    unsigned long interrupts;
+    unsigned long lostScans;
+    epicsTimeStamp scanTime[IP330_SIM_COUNT_MASK+1];
+    volatile int stopping;
+    epicsEventId stoppedEventId;
+};
+
+static ip330Sim *simList;
+
+static const double simGain[4] = {1.0, 2.0, 4.0, 8.0};
+
+static double simRandom(ip330Sim *pSim)
+{
+    pSim->seed = pSim->seed * 1103515245 + 12345;
+    return(((pSim->seed >> 8) & 0xffffff) / 16777216.);
+}
+
+static double simReference(int input)
+{
+    switch (input) {
+        case CTL_INPUT_4900MV: return(4.9);
+        case CTL_INPUT_2450MV: return(2.45);
+        case CTL_INPUT_1225MV: return(1.225);
+        case CTL_INPUT_612MV:  return(0.6125);
+        default:               return(0.);
+    }
+}
+
+static double simSignal(ip330Sim *pSim, int channel, double time)
+{
+    double phase = (double)channel / MAX_IP330_CHANNELS;
+    double code;
+
+    switch (pSim->signal) {
+        case simCount:
+            code = IP330_SIM_COUNT_BASE + IP330_SIM_COUNT_STEP *
+                   (double)(pSim->scans & IP330_SIM_COUNT_MASK);
+            return(pSim->zero + code / 65536. * pSim->span);
+        case simSine:
+            return(pSim->amplitude *
+                   sin(2. * M_PI * (pSim->frequency * time + phase)));
+        case simStep:
+            return(fmod(pSim->frequency * time + phase, 1.0) < 0.5 ?
+                   pSim->amplitude : -pSim->amplitude);
+        case simNoise:
+            return(pSim->amplitude * (2. * simRandom(pSim) - 1.));
+        case simDC:
+        default:
+            return(pSim->amplitude * (channel + 1) / MAX_IP330_CHANNELS);
+    }
+}
+
+/* Time for one scan with the current register settings */
+static double simScanPeriod(ip330Sim *pSim, unsigned short control)
+{
+    volatile ip330ADCregs *regs = pSim->regs;
+    int nChans = regs->endChanVal - regs->startChanVal + 1;
+    double timer = (regs->timePrescale * regs->conversionTime) / 8.e6;
+
+    if (nChans < 1) nChans = 1;
+    if (!(control & CTL_TIMER_ENABLE)) return(nChans * CONVERSION_SECONDS);
+    /* In uniform continuous mode the timer starts each conversion, in the
+     * other modes it starts each scan */
+    if ((control & CTL_SCAN_MASK) == CTL_SCAN_UNIFORM_CONTINUOUS)
+        return(nChans * (timer > CONVERSION_SECONDS ? timer : CONVERSION_SECONDS));
+    return(nChans * CONVERSION_SECONDS + timer);
+}
+
+static void simConvert(ip330Sim *pSim, unsigned short control, double time)
+{
+    volatile ip330ADCregs *regs = pSim->regs;
+    int input = control & CTL_INPUT_MASK;
+    int scan = control & CTL_SCAN_MASK;
+    /* In differential mode the continuous scan modes alternate between
+     * the two halves of the mailbox */
+    int pingPong = (input == CTL_INPUT_DIFFERENTIAL) &&
+                   ((scan == CTL_SCAN_UNIFORM_CONTINUOUS) ||
+                    (scan == CTL_SCAN_BURST_CONTINUOUS));
+    int first = regs->startChanVal;
+    int last = regs->endChanVal;
+    int chan, box;
+    unsigned short bit;
+    double volts, counts;
+    long code;
+
+    if (last >= MAX_IP330_CHANNELS) last = MAX_IP330_CHANNELS - 1;
+    for (chan=first; chan<=last; chan++) {
+        if ((input == CTL_INPUT_DIFFERENTIAL) || (input == CTL_INPUT_SINGLE_ENDED))
+            volts = simSignal(pSim, chan, time);
+        else
+            volts = simReference(input);
+        volts = volts * simGain[regs->gain[chan] & 3] * (1. + SIM_GAIN_ERROR) +
+                SIM_OFFSET_ERROR;
+        counts = (volts - pSim->zero) / pSim->span * 65536. +
+                 SIM_NOISE_LSB * (simRandom(pSim) - 0.5);
+        code = (long)floor(counts + 0.5);
+        if (code < 0) code = 0;
+        if (code > 65535) code = 65535;
+        if (!(control & CTL_OUTPUT_STRAIGHT_BINARY)) code ^= 0x8000;
+        box = pingPong ? (chan & 15) + 16 * pSim->half : chan;
+        regs->mailBox[box] = (unsigned short)code;
+        bit = 1 << (box & 15);
+        if (regs->newData[box / 16] & bit) regs->missedData[box / 16] |= bit;
+        regs->newData[box / 16] |= bit;
+    }
+    if (pingPong) pSim->half = !pSim->half;
+    epicsTimeGetCurrent(&pSim->scanTime[pSim->scans & IP330_SIM_COUNT_MASK]);
+    pSim->scans++;
+}
+
+static void simTask(ip330Sim *pSim)
+{
+    volatile ip330ADCregs *regs = pSim->regs;
+    unsigned short control;
+    int scan;
+    double now, period, delay;
+    long late;
+    epicsTimeStamp current;
+
+    while (!pSim->stopping) {
+        control = regs->control;
+        scan = control & CTL_SCAN_MASK;
+        epicsTimeGetCurrent(&current);
+        now = epicsTimeDiffInSeconds(&current, &pSim->startTime);
+        if (regs->startConvert) {
+            regs->startConvert = 0;
+            regs->newData[0] = regs->newData[1] = 0;
+            pSim->half = 0;
+            pSim->running = 1;
+            pSim->nextScan = now + simScanPeriod(pSim, control);
+        }
+        if ((scan == CTL_SCAN_DISABLE) || (scan == CTL_SCAN_EXTERNAL))
+            pSim->running = 0;
+        if (pSim->running && (now >= pSim->nextScan)) {
+            period = simScanPeriod(pSim, control);
+            if (now - pSim->nextScan > SIM_MAX_LAG) {
+                late = (long)((now - pSim->nextScan) / period);
+                pSim->lostScans += late;
+                pSim->nextScan += late * period;
+                /* The card would have kept alternating mailbox halves */
+                if (late & 1) pSim->half = !pSim->half;
+                regs->missedData[0] = regs->missedData[1] = 0xffff;
+            }
+            simConvert(pSim, control, pSim->nextScan);
+            pSim->nextScan += period;
+            if ((scan == CTL_SCAN_UNIFORM_SINGLE) ||
+                (scan == CTL_SCAN_BURST_SINGLE))
+                pSim->running = 0;
+            if ((control & CTL_INTERRUPT_MASK) && pSim->irqEnabled &&
+                pSim->routine) {
+                pSim->interrupts++;
+                pSim->routine(pSim->parameter);
+                regs->newData[0] = regs->newData[1] = 0;
+            }
+            continue;
+        }
+        delay = SIM_POLL_SECONDS;
+        if (pSim->running && (pSim->nextScan - now < delay))
+            delay = pSim->nextScan - now;
+        epicsThreadSleep(delay);
+    }
+    epicsEventSignal(pSim->stoppedEventId);
+}
+
+ip330Sim *ip330SimCreate(const char *name, double zero, double span,
+                         const char *signalString)
+{
+    ip330Sim *pSim;
+    char type[16];
+    double amplitude = 1.0;
+    double frequency = 10.0;
+    simSignalType signal;
+
+    if (!signalString || (sscanf(signalString, "%15s %lf %lf",
+                                 type, &amplitude, &frequency) < 1)) {
+        strcpy(type, "sine");
+    }
+    if (strcmp(type, "sine") == 0) {
+        signal = simSine;
+    } else if (strcmp(type, "step") == 0) {
+        signal = simStep;
+    } else if (strcmp(type, "noise") == 0) {
+        signal = simNoise;
+    } else if (strcmp(type, "dc") == 0) {
+        signal = simDC;
+    } else if (strcmp(type, "count") == 0) {
+        signal = simCount;
+    } else {
+        errlogPrintf("ip330SimCreate illegal signal \"%s\". Must be sine, "
+                     "step, noise, dc or count\n", type);
+        return(NULL);
+    }
+    pSim = callocMustSucceed(1, sizeof(*pSim), "ip330SimCreate");
+    pSim->regs = callocMustSucceed(1, sizeof(ip330ADCregs), "ip330SimCreate");
+    pSim->name = epicsStrDup(name);
+    pSim->zero = zero;
+    pSim->span = span;
+    pSim->signal = signal;
+    pSim->amplitude = amplitude;
+    pSim->frequency = frequency;
+    pSim->seed = 1;
+    pSim->stoppedEventId = epicsEventMustCreate(epicsEventEmpty);
+    epicsTimeGetCurrent(&pSim->startTime);
+    pSim->next = simList;
+    simList = pSim;
+    /* Below the dispatch workers, so that the simulation does not starve
+     * the threads it is feeding */
+    if (epicsThreadCreate("ip330Sim",
+                          epicsThreadPriorityHigh - 1,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)simTask,
+                          pSim) == NULL) {
+        errlogPrintf("ip330SimCreate epicsThreadCreate failure\n");
+        return(NULL);
+    }
+    return(pSim);
+}
+
+void *ip330SimRegs(ip330Sim *pSim)
+{
+    return((void *)pSim->regs);
+}
+
+void ip330SimIntConnect(ip330Sim *pSim, void (*routine)(int parameter),
+                        int parameter)
+{
+    pSim->parameter = parameter;
+    pSim->routine = routine;
+}
+
+void ip330SimIrqEnable(ip330Sim *pSim, int enable)
+{
+    pSim->irqEnabled = enable;
+}
+
+void ip330SimReport(ip330Sim *pSim, FILE *fp)
+{
+    fprintf(fp, "    simulated %s, scans=%lu, interrupts=%lu, lost scans=%lu\n",
+            pSim->name, pSim->scans, pSim->interrupts, pSim->lostScans);
+}
+
+ip330Sim *ip330SimFind(const char *name)
+{
+    ip330Sim *pSim;
+
+    for (pSim=simList; pSim; pSim=pSim->next) {
+        if (strcmp(pSim->name, name) == 0) return(pSim);
+    }
+    return(NULL);
+}
+
+void ip330SimStop(ip330Sim *pSim)
+{
+    if (pSim->stopping) return;
+    pSim->stopping = 1;
+    epicsEventMustWait(pSim->stoppedEventId);
+}
+
+unsigned long ip330SimScans(ip330Sim *pSim)
+{
+    return(pSim->scans);
+}
+
+int ip330SimScanTime(ip330Sim *pSim, unsigned long scan, epicsTimeStamp *pTime)
+{
+    if ((scan >= pSim->scans) || (pSim->scans - scan > IP330_SIM_COUNT_MASK))
+        return(-1);
+    *pTime = pSim->scanTime[scan & IP330_SIM_COUNT_MASK];
+    return(0);
+}
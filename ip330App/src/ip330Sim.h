@@ -0,0 +1,69 @@
+/* ip330Sim.h
+
+    Simulated IP carrier with an IP330 ADC, so that the driver can run
+    without hardware.  The simulation emulates the ip330ADCregs block:
+    the control register, the prescale/conversion timer, startConvert,
+    the newData/missedData bits and both mailbox halves.  A thread converts
+    synthetic signals at the programmed rate and calls the interrupt
+    routine after each scan.
+
+    signalString selects the signal on every channel:
+        "sine <amplitude> <frequency>"   sine wave, phase shifted by channel
+        "step <amplitude> <frequency>"   square wave, shifted by channel
+        "noise <amplitude>"              uniform noise
+        "dc <amplitude>"                 constant, scaled by channel
+        "count"                          scan number, see below
+    Amplitudes are in volts and frequencies in Hz.  The calibration
+    references are converted with a small gain and offset error, so that
+    calibration has something to correct.
+
+    The count signal puts the scan number on every channel, so that a
+    client can tell which scan a value came from.  At gain 1 the corrected
+    value is IP330_SIM_COUNT_BASE + IP330_SIM_COUNT_STEP * (scan number
+    & IP330_SIM_COUNT_MASK), to within a few counts.  ip330SimScanTime
+    returns the time at which the interrupt for a recent scan was raised.
+*/
+
+#ifndef ip330SimH
+#define ip330SimH
+
+#include <stdio.h>
+
+#include <epicsTime.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IP330_SIM_COUNT_BASE 1024
+#define IP330_SIM_COUNT_STEP 15
+#define IP330_SIM_COUNT_MASK 0xfff
+
+typedef struct ip330Sim ip330Sim;
+
+/* zero and span are the ADC input range in volts at gain 1 */
+ip330Sim *ip330SimCreate(const char *name, double zero, double span,
+                         const char *signalString);
+void *ip330SimRegs(ip330Sim *pSim);
+void ip330SimIntConnect(ip330Sim *pSim, void (*routine)(int parameter),
+                        int parameter);
+void ip330SimIrqEnable(ip330Sim *pSim, int enable);
+void ip330SimReport(ip330Sim *pSim, FILE *fp);
+/* Stop the simulation thread for good.  The registers keep their values
+ * and no more scans or interrupts happen, as for a card which is not
+ * scanning. */
+void ip330SimStop(ip330Sim *pSim);
+/* Find the simulation created with this name, NULL if none */
+ip330Sim *ip330SimFind(const char *name);
+/* Number of scans converted so far */
+unsigned long ip330SimScans(ip330Sim *pSim);
+/* Time of a scan.  Returns -1 if the scan is not one of the last
+ * IP330_SIM_COUNT_MASK+1 scans. */
+int ip330SimScanTime(ip330Sim *pSim, unsigned long scan,
+                     epicsTimeStamp *pTime);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ip330SimH */
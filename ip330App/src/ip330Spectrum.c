@@ -0,0 +1,151 @@
+/* ip330Spectrum.c
+
+    Spectral estimation for the IP330 driver.  See ip330Spectrum.h.
+
+    The FFT is an iterative radix-2 complex transform with the twiddle
+    factors and the bit reversal computed once for the block size.  The
+    real block is transformed as the imaginary part zero, which costs a
+    factor of 2 over a packed real transform but keeps the code simple;
+    the spectra are computed on a low priority thread.
+*/
+
+#include <stdlib.h>
+#include <math.h>
+
+#include <cantProceed.h>
+
+#include "drvIp330.h"
+#include "ip330Spectrum.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct ip330Spectrum {
+    int size;
+    int bits;
+    double *window;
+    double windowSum;
+    double windowSumSquares;
+    double *cosTable;
+    double *sinTable;
+    int *reverse;
+    double *re;
+    double *im;
+};
+
+static double windowValue(int window, int i, int n)
+{
+    double x = 2. * M_PI * i / n;
+
+    switch (window) {
+        case ip330WindowHann:
+            return(0.5 - 0.5*cos(x));
+        case ip330WindowBlackmanHarris:
+            return(0.35875 - 0.48829*cos(x) + 0.14128*cos(2*x) -
+                   0.01168*cos(3*x));
+        case ip330WindowFlatTop:
+            return(0.21557895 - 0.41663158*cos(x) + 0.277263158*cos(2*x) -
+                   0.083578947*cos(3*x) + 0.006947368*cos(4*x));
+        case ip330WindowRectangular:
+        default:
+            return(1.0);
+    }
+}
+
+ip330Spectrum *ip330SpectrumCreate(int size, int window)
+{
+    ip330Spectrum *pSpectrum;
+    int i, j, bits;
+
+    for (bits=0; (1 << bits) < size; bits++);
+    if ((size < 2) || ((1 << bits) != size)) return(NULL);
+    pSpectrum = callocMustSucceed(1, sizeof(*pSpectrum), "ip330SpectrumCreate");
+    pSpectrum->size = size;
+    pSpectrum->bits = bits;
+    pSpectrum->window = callocMustSucceed(size, sizeof(double), "ip330SpectrumCreate");
+    pSpectrum->cosTable = callocMustSucceed(size/2, sizeof(double), "ip330SpectrumCreate");
+    pSpectrum->sinTable = callocMustSucceed(size/2, sizeof(double), "ip330SpectrumCreate");
+    pSpectrum->reverse = callocMustSucceed(size, sizeof(int), "ip330SpectrumCreate");
+    pSpectrum->re = callocMustSucceed(size, sizeof(double), "ip330SpectrumCreate");
+    pSpectrum->im = callocMustSucceed(size, sizeof(double), "ip330SpectrumCreate");
+    for (i=0; i<size; i++) {
+        /* Periodic windows, so that overlapped blocks add up evenly */
+        pSpectrum->window[i] = windowValue(window, i, size);
+        pSpectrum->windowSum += pSpectrum->window[i];
+        pSpectrum->windowSumSquares += pSpectrum->window[i] * pSpectrum->window[i];
+        for (j=0; j<bits; j++)
+            if (i & (1 << j)) pSpectrum->reverse[i] |= 1 << (bits - 1 - j);
+    }
+    for (i=0; i<size/2; i++) {
+        pSpectrum->cosTable[i] = cos(2. * M_PI * i / size);
+        pSpectrum->sinTable[i] = -sin(2. * M_PI * i / size);
+    }
+    return(pSpectrum);
+}
+
+void ip330SpectrumDestroy(ip330Spectrum *pSpectrum)
+{
+    if (!pSpectrum) return;
+    free(pSpectrum->window);
+    free(pSpectrum->cosTable);
+    free(pSpectrum->sinTable);
+    free(pSpectrum->reverse);
+    free(pSpectrum->re);
+    free(pSpectrum->im);
+    free(pSpectrum);
+}
+
+int ip330SpectrumPoints(const ip330Spectrum *pSpectrum)
+{
+    return(pSpectrum->size/2 + 1);
+}
+
+void ip330SpectrumAdd(ip330Spectrum *pSpectrum, const double *block,
+                      double *power)
+{
+    int n = pSpectrum->size;
+    double *re = pSpectrum->re;
+    double *im = pSpectrum->im;
+    int half, step, i, j, k;
+    double tr, ti, wr, wi;
+
+    for (i=0; i<n; i++) {
+        re[pSpectrum->reverse[i]] = block[i] * pSpectrum->window[i];
+        im[pSpectrum->reverse[i]] = 0.;
+    }
+    for (half=1, step=n/2; half<n; half*=2, step/=2) {
+        for (i=0; i<n; i+=2*half) {
+            for (j=0, k=0; j<half; j++, k+=step) {
+                wr = pSpectrum->cosTable[k];
+                wi = pSpectrum->sinTable[k];
+                tr = wr*re[i+j+half] - wi*im[i+j+half];
+                ti = wr*im[i+j+half] + wi*re[i+j+half];
+                re[i+j+half] = re[i+j] - tr;
+                im[i+j+half] = im[i+j] - ti;
+                re[i+j] += tr;
+                im[i+j] += ti;
+            }
+        }
+    }
+    for (i=0; i<=n/2; i++) power[i] += re[i]*re[i] + im[i]*im[i];
+}
+
+void ip330SpectrumFinish(const ip330Spectrum *pSpectrum, const double *power,
+                         int nBlocks, double sampleRate, double *magnitude,
+                         double *psd)
+{
+    int n = pSpectrum->size;
+    double mean, scale;
+    int i;
+
+    for (i=0; i<=n/2; i++) {
+        mean = power[i] / nBlocks;
+        scale = ((i == 0) || (i == n/2)) ? 1.0 : 2.0;
+        if (magnitude)
+            magnitude[i] = sqrt(scale * mean /
+                                (pSpectrum->windowSum * pSpectrum->windowSum));
+        if (psd)
+            psd[i] = scale * mean / (sampleRate * pSpectrum->windowSumSquares);
+    }
+}
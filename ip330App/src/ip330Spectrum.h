@@ -0,0 +1,46 @@
+/* ip330Spectrum.h
+
+    Spectral estimation for the IP330 driver.
+
+    ip330SpectrumAdd windows a block of samples, transforms it with a
+    radix-2 FFT and adds the squared magnitude of each frequency to a
+    running sum.  ip330SpectrumFinish turns the sum over a number of blocks
+    into a one-sided amplitude spectrum and a Welch power spectral density:
+        magnitude[k] = sqrt(c[k] * P[k] / S1^2)      RMS units
+        psd[k]       = c[k] * P[k] / (fs * S2)       units^2/Hz
+    where P[k] is the mean squared magnitude, S1 and S2 are the sum and the
+    sum of squares of the window, fs is the sample rate, and c[k] is 2
+    except for DC and the Nyquist frequency, where it is 1.
+*/
+
+#ifndef ip330SpectrumH
+#define ip330SpectrumH
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ip330Spectrum ip330Spectrum;
+
+/* size must be a power of 2, window is an ip330WindowType */
+ip330Spectrum *ip330SpectrumCreate(int size, int window);
+void ip330SpectrumDestroy(ip330Spectrum *pSpectrum);
+
+/* Number of frequencies, size/2 + 1 */
+int ip330SpectrumPoints(const ip330Spectrum *pSpectrum);
+
+/* Add the squared magnitudes of one block of size samples to power */
+void ip330SpectrumAdd(ip330Spectrum *pSpectrum, const double *block,
+                      double *power);
+
+/* Convert the power of nBlocks blocks, sampled at sampleRate, to
+ * magnitude and psd.  Either output may be NULL. */
+void ip330SpectrumFinish(const ip330Spectrum *pSpectrum, const double *power,
+                         int nBlocks, double sampleRate, double *magnitude,
+                         double *psd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ip330SpectrumH */